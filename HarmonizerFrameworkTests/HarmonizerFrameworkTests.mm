@@ -119,7 +119,6 @@ static float audioValue(int k, float trueT) {
     }];
 }
 
-
 - (void)testPitch {
     float T = 0;
     for (int k = 0; k < 4; k++)
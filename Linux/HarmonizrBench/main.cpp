@@ -0,0 +1,567 @@
+//
+//  main.cpp
+//  HarmonizrBench
+//
+//  Deadline benchmark: drives HarmonizerDSPKernel the way a host's audio
+//  callback does, on a SCHED_FIFO thread woken once per block period, and
+//  measures each callback against the time it actually has. Throughput
+//  averages hide the occasional late callback; this counts them.
+//
+//  usage: harmonizr-bench [-r rates] [-b blocks] [-s seconds] [-d deadline] [-f]
+//                         [-P priority] [-C cpu] [-e engine] [-q tier] [-a analysis]
+//                         [-v notes] [-i input.wav] [-M events.txt]
+//
+//      -r  sample rates, comma separated (default 44100,48000,96000)
+//      -b  block sizes in frames, comma separated
+//          (default 16,32,64,128,256,512,1024,2048,4096)
+//      -s  seconds measured per rate and block size (default 5), after half
+//          a second of warm-up
+//      -d  deadline as a fraction of the block period (default 1). A callback
+//          that finishes later than that after its scheduled start, wake-up
+//          latency included, is an xrun
+//      -f  free-running: callbacks back to back instead of paced in real
+//          time; quicker, but nothing else gets the core between callbacks
+//      -P  SCHED_FIFO priority (default 80); without the privilege for it the
+//          run goes on at normal priority and says so
+//      -C  pin the callback thread to this CPU
+//      -e  psola (default) or spectral
+//      -q  grain reads: linear, cubic (default) or sinc
+//      -a  pitch analysis: inline (default), sliced or threaded
+//      -v  MIDI notes held per chord in the script (default 8)
+//      -i  loop this file's first channel as the input instead of the
+//          synthetic voice
+//      -M  also send these MIDI events, in the renderer's format
+//          (seconds status data1 data2 per line)
+//
+//  The script runs on the callback thread between blocks, as a host would
+//  deliver it: a new chord every half second with CC11 riding on it, the
+//  sustain pedal every two seconds, a key change every one and a half, a
+//  program change every three, and the gains and correction strength
+//  automated on every callback. The synthetic voice sings phrases with
+//  gaps, so the gate opens and closes too.
+//
+//  Callback times go into log-spaced histograms (about 5% per bucket), so
+//  the percentiles are bucket upper edges.
+//
+//  Exit status is 0 when no configuration had an xrun, 1 otherwise.
+//
+//  build:
+//      c++ -std=c++17 -O2 -pthread -I../../Shared main.cpp -o harmonizr-bench
+//
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "HarmonizerDSPKernel.hpp"
+#include "WavFile.hpp"
+
+typedef struct midi_msg_s
+{
+    size_t frame;
+    uint8_t data[3];
+} midi_msg_t;
+
+typedef struct bench_options_s
+{
+    std::vector<int> rates;
+    std::vector<int> blocks;
+    double seconds;
+    double deadline;
+    int free_running;
+    int priority;
+    int cpu;
+    int algorithm;
+    int interpolation;
+    int analysis;
+    int notes;
+    const char * input;
+    const char * midi;
+} bench_options_t;
+
+// ---- histogram ----
+
+// callback times from 0.1 us to 10 s, 50 buckets per decade
+class LatencyHistogram {
+public:
+    static const int per_decade = 50;
+    static const int nbuckets = 8 * per_decade;
+
+    void clear()
+    {
+        memset(counts, 0, sizeof(counts));
+        n = 0;
+        sum = 0;
+        max = 0;
+    }
+
+    void add(double us)
+    {
+        int b = (int) ((log10(std::max(us, 0.1)) + 1) * per_decade);
+        counts[std::min(b, nbuckets - 1)]++;
+        n++;
+        sum += us;
+        max = std::max(max, us);
+    }
+
+    // upper edge of the bucket holding the q-th fraction of callbacks
+    double percentile(double q) const
+    {
+        uint64_t target = (uint64_t) ceil(q * n);
+        uint64_t seen = 0;
+        for (int b = 0; b < nbuckets; b++)
+        {
+            seen += counts[b];
+            if (seen >= target && seen > 0)
+                return std::min(max, pow(10.0, (double) (b + 1) / per_decade - 1));
+        }
+        return max;
+    }
+
+    double mean() const { return n ? sum / n : 0; }
+    double maximum() const { return max; }
+    uint64_t count() const { return n; }
+
+private:
+    uint64_t counts[nbuckets];
+    uint64_t n = 0;
+    double sum = 0;
+    double max = 0;
+};
+
+// ---- one configuration ----
+
+typedef struct bench_run_s
+{
+    HarmonizerDSPKernel * kernel;
+    const bench_options_t * opt;
+    int rate;
+    int block;
+    const float * input;            // the whole run, warm-up included
+    size_t frames;
+    size_t warmup;
+    const std::vector<midi_msg_t> * events;
+
+    LatencyHistogram compute;       // start to finish of each callback
+    LatencyHistogram late;          // scheduled start to actual start
+    uint64_t xruns;
+} bench_run_t;
+
+static void midi(HarmonizerDSPKernel & k, uint8_t status, uint8_t d1, uint8_t d2)
+{
+    uint8_t msg[3] = {status, d1, d2};
+    k.handleMIDIMessage(msg, (status & 0xF0) == 0xC0 ? 2 : 3);
+}
+
+// true when a multiple of period falls in [pos, pos + n)
+static bool crosses(size_t pos, int n, size_t period)
+{
+    return pos % period == 0 || pos / period != (pos + n - 1) / period;
+}
+
+// the host's side of one callback: events and automation for the block at pos
+static void script(bench_run_t & run, size_t pos, int n, size_t & ev)
+{
+    HarmonizerDSPKernel & k = *run.kernel;
+    size_t rate = (size_t) run.rate;
+    int notes = run.opt->notes;
+
+    size_t chord_period = rate / 2;
+    if (crosses(pos, n, chord_period))
+    {
+        int chord = (int) ((pos + n - 1) / chord_period);
+        for (int j = 0; j < notes; j++)
+            midi(k, 0x80, (uint8_t) (36 + ((chord - 1) * 7 + j * 5) % 48), 0);
+        for (int j = 0; j < notes; j++)
+            midi(k, 0x90, (uint8_t) (36 + (chord * 7 + j * 5) % 48), (uint8_t) (60 + j * 7 % 60));
+    }
+    midi(k, 0xB0, 11, (uint8_t) ((pos / 256) & 0x7F));
+    if (crosses(pos, n, rate * 2))
+        midi(k, 0xB0, 64, ((pos + n - 1) / (rate * 2)) & 1 ? 127 : 0);
+    if (crosses(pos, n, rate * 3))
+        midi(k, 0xC0, (uint8_t) (((pos + n - 1) / (rate * 3)) % (HarmPresetModes + 1)), 0);
+    if (crosses(pos, n, rate * 3 / 2))
+        k.setParameter(HarmParamKeycenter, (float) (((pos + n - 1) / (rate * 3 / 2) * 7) % (12 * CHORD_KEY_NQUALITIES)));
+
+    float lfo = 0.5f + 0.5f * sinf(2 * M_PI * 0.2 * pos / rate);
+    k.setParameter(HarmParamHgain, 0.5f + lfo);
+    k.setParameter(HarmParamVgain, 1.5f - lfo);
+    k.setParameter(HarmParamDryMix, lfo);
+    k.setParameter(HarmParamAutoStrength, lfo);
+
+    const std::vector<midi_msg_t> & events = *run.events;
+    while (ev < events.size() && events[ev].frame < pos + n)
+    {
+        k.handleMIDIMessage(events[ev].data, (events[ev].data[0] & 0xF0) == 0xC0 ? 2 : 3);
+        ev++;
+    }
+}
+
+static double elapsed_us(const timespec & a, const timespec & b)
+{
+    return (b.tv_sec - a.tv_sec) * 1e6 + (b.tv_nsec - a.tv_nsec) * 1e-3;
+}
+
+static void advance(timespec & t, double ns)
+{
+    long long total = (long long) t.tv_nsec + (long long) ns;
+    t.tv_sec += total / 1000000000LL;
+    t.tv_nsec = total % 1000000000LL;
+}
+
+static void * callback_thread(void * arg)
+{
+    bench_run_t & run = *(bench_run_t *) arg;
+    int n = run.block;
+    double period_ns = 1e9 * n / run.rate;
+    double deadline_us = run.opt->deadline * period_ns / 1000;
+
+    std::vector<float> out_l(n), out_r(n);
+    float * outs[2] = {out_l.data(), out_r.data()};
+
+    run.compute.clear();
+    run.late.clear();
+    run.xruns = 0;
+    size_t ev = 0;
+
+    timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    for (size_t pos = 0; pos + n <= run.frames; pos += n)
+    {
+        if (!run.opt->free_running)
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+        timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+
+        float * ins[2] = {(float *) run.input + pos, (float *) run.input + pos};
+        run.kernel->setBuffers(ins, outs);
+        script(run, pos, n, ev);
+        run.kernel->process(n, 0);
+        run.kernel->midiOut().clear();
+
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+
+        double late_us = run.opt->free_running ? 0 : std::max(0.0, elapsed_us(next, t0));
+        double compute_us = elapsed_us(t0, t1);
+        if (pos >= run.warmup)
+        {
+            run.compute.add(compute_us);
+            run.late.add(late_us);
+            if (late_us + compute_us > deadline_us)
+                run.xruns++;
+        }
+
+        // after an overrun, pick the schedule up from now like a host's next cycle would
+        advance(next, period_ns);
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (elapsed_us(next, now) > 0)
+            next = now;
+    }
+    return NULL;
+}
+
+// on a SCHED_FIFO thread if we may, otherwise at normal priority; false if neither starts
+static bool run_on_thread(bench_run_t & run, bool & realtime)
+{
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        bool fifo = attempt == 0;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if (fifo)
+        {
+            sched_param sp = {};
+            sp.sched_priority = run.opt->priority;
+            pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+            pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+            pthread_attr_setschedparam(&attr, &sp);
+        }
+        if (run.opt->cpu >= 0)
+        {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(run.opt->cpu, &set);
+            pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+        }
+
+        pthread_t thread;
+        int err = pthread_create(&thread, &attr, callback_thread, &run);
+        pthread_attr_destroy(&attr);
+        if (err == 0)
+        {
+            pthread_join(thread, NULL);
+            realtime = fifo;
+            return true;
+        }
+        if (!fifo || err != EPERM)
+        {
+            fprintf(stderr, "can't start the callback thread: %s\n", strerror(err));
+            return false;
+        }
+    }
+    return false;
+}
+
+// ---- input ----
+
+// phrases of a sung line with vibrato, a second and a half on and half a second off
+static void synth_voice(std::vector<float> & x, int rate)
+{
+    double phase = 0;
+    for (size_t k = 0; k < x.size(); k++)
+    {
+        double t = (double) k / rate;
+        double in_phrase = fmod(t, 2.0);
+        if (in_phrase >= 1.5)
+        {
+            x[k] = 0;
+            continue;
+        }
+        static const int line[] = {0, 2, 4, 5, 7, 5, 4, 2};
+        int note = 55 + line[(int) (t * 4) % 8];
+        double f = 440 * pow(2.0, (note - 69) / 12.0) * (1 + 0.006 * sin(2 * M_PI * 5.5 * t));
+        phase += 2 * M_PI * f / rate;
+        double env = std::min(1.0, std::min(in_phrase, 1.5 - in_phrase) * 20);
+        x[k] = (float) (0.3 * env * (sin(phase) + 0.4 * sin(2 * phase) + 0.2 * sin(3 * phase)));
+    }
+}
+
+static bool load_input(const char * path, std::vector<float> & x)
+{
+    WavReader reader;
+    if (!reader.open(path) || reader.frames() == 0)
+        return false;
+
+    std::vector<float> file(reader.frames());
+    float * out[1] = {file.data()};
+    reader.read(0, file.size(), out, 1);
+    for (size_t k = 0; k < x.size(); k++)
+        x[k] = file[k % file.size()];
+    return true;
+}
+
+static bool load_midi(const char * path, int rate, std::vector<midi_msg_t> & events)
+{
+    FILE * fp = fopen(path, "r");
+    if (!fp)
+        return false;
+
+    char line[256];
+    while (fgets(line, sizeof(line), fp))
+    {
+        double t;
+        unsigned int d1, d2;
+        char st[16];
+        char * p = line;
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (*p == '#' || *p == '\n' || *p == 0)
+            continue;
+        if (sscanf(p, "%lf %15s %u %u", &t, st, &d1, &d2) != 4)
+            continue;
+
+        midi_msg_t m;
+        m.frame = (size_t) std::max(0.0, t * rate);
+        m.data[0] = (uint8_t) strtoul(st, NULL, 0);
+        m.data[1] = (uint8_t) d1;
+        m.data[2] = (uint8_t) d2;
+        events.push_back(m);
+    }
+    fclose(fp);
+
+    std::stable_sort(events.begin(), events.end(),
+                     [](const midi_msg_t & a, const midi_msg_t & b) { return a.frame < b.frame; });
+    return true;
+}
+
+// ---- options ----
+
+static std::vector<int> parse_list(const char * s)
+{
+    std::vector<int> v;
+    while (*s)
+    {
+        char * end;
+        long x = strtol(s, &end, 10);
+        if (end == s)
+            break;
+        if (x > 0)
+            v.push_back((int) x);
+        s = *end == ',' ? end + 1 : end;
+    }
+    return v;
+}
+
+static int pick(const char * s, const char * const * names, int count)
+{
+    for (int k = 0; k < count; k++)
+        if (!strcmp(s, names[k]))
+            return k;
+    return -1;
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: harmonizr-bench [-r rates] [-b blocks] [-s seconds] [-d deadline] [-f]\n"
+                    "                       [-P priority] [-C cpu] [-e engine] [-q tier] [-a analysis]\n"
+                    "                       [-v notes] [-i input.wav] [-M events.txt]\n");
+    exit(2);
+}
+
+int main(int argc, char ** argv)
+{
+    static const char * const engines[] = {"psola", "interp", "spectral"};
+    static const char * const tiers[] = {"linear", "cubic", "sinc"};
+    static const char * const analyses[] = {"inline", "sliced", "threaded"};
+
+    bench_options_t opt;
+    opt.rates = {44100, 48000, 96000};
+    opt.blocks = {16, 32, 64, 128, 256, 512, 1024, 2048, 4096};
+    opt.seconds = 5;
+    opt.deadline = 1;
+    opt.free_running = 0;
+    opt.priority = 80;
+    opt.cpu = -1;
+    opt.algorithm = AlgorithmPSOLA;
+    opt.interpolation = InterpCubic;
+    opt.analysis = AnalysisInline;
+    opt.notes = 8;
+    opt.input = NULL;
+    opt.midi = NULL;
+
+    for (int k = 1; k < argc; k++)
+    {
+        const char * a = argv[k];
+        const char * v = k + 1 < argc ? argv[k + 1] : NULL;
+        if (!strcmp(a, "-f"))
+        {
+            opt.free_running = 1;
+            continue;
+        }
+        if (a[0] != '-' || !v)
+            usage();
+        k++;
+
+        if (!strcmp(a, "-r"))
+            opt.rates = parse_list(v);
+        else if (!strcmp(a, "-b"))
+            opt.blocks = parse_list(v);
+        else if (!strcmp(a, "-s"))
+            opt.seconds = std::max(0.1, atof(v));
+        else if (!strcmp(a, "-d"))
+            opt.deadline = std::max(0.01, atof(v));
+        else if (!strcmp(a, "-P"))
+            opt.priority = std::max(1, std::min(99, atoi(v)));
+        else if (!strcmp(a, "-C"))
+            opt.cpu = atoi(v);
+        else if (!strcmp(a, "-e"))
+            opt.algorithm = pick(v, engines, 3);
+        else if (!strcmp(a, "-q"))
+            opt.interpolation = pick(v, tiers, 3);
+        else if (!strcmp(a, "-a"))
+            opt.analysis = pick(v, analyses, 3);
+        else if (!strcmp(a, "-v"))
+            opt.notes = std::max(0, std::min(16, atoi(v)));
+        else if (!strcmp(a, "-i"))
+            opt.input = v;
+        else if (!strcmp(a, "-M"))
+            opt.midi = v;
+        else
+            usage();
+    }
+    if (opt.rates.empty() || opt.blocks.empty() || opt.algorithm < 0 || opt.interpolation < 0 || opt.analysis < 0)
+        usage();
+
+    // page faults on the callback thread would be measured as the kernel's
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+        fprintf(stderr, "mlockall failed (%s), page faults may show up as latency\n", strerror(errno));
+
+    printf("%s, %s, %s analysis, %d-note chords, deadline %.0f%% of the period, %s\n",
+           engines[opt.algorithm], tiers[opt.interpolation], analyses[opt.analysis], opt.notes,
+           opt.deadline * 100, opt.free_running ? "free-running" : "paced");
+    printf("%6s %5s %9s %6s %8s %8s %8s %8s %9s %12s\n",
+           "rate", "block", "period", "load", "p50", "p99", "p99.9", "max", "late max", "xruns");
+
+    bool any_xruns = false;
+    bool warned = false;
+    for (int rate : opt.rates)
+    {
+        size_t warmup = (size_t) (rate / 2);
+        size_t frames = warmup + (size_t) (opt.seconds * rate) + 4096;
+        std::vector<float> input(frames);
+        if (!opt.input || !load_input(opt.input, input))
+        {
+            if (opt.input)
+                fprintf(stderr, "%s: can't read, using the synthetic voice\n", opt.input);
+            synth_voice(input, rate);
+        }
+
+        std::vector<midi_msg_t> events;
+        if (opt.midi && !load_midi(opt.midi, rate, events))
+            fprintf(stderr, "%s: can't read MIDI events\n", opt.midi);
+
+        for (int block : opt.blocks)
+        {
+            HarmonizerDSPKernel * kernel = new HarmonizerDSPKernel();
+            kernel->init(2, rate);
+            kernel->reset();
+            kernel->setPreset(HarmPresetMIDI);
+            kernel->setParameter(HarmParamAlgorithm, opt.algorithm);
+            kernel->setInterpolation(opt.interpolation);
+            kernel->setAnalysisMode(opt.analysis);
+
+            bench_run_t * run = new bench_run_t();
+            run->kernel = kernel;
+            run->opt = &opt;
+            run->rate = rate;
+            run->block = block;
+            run->input = input.data();
+            run->frames = frames - 4096 + block > frames ? frames : frames - 4096 + block;
+            run->warmup = warmup;
+            run->events = &events;
+
+            bool realtime = false;
+            if (!run_on_thread(*run, realtime))
+                return 1;
+            if (!realtime && !warned)
+            {
+                fprintf(stderr, "no SCHED_FIFO (needs CAP_SYS_NICE or an rtprio limit), running at normal priority\n");
+                warned = true;
+            }
+
+            double period_us = 1e6 * block / rate;
+            char xruns[32];
+            snprintf(xruns, sizeof(xruns), "%llu/%llu",
+                     (unsigned long long) run->xruns, (unsigned long long) run->compute.count());
+            printf("%6d %5d %7.1fus %5.1f%% %6.1fus %6.1fus %6.1fus %6.1fus %7.1fus %12s\n",
+                   rate, block, period_us, 100 * run->compute.mean() / period_us,
+                   run->compute.percentile(0.5), run->compute.percentile(0.99), run->compute.percentile(0.999),
+                   run->compute.maximum(), run->late.maximum(), xruns);
+            fflush(stdout);
+            any_xruns |= run->xruns > 0;
+
+            // drain what the run queued for the host
+            harm_event_t ev;
+            while (kernel->eventChannel().poll(ev))
+                ;
+            kernel->fini();
+            delete kernel;
+            delete run;
+        }
+    }
+
+    return any_xruns ? 1 : 0;
+}
@@ -0,0 +1,59 @@
+//
+//  BoundedQueue.hpp
+//  Harmonizer
+//
+//  Fixed-capacity blocking queue connecting the stages of a render job.
+//  push() blocks while the queue is full, which is what keeps a fast reader
+//  from running arbitrarily far ahead of the DSP stage.
+//
+
+#ifndef BoundedQueue_hpp
+#define BoundedQueue_hpp
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity_) : capacity(capacity_) {}
+
+    void push(T item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_full.wait(lock, [this] { return items.size() < capacity; });
+        items.push_back(std::move(item));
+        not_empty.notify_one();
+    }
+
+    // returns false once the queue is closed and drained
+    bool pop(T & item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty.wait(lock, [this] { return !items.empty() || closed; });
+        if (items.empty())
+            return false;
+        item = std::move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        not_empty.notify_all();
+    }
+
+private:
+    size_t capacity;
+    bool closed = false;
+    std::deque<T> items;
+    std::mutex mutex;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+};
+
+#endif /* BoundedQueue_hpp */
@@ -0,0 +1,113 @@
+//
+//  WorkStealingPool.hpp
+//  Harmonizer
+//
+//  A small work-stealing thread pool for whole-file render jobs.
+//  Every worker owns a deque: it takes work from the front of its own and,
+//  when that runs dry, steals from the back of the others. Submitting the
+//  longest jobs first therefore runs them first and leaves the short ones
+//  for thieves to even out the tail. Jobs are long (seconds to minutes), so
+//  a mutex per deque costs nothing measurable.
+//
+
+#ifndef WorkStealingPool_hpp
+#define WorkStealingPool_hpp
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class WorkStealingPool {
+public:
+    typedef std::function<void(int worker)> task_t;
+
+    explicit WorkStealingPool(int nworkers)
+    {
+        if (nworkers < 1)
+            nworkers = 1;
+        for (int w = 0; w < nworkers; w++)
+            queues.emplace_back(new worker_queue_t);
+    }
+
+    int size() const { return (int) queues.size(); }
+
+    // distribute before run(); tasks are dealt round-robin in submission order
+    void submit(task_t task)
+    {
+        worker_queue_t & q = *queues[next++ % queues.size()];
+        std::lock_guard<std::mutex> lock(q.mutex);
+        q.tasks.push_back(std::move(task));
+        pending++;
+    }
+
+    // run every submitted task and return when all have finished
+    void run()
+    {
+        std::vector<std::thread> threads;
+        for (int w = 0; w < size(); w++)
+            threads.emplace_back(&WorkStealingPool::work, this, w);
+        for (auto & t : threads)
+            t.join();
+    }
+
+    unsigned int steals() const { return nsteals; }
+
+private:
+    typedef struct worker_queue_s
+    {
+        std::mutex mutex;
+        std::deque<task_t> tasks;
+    } worker_queue_t;
+
+    std::vector<std::unique_ptr<worker_queue_t>> queues;
+    std::atomic<int> pending{0};
+    std::atomic<unsigned int> nsteals{0};
+    size_t next = 0;
+
+    bool take(int w, task_t & task)
+    {
+        worker_queue_t & q = *queues[w];
+        std::lock_guard<std::mutex> lock(q.mutex);
+        if (q.tasks.empty())
+            return false;
+        task = std::move(q.tasks.front());
+        q.tasks.pop_front();
+        return true;
+    }
+
+    bool steal(int w, task_t & task)
+    {
+        int n = size();
+        for (int k = 1; k < n; k++)
+        {
+            worker_queue_t & q = *queues[(w + k) % n];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            if (q.tasks.empty())
+                continue;
+            task = std::move(q.tasks.back());
+            q.tasks.pop_back();
+            nsteals++;
+            return true;
+        }
+        return false;
+    }
+
+    void work(int w)
+    {
+        task_t task;
+        // jobs never spawn jobs, so an empty sweep means we're done
+        while (pending > 0)
+        {
+            if (!take(w, task) && !steal(w, task))
+                break;
+            task(w);
+            pending--;
+        }
+    }
+};
+
+#endif /* WorkStealingPool_hpp */
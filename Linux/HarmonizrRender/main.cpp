@@ -0,0 +1,576 @@
+//
+//  main.cpp
+//  HarmonizrRender
+//
+//  Offline batch renderer: runs one HarmonizerDSPKernel per output file
+//  across all cores.
+//
+//  usage: harmonizr-render [-j threads] [-b blockframes] [-p bank] [-q tier] [-a] [-c] [-f] jobs.txt
+//
+//      -a  two-pass: analyze each whole file first (OfflineAnalysis.hpp),
+//          with the preset's threshold, then synthesize from the precomputed
+//          pitch track
+//      -c  like -a, but keep the analysis in a sidecar next to each input
+//          (input.wav.pitch) and reuse it while the audio and analysis
+//          settings are unchanged
+//      -f  fan-out: lines that share an input become one job. The input is
+//          read and analyzed once and feeds one synthesis kernel per line,
+//          each writing its own output (implies -a). The analysis uses the
+//          first line's preset threshold for all of them
+//      -p  take presets from this PresetBank file instead of the factory set
+//      -q  grain read quality: linear, cubic (the default, as live) or sinc
+//
+//  Each non-empty line of the job list is
+//
+//      input.wav output.wav [preset=N] [key=K] [midi=events.txt] [engine=E]
+//
+//  where N is a program number or a preset name in the bank,
+//  K is a kernel key center (0-71) or a name such as C, F#m, Bb7, Ddor,
+//  Gmix or Ahm (harmonic minor), and E is psola (the default) or spectral.
+//  A MIDI event list holds one channel message per line,
+//
+//      seconds status data1 data2      e.g.  1.25 0x90 60 100
+//
+//  Every job is a three-stage pipeline: a reader thread converts blocks from
+//  the mmap'd input, the pool worker runs the job's kernels, and a writer
+//  thread appends float32 stereo output. The stages trade a fixed set of blocks
+//  through bounded queues, so disk I/O overlaps compute without the reader
+//  running away from the DSP.
+//
+//  build:
+//      c++ -std=c++17 -O2 -pthread -I../../Shared main.cpp -o harmonizr-render
+//
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "HarmonizerDSPKernel.hpp"
+#include "OfflineAnalysis.hpp"
+#include "PitchTrackCache.hpp"
+#include "WavFile.hpp"
+
+#include "BoundedQueue.hpp"
+#include "WorkStealingPool.hpp"
+
+typedef struct midi_msg_s
+{
+    size_t frame;
+    uint8_t data[3];
+} midi_msg_t;
+
+// one output: a synthesis kernel with its own settings
+typedef struct render_target_s
+{
+    std::string output;
+    int preset;
+    std::string preset_name;
+    int key;
+    int algorithm;
+    std::string midi;
+    std::vector<midi_msg_t> events;
+    bool ok;
+} render_target_t;
+
+typedef struct render_job_s
+{
+    std::string input;
+    WavReader reader;
+    std::vector<render_target_t> targets;
+    bool cache_hit;
+    double seconds;     // wall time spent on this job
+} render_job_t;
+
+typedef struct block_s
+{
+    std::vector<float> in;
+    std::vector<float> out;     // two channels per target, block_frames each
+    size_t start;
+    size_t frames;
+} block_t;
+
+typedef struct render_options_s
+{
+    int block_frames;
+    int two_pass;
+    int use_cache;
+    int fan_out;
+    int analysis_threads;
+    const PresetBank * bank;
+    int interpolation;
+} render_options_t;
+
+static const int pipeline_depth = 8;
+
+static int parse_key(const char * s)
+{
+    static const int letters[] = {9, 11, 0, 2, 4, 5, 7}; // A B C D E F G
+
+    if (*s >= '0' && *s <= '9')
+        return clamp(atoi(s), 0, 12 * CHORD_KEY_NQUALITIES - 1);
+
+    char c = (char) toupper(*s);
+    if (c < 'A' || c > 'G')
+        return -1;
+    int root = letters[c - 'A'];
+    s++;
+
+    if (*s == '#') { root++; s++; }
+    else if (*s == 'b') { root--; s++; }
+    root = (root + 12) % 12;
+
+    int quality = CHORD_KEY_MAJOR;
+    if (strncmp(s, "dor", 3) == 0)
+        quality = CHORD_KEY_DORIAN;
+    else if (strncmp(s, "mix", 3) == 0)
+        quality = CHORD_KEY_MIXOLYDIAN;
+    else if (strncmp(s, "hm", 2) == 0)
+        quality = CHORD_KEY_HARMONIC_MINOR;
+    else if (*s == 'm')
+        quality = CHORD_KEY_MINOR;
+    else if (*s == '7')
+        quality = CHORD_KEY_DOM;
+
+    return root + 12 * quality;
+}
+
+static bool load_midi(render_target_t & target, int sample_rate)
+{
+    FILE * fp = fopen(target.midi.c_str(), "r");
+    if (!fp)
+        return false;
+
+    char line[256];
+    while (fgets(line, sizeof(line), fp))
+    {
+        double t;
+        unsigned int status, d1, d2;
+        char * p = line;
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (*p == '#' || *p == '\n' || *p == 0)
+            continue;
+
+        char st[16];
+        if (sscanf(p, "%lf %15s %u %u", &t, st, &d1, &d2) != 4)
+            continue;
+        status = (unsigned int) strtoul(st, NULL, 0);
+
+        midi_msg_t m;
+        m.frame = (size_t) std::max(0.0, t * sample_rate);
+        m.data[0] = (uint8_t) status;
+        m.data[1] = (uint8_t) d1;
+        m.data[2] = (uint8_t) d2;
+        target.events.push_back(m);
+    }
+    fclose(fp);
+
+    std::stable_sort(target.events.begin(), target.events.end(),
+                     [](const midi_msg_t & a, const midi_msg_t & b) { return a.frame < b.frame; });
+    return true;
+}
+
+static bool parse_jobs(const char * path, int fan_out, std::vector<std::unique_ptr<render_job_t>> & jobs)
+{
+    FILE * fp = fopen(path, "r");
+    if (!fp)
+        return false;
+
+    char line[4096];
+    int lineno = 0;
+    while (fgets(line, sizeof(line), fp))
+    {
+        lineno++;
+        std::vector<std::string> tok;
+        for (char * t = strtok(line, " \t\r\n"); t; t = strtok(NULL, " \t\r\n"))
+            tok.push_back(t);
+        if (tok.empty() || tok[0][0] == '#')
+            continue;
+        if (tok.size() < 2)
+        {
+            fprintf(stderr, "%s:%d: expected input and output\n", path, lineno);
+            continue;
+        }
+
+        render_target_t target;
+        target.output = tok[1];
+        target.preset = -1;
+        target.key = -1;
+        target.algorithm = AlgorithmPSOLA;
+        target.ok = false;
+
+        for (size_t k = 2; k < tok.size(); k++)
+        {
+            const std::string & t = tok[k];
+            if (t.compare(0, 7, "preset=") == 0)
+            {
+                if (isdigit((unsigned char) t[7]))
+                    target.preset = atoi(t.c_str() + 7);
+                else
+                    target.preset_name = t.substr(7);
+            }
+            else if (t.compare(0, 4, "key=") == 0)
+                target.key = parse_key(t.c_str() + 4);
+            else if (t.compare(0, 5, "midi=") == 0)
+                target.midi = t.substr(5);
+            else if (t == "engine=psola")
+                target.algorithm = AlgorithmPSOLA;
+            else if (t == "engine=spectral")
+                target.algorithm = AlgorithmSpectral;
+            else
+                fprintf(stderr, "%s:%d: ignoring '%s'\n", path, lineno, t.c_str());
+        }
+
+        render_job_t * job = NULL;
+        if (fan_out)
+        {
+            for (auto & j : jobs)
+            {
+                if (j->input == tok[0])
+                    job = j.get();
+            }
+        }
+
+        if (!job)
+        {
+            std::unique_ptr<render_job_t> j(new render_job_t());
+            j->input = tok[0];
+            j->cache_hit = false;
+            j->seconds = 0;
+            if (!j->reader.open(j->input.c_str()))
+            {
+                fprintf(stderr, "%s: can't open or not a PCM wav file\n", j->input.c_str());
+                continue;
+            }
+            job = j.get();
+            jobs.push_back(std::move(j));
+        }
+
+        if (!target.midi.empty() && !load_midi(target, job->reader.format().sample_rate))
+        {
+            fprintf(stderr, "%s: can't read MIDI events\n", target.midi.c_str());
+            continue;
+        }
+        job->targets.push_back(std::move(target));
+    }
+    fclose(fp);
+
+    // drop inputs whose every line was rejected
+    jobs.erase(std::remove_if(jobs.begin(), jobs.end(),
+                              [](const std::unique_ptr<render_job_t> & j) { return j->targets.empty(); }),
+               jobs.end());
+    return true;
+}
+
+// run one target's kernel over a block, split at MIDI events so they land on their sample
+static void render_block(HarmonizerDSPKernel & kernel, render_target_t & target, size_t & ev,
+                         block_t & b, float * out_l, float * out_r)
+{
+    size_t done = 0;
+    while (done < b.frames)
+    {
+        size_t now = b.start + done;
+        while (ev < target.events.size() && target.events[ev].frame <= now)
+        {
+            kernel.handleMIDIMessage(target.events[ev].data, 3);
+            ev++;
+        }
+
+        size_t n = b.frames - done;
+        if (ev < target.events.size() && target.events[ev].frame < now + n)
+            n = target.events[ev].frame - now;
+
+        float * in[2] = {b.in.data() + done, b.in.data() + done};
+        float * out[2] = {out_l + done, out_r + done};
+        kernel.setBuffers(in, out);
+        kernel.process((frame_count_t) n, 0);
+        done += n;
+    }
+}
+
+static void render(render_job_t & job, const render_options_t & opt)
+{
+    int block_frames = opt.block_frames;
+    auto t0 = std::chrono::steady_clock::now();
+
+    const wav_format_t & fmt = job.reader.format();
+    size_t ntargets = job.targets.size();
+
+    std::vector<WavWriter> writers(ntargets);
+    std::vector<std::unique_ptr<HarmonizerDSPKernel>> kernels;
+    std::vector<size_t> next_event(ntargets, 0);
+
+    // every output first, so a failure leaves no kernel to tear down
+    for (size_t t = 0; t < ntargets; t++)
+    {
+        if (!writers[t].open(job.targets[t].output.c_str(), 2, fmt.sample_rate))
+        {
+            fprintf(stderr, "%s: can't create\n", job.targets[t].output.c_str());
+            return;
+        }
+    }
+
+    for (size_t t = 0; t < ntargets; t++)
+    {
+        render_target_t & target = job.targets[t];
+        std::unique_ptr<HarmonizerDSPKernel> kernel(new HarmonizerDSPKernel());
+        kernel->init(2, fmt.sample_rate);
+        kernel->reset();
+        const PresetBank & bank = opt.bank ? *opt.bank : HarmonizerDSPKernel::factoryBank();
+        int program = target.preset_name.empty() ? target.preset : bank.find(target.preset_name.c_str());
+        if (const harm_preset_t * p = bank.preset(program))
+            kernel->applyPreset(*p);
+        else if (program >= 0 || !target.preset_name.empty())
+            fprintf(stderr, "%s: no such preset, using the defaults\n", target.output.c_str());
+        if (target.key >= 0)
+            kernel->setParameter(HarmParamKeycenter, target.key);
+        kernel->setParameter(HarmParamAlgorithm, target.algorithm);
+        kernel->setInterpolation(opt.interpolation);
+        kernels.push_back(std::move(kernel));
+    }
+
+    // analysis front end: shared by every target of this job
+    PitchTrackBuffer analysis;
+    PitchTrackCache cache;
+    pitch_track_t track;
+    if (opt.two_pass || opt.use_cache || ntargets > 1)
+    {
+        OfflineAnalysis pass1;
+        pass1.sampleRate = fmt.sample_rate;
+        pass1.nthreads = opt.analysis_threads;
+
+        // the voicing threshold the presets asked for; one analysis can only use one
+        pass1.threshold = kernels[0]->getParameter(HarmParamThreshold);
+        for (size_t t = 1; t < ntargets; t++)
+        {
+            if (kernels[t]->getParameter(HarmParamThreshold) != pass1.threshold)
+            {
+                fprintf(stderr, "%s: presets disagree on the analysis threshold, using %s's\n",
+                        job.input.c_str(), job.targets[0].output.c_str());
+                break;
+            }
+        }
+
+        std::string cache_path = PitchTrackCache::sidecarPath(job.input);
+        uint64_t key = 0;
+        if (opt.use_cache)
+        {
+            key = PitchTrackCache::key(job.reader.dataBytes(), job.reader.dataSize(),
+                                       fmt.sample_rate, fmt.channels, fmt.bits,
+                                       pass1.threshold, pass1.hop, pass1.maxT, pass1.nmed);
+            job.cache_hit = cache.open(cache_path.c_str(), key);
+        }
+
+        if (job.cache_hit)
+        {
+            track = cache.track();
+        }
+        else
+        {
+            pass1.analyze([&](size_t start, size_t n, float * x) {
+                float * out[1] = {x};
+                return job.reader.read(start, n, out, 1);
+            }, job.reader.frames(), analysis);
+            track = analysis.view();
+
+            if (opt.use_cache && !PitchTrackCache::write(cache_path.c_str(), key, analysis))
+                fprintf(stderr, "%s: can't write analysis cache\n", cache_path.c_str());
+        }
+
+        for (auto & kernel : kernels)
+            kernel->setPitchTrack(&track);
+    }
+
+    std::vector<block_t> blocks(pipeline_depth);
+    BoundedQueue<block_t *> free_blocks(pipeline_depth);
+    BoundedQueue<block_t *> filled(pipeline_depth);
+    BoundedQueue<block_t *> rendered(pipeline_depth);
+
+    for (block_t & b : blocks)
+    {
+        b.in.resize(block_frames);
+        b.out.resize(2 * ntargets * block_frames);
+        free_blocks.push(&b);
+    }
+
+    std::thread reader_thread([&] {
+        size_t pos = 0;
+        block_t * b;
+        while (pos < job.reader.frames() && free_blocks.pop(b))
+        {
+            float * out[1] = {b->in.data()};
+            b->start = pos;
+            b->frames = job.reader.read(pos, block_frames, out, 1);
+            pos += b->frames;
+            filled.push(b);
+        }
+        filled.close();
+    });
+
+    std::vector<char> write_ok(ntargets, 1);
+    std::thread writer_thread([&] {
+        block_t * b;
+        while (rendered.pop(b))
+        {
+            for (size_t t = 0; t < ntargets; t++)
+            {
+                const float * out[2] = {&b->out[(2*t) * block_frames], &b->out[(2*t + 1) * block_frames]};
+                write_ok[t] = writers[t].write(out, b->frames) && write_ok[t];
+            }
+            free_blocks.push(b);
+        }
+        free_blocks.close();
+    });
+
+    block_t * b;
+    while (filled.pop(b))
+    {
+        for (size_t t = 0; t < ntargets; t++)
+        {
+            render_block(*kernels[t], job.targets[t], next_event[t], *b,
+                         &b->out[(2*t) * block_frames], &b->out[(2*t + 1) * block_frames]);
+        }
+        rendered.push(b);
+    }
+    rendered.close();
+
+    reader_thread.join();
+    writer_thread.join();
+
+    for (size_t t = 0; t < ntargets; t++)
+    {
+        kernels[t]->fini();
+        writers[t].close();
+        job.targets[t].ok = write_ok[t];
+    }
+
+    job.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: harmonizr-render [-j threads] [-b blockframes] [-p bank] [-q tier] [-a] [-c] [-f] jobs.txt\n");
+    exit(1);
+}
+
+int main(int argc, char ** argv)
+{
+    int nthreads = (int) std::thread::hardware_concurrency();
+    render_options_t opt = {4096, 0, 0, 0, 1, NULL, InterpCubic};
+    PresetBank user_bank;
+    const char * joblist = NULL;
+
+    for (int k = 1; k < argc; k++)
+    {
+        if (!strcmp(argv[k], "-j") && k + 1 < argc)
+            nthreads = atoi(argv[++k]);
+        else if (!strcmp(argv[k], "-b") && k + 1 < argc)
+            opt.block_frames = std::max(64, atoi(argv[++k]));
+        else if (!strcmp(argv[k], "-p") && k + 1 < argc)
+        {
+            if (!user_bank.open(argv[++k]))
+            {
+                fprintf(stderr, "%s: not a preset bank\n", argv[k]);
+                return 1;
+            }
+            opt.bank = &user_bank;
+        }
+        else if (!strcmp(argv[k], "-q") && k + 1 < argc)
+        {
+            const char * tier = argv[++k];
+            if (!strcmp(tier, "linear"))
+                opt.interpolation = InterpLinear;
+            else if (!strcmp(tier, "cubic"))
+                opt.interpolation = InterpCubic;
+            else if (!strcmp(tier, "sinc"))
+                opt.interpolation = InterpSinc;
+            else
+                usage();
+        }
+        else if (!strcmp(argv[k], "-a"))
+            opt.two_pass = 1;
+        else if (!strcmp(argv[k], "-c"))
+            opt.use_cache = 1;
+        else if (!strcmp(argv[k], "-f"))
+            opt.fan_out = 1;
+        else if (argv[k][0] == '-')
+            usage();
+        else
+            joblist = argv[k];
+    }
+    if (!joblist)
+        usage();
+
+    std::vector<std::unique_ptr<render_job_t>> jobs;
+    if (!parse_jobs(joblist, opt.fan_out, jobs))
+    {
+        fprintf(stderr, "%s: can't read job list\n", joblist);
+        return 1;
+    }
+    if (jobs.empty())
+    {
+        fprintf(stderr, "nothing to render\n");
+        return 1;
+    }
+
+    // most work first, so the long stems don't end up starting last
+    std::stable_sort(jobs.begin(), jobs.end(),
+                     [](const std::unique_ptr<render_job_t> & a, const std::unique_ptr<render_job_t> & b) {
+                         return a->reader.duration() * a->targets.size() > b->reader.duration() * b->targets.size();
+                     });
+
+    // build shared tables before the workers race for them
+    ChordTable::shared();
+    HarmonizerDSPKernel::factoryBank();
+
+    WorkStealingPool pool(std::min(nthreads, (int) jobs.size()));
+
+    // with fewer jobs than cores, the analysis pass can use the spare ones
+    opt.analysis_threads = std::max(1, nthreads / pool.size());
+
+    for (auto & job : jobs)
+    {
+        render_job_t * j = job.get();
+        pool.submit([j, &opt](int) { render(*j, opt); });
+    }
+
+    auto t0 = std::chrono::steady_clock::now();
+    pool.run();
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+    double audio = 0;
+    int failed = 0;
+    size_t outputs = 0;
+    for (auto & job : jobs)
+    {
+        double dur = job->reader.duration();
+        for (auto & target : job->targets)
+        {
+            outputs++;
+            if (target.ok)
+            {
+                audio += dur;
+                printf("%-40s %8.1fs audio %7.2fs wall %6.1fx realtime%s\n",
+                       target.output.c_str(), dur, job->seconds, job->seconds > 0 ? dur / job->seconds : 0.0,
+                       job->cache_hit ? " (cached analysis)" : "");
+            }
+            else
+            {
+                printf("%-40s FAILED\n", target.output.c_str());
+                failed++;
+            }
+        }
+    }
+
+    printf("\n%zu outputs from %zu jobs on %d threads (%u steals): %.2f audio hours in %.1fs wall = %.1f audio-hours per wall-hour\n",
+           outputs, jobs.size(), pool.size(), pool.steals(), audio / 3600.0, wall, wall > 0 ? audio / wall : 0.0);
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,736 @@
+//
+//  main.cpp
+//  KernelTests
+//
+//  Tests for the Shared kernel and the headers it is built from. The XCTest
+//  target builds against the harmonizr-dsp kernel, which has a different
+//  init, none of the preset, spectrum, voicing or analysis-mode API, and
+//  types of its own under some of the same names, so nothing from Shared can
+//  be imported next to it. Anything that needs a live Shared kernel or one
+//  of its parts runs here instead, along with the looper storage cases that
+//  depend on what its spill thread does in between.
+//
+//  usage: harmonizr-kernel-tests [name ...]
+//
+//      with names, runs only the tests whose names contain one of them
+//
+//  Exit status is 0 when every check passed, 1 otherwise.
+//
+//  build:
+//      c++ -std=c++17 -O2 -pthread -I../../Shared main.cpp -o harmonizr-kernel-tests
+//
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "HarmonizerDSPKernel.hpp"
+
+// ---- checks ----
+
+static int failures = 0;
+
+static void fail(const char * file, int line, const char * what)
+{
+    fprintf(stderr, "%s:%d: check failed: %s\n", file, line, what);
+    failures++;
+}
+
+#define CHECK(cond) do { if (!(cond)) fail(__FILE__, __LINE__, #cond); } while (0)
+#define CHECK_CLOSE(a, b, eps) do { if (!(fabs((double) (a) - (double) (b)) <= (eps))) fail(__FILE__, __LINE__, #a " ~ " #b); } while (0)
+
+static std::string temp_path(const char * name)
+{
+    const char * dir = getenv("TMPDIR");
+    return std::string(dir ? dir : "/tmp") + "/" + name + "." + std::to_string(getpid());
+}
+
+// ---- tests ----
+
+static void test_ramps()
+{
+    // a linear ramp starts where the value was and lands on the goal on time
+    ParameterRamper lin(0.25f);
+    lin.setUIValue(0.75f);
+    lin.dezipperCheck(100);
+    CHECK(lin.isRamping() && lin.goal() == 0.75f);
+    CHECK(lin.getAndStep() == 0.25f);
+    for (int k = 1; k < 100; k++)
+        lin.step();
+    CHECK(!lin.isRamping() && lin.get() == 0.75f);
+
+    // an exponential fade to zero gets there exactly, through the floor, never below
+    ParameterRamper fade(1.f, ParameterRamper::Exponential);
+    fade.startRamp(0.f, 1000);
+    CHECK_CLOSE(fade.get(), 1, 1e-6);
+    float last = 2, lowest = 1;
+    for (int k = 0; k < 1000; k++)
+    {
+        float v = fade.getAndStep();
+        CHECK(v < last);
+        last = v;
+        lowest = std::min(lowest, v);
+    }
+    CHECK(lowest >= 0 && fade.get() == 0.f);
+
+    // and halfway is the geometric mean with the floor taken in, not 0.5
+    ParameterRamper rise(0.f, ParameterRamper::Exponential);
+    rise.startRamp(1.f, 1000);
+    CHECK_CLOSE(rise.get(), 0, 1e-6);
+    rise.stepBy(500);
+    CHECK_CLOSE(rise.get(), sqrt(1e-3 * (1 + 1e-3)) - 1e-3, 1e-5);
+
+    // getBlock writes the same curve as stepping a sample at a time, then holds the goal
+    for (ParameterRamper::Shape shape : {ParameterRamper::Linear, ParameterRamper::Exponential})
+    {
+        ParameterRamper a(0.1f, shape), b(0.1f, shape);
+        a.startRamp(1.5f, 300);
+        b.startRamp(1.5f, 300);
+        std::vector<float> block(512);
+        a.getBlock(block.data(), 256);
+        a.getBlock(block.data() + 256, 256);
+        for (int k = 0; k < 512; k++)
+            CHECK_CLOSE(block[k], b.getAndStep(), 1e-4);
+        CHECK(block[511] == 1.5f && !a.isRamping());
+    }
+}
+
+static void test_gate()
+{
+    // a sung note, then hiss under the gate, then another note
+    HarmonizerDSPKernel kernel;
+    kernel.init(2, 44100);
+    kernel.reset();
+
+    const int n = 256, second = 44100 / n;
+    float in[n], l[n], r[n];
+    float * ins[2] = {in, in}, * outs[2] = {l, r};
+    kernel.setBuffers(ins, outs);
+    double phase = 0;
+    auto sing = [&](float f) {
+        for (int k = 0; k < n; k++)
+        {
+            in[k] = 0.3f * sinf(phase);
+            phase += 2 * M_PI * f / 44100;
+        }
+    };
+
+    for (int b = 0; b < second; b++)
+    {
+        sing(220);
+        kernel.process(n, 0);
+    }
+    CHECK(kernel.midi_note_number == 57);
+    CHECK(kernel.silentFrames() == 0);
+
+    // -80 dB against the default -60 dB gate: the grains ring out, then exact zeros
+    int first_silent = -1, nonzero = 0;
+    for (int b = 0; b < second; b++)
+    {
+        for (int k = 0; k < n; k++)
+            in[k] = 1e-4f * ((k & 1) ? 1 : -1);
+        kernel.process(n, 0);
+        if (kernel.silentFrames() >= (unsigned int) n)
+        {
+            if (first_silent < 0)
+                first_silent = b;
+            for (int k = 0; k < n; k++)
+                nonzero += l[k] != 0.f || r[k] != 0.f;
+        }
+    }
+    CHECK(first_silent >= 0 && first_silent < second / 2);
+    CHECK(kernel.silentFrames() == (unsigned int) (second - first_silent) * n);
+    CHECK(nonzero == 0);
+
+    // tracking picks up again once the gate reopens
+    for (int b = 0; b < second; b++)
+    {
+        sing(330);
+        kernel.process(n, 0);
+    }
+    CHECK(kernel.silentFrames() == 0);
+    CHECK(kernel.midi_note_number == 64);
+    kernel.fini();
+}
+
+static void test_preset_bank()
+{
+    // a user bank round trip, looked up by name and applied through a program change
+    HarmonizerDSPKernel kernel;
+    kernel.init(2, 44100);
+
+    std::vector<harm_preset_t> presets(1000);
+    for (int k = 0; k < (int) presets.size(); k++)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "user %d", k);
+        kernel.setParameter(HarmParamKeycenter, k % 48);
+        kernel.setParameter(HarmParamInterval + 7, (k % 40) - 20);
+        kernel.capturePreset(presets[k], name);
+    }
+    std::string path = temp_path("test.hpbk");
+    CHECK(PresetBank::write(path.c_str(), presets.data(), (int) presets.size()));
+
+    PresetBank bank;
+    CHECK(bank.open(path.c_str()));
+    CHECK(bank.count() == 1000);
+    CHECK(bank.find("user 321") == 321 && bank.find("nobody") == -1);
+
+    kernel.setPresetBank(&bank);
+    uint8_t pc[2] = {0xC0, 77};
+    kernel.handleMIDIMessage(pc, 2);
+    CHECK(kernel.getParameter(HarmParamKeycenter) == 77 % 48);
+    CHECK(kernel.getParameter(HarmParamInterval + 7) == (77 % 40) - 20);
+
+    // the factory set is the same format
+    CHECK(HarmonizerDSPKernel::factoryBank().find("Modes") == HarmPresetModes);
+    kernel.setPresetBank(NULL);
+    kernel.fini();
+    bank.close();
+    unlink(path.c_str());
+}
+
+static void test_spectrum()
+{
+    // a 1 kHz sine shows up in the band that holds 1 kHz, near its level
+    HarmonizerDSPKernel kernel;
+    kernel.init(2, 44100);
+    kernel.reset();
+    kernel.enableSpectrum(true);
+
+    const int n = 512;
+    float in[n], l[n], r[n];
+    float * ins[2] = {in, in}, * outs[2] = {l, r};
+    kernel.setBuffers(ins, outs);
+    for (int b = 0; b < 60; b++)
+    {
+        for (int k = 0; k < n; k++)
+            in[k] = 0.5f * sinf(2 * M_PI * 1000 * (b * n + k) / 44100.f);
+        kernel.process(n, 0);
+    }
+
+    spectrum_t spec;
+    kernel.readSpectrum(spec);
+    CHECK(spec.hop > 0);
+    int loudest = 0;
+    for (int k = 1; k < SPECTRUM_BANDS; k++)
+        if (spec.db[k] > spec.db[loudest])
+            loudest = k;
+    float f0 = spec.fmin * powf(spec.fmax / spec.fmin, (float) loudest / SPECTRUM_BANDS);
+    float f1 = spec.fmin * powf(spec.fmax / spec.fmin, (float) (loudest + 1) / SPECTRUM_BANDS);
+    CHECK(f0 <= 1000 && 1000 <= f1);
+    CHECK_CLOSE(spec.db[loudest], -6, 2);
+    kernel.fini();
+}
+
+static void test_interval_addresses()
+{
+    // the kernel's legacy addresses land in the same table as the full ones
+    HarmonizerDSPKernel kernel;
+    kernel.init(2, 44100);
+    kernel.setParameter(HarmParamInterval + 48 * CHORD_KEY_MINOR + 4 * 2 + 3, 11);
+    CHECK(kernel.getParameter(HarmonizerDSPKernel::intervalAddress(CHORD_KEY_MINOR, 2, 3)) == 11);
+    kernel.setParameter(HarmonizerDSPKernel::intervalAddress(CHORD_KEY_DORIAN, 9, 7), -5);
+    CHECK(kernel.getParameter(HarmonizerDSPKernel::intervalAddress(CHORD_KEY_DORIAN, 9, 7)) == -5);
+    kernel.setParameter(HarmParamNvoices, 12);
+    CHECK(kernel.getParameter(HarmParamNvoices) == 8);
+    kernel.setParameter(HarmParamKeycenter, 12 * CHORD_KEY_HARMONIC_MINOR + 9);
+    CHECK(kernel.getParameter(HarmParamKeycenter) == 12 * CHORD_KEY_HARMONIC_MINOR + 9);
+    kernel.fini();
+}
+
+static void test_analysis_modes()
+{
+    // the steps add up to the whole pass, and every mode settles on the sung note
+    std::vector<float> x(1200);
+    for (int k = 0; k < 1200; k++)
+        x[k] = 0.3f * sinf(2 * M_PI * 220 * k / 44100.);
+
+    HarmonizerDSPKernel kernels[3];
+    kernels[0].init(2, 44100);
+    float whole = kernels[0].yin_period(x.data());
+    for (int step = 0; step < YinStepSearch; step++)
+        CHECK(kernels[0].yin_step(x.data(), step) == 0);
+    CHECK(kernels[0].yin_step(x.data(), YinStepSearch) == whole);
+    CHECK_CLOSE(whole, 44100 / 220.f, 1);
+
+    const int n = 32;
+    float in[n], out_l[n], out_r[n];
+    float * ins[2] = {in, in};
+    float * outs[2] = {out_l, out_r};
+    for (int m = 0; m < 3; m++)
+    {
+        HarmonizerDSPKernel & kernel = kernels[m];
+        if (m)
+            kernel.init(2, 44100);
+        kernel.reset();
+        kernel.setAnalysisMode(m);
+        kernel.setBuffers(ins, outs);
+        for (int b = 0; b < 44100 / n; b++)
+        {
+            for (int k = 0; k < n; k++)
+                in[k] = 0.3f * sinf(2 * M_PI * 220 * (b * n + k) / 44100.);
+            kernel.process(n, 0);
+        }
+        CHECK(kernel.midi_note_number == 57);
+        kernel.fini();
+    }
+}
+
+static void test_overdub_spill()
+{
+    // overdub into a chunk that was spilled, push it out again, and read it back
+    const char * dir = getenv("TMPDIR");
+    const size_t cf = LoopStorage::chunk_frames;
+    const int loop = 30, c = 5, n = 512;
+    LoopStorage store;
+    CHECK(store.open(dir ? dir : "/tmp", 1, 1, loop));
+
+    float buf[n];
+    const float * in[1] = {buf};
+    float * out[1] = {buf};
+    auto settle = [] { usleep(20000); };
+    settle();   // for the first fresh chunks
+
+    // a take of ones, far longer than the pool
+    for (int k = 0; k < n; k++)
+        buf[k] = 1;
+    for (size_t frame = 0; frame < loop * cf; frame += n)
+    {
+        store.setHead(frame, frame + n);
+        store.write(frame, in, 1, n, false);
+        usleep(200);
+    }
+    store.endRecording();
+    CHECK(store.overrunFrames() == 0);
+
+    // playback moves on, so chunk c isn't resident when the overdub reaches it
+    store.setHead(15 * cf, loop * cf);
+    settle();
+    store.write(c * cf, in, 1, n, true);
+    CHECK(store.overrunFrames() == (uint32_t) n);
+
+    // the spill thread reads it back with the overdub already under way
+    store.setHead(c * cf, loop * cf);
+    settle();
+    for (size_t frame = c * cf + n; frame < (c + 1) * cf; frame += n)
+        store.write(frame, in, 1, n, true);
+    CHECK(store.overrunFrames() == (uint32_t) n);
+    store.endRecording();
+
+    // once round the loop pushes chunk c out; then bring it back
+    for (int h = c + 1; h <= c + loop; h++)
+    {
+        store.setHead((h % loop) * cf, loop * cf);
+        settle();
+    }
+    store.setHead(c * cf, loop * cf);
+    settle();
+
+    uint32_t underruns = store.underrunFrames();
+    int wrong = 0;
+    for (size_t frame = c * cf; frame < (c + 1) * cf; frame += n)
+    {
+        memset(buf, 0, sizeof(buf));
+        store.read(frame, out, 1, n);
+        float want = frame < c * cf + n ? 1 : 2;    // the first block had nowhere to go
+        for (int k = 0; k < n; k++)
+            wrong += buf[k] != want;
+    }
+    CHECK(store.underrunFrames() == underruns);
+    CHECK(wrong == 0);
+    store.close();
+}
+
+static void test_chord_table()
+{
+    const ChordTable & t = ChordTable::shared();
+
+    // C E G
+    chord_info_t c = t.lookup(0x091);
+    CHECK(c.root == 0 && c.quality == CHORD_MAJOR && c.confidence == 1.0);
+
+    // A C E, any octave
+    c = t.lookup((1 << 9) | (1 << 0) | (1 << 4));
+    CHECK(c.root == 9 && c.key_quality == CHORD_KEY_MINOR);
+
+    // G B D F
+    c = t.lookup((1 << 7) | (1 << 11) | (1 << 2) | (1 << 5));
+    CHECK(c.root == 7 && c.quality == CHORD_DOM7 && c.key_quality == CHORD_KEY_DOM);
+
+    // a single note is not a chord
+    c = t.lookup(1 << 4);
+    CHECK(c.quality == CHORD_NONE);
+}
+
+static void test_fft_backends()
+{
+    const int n = 2048;
+    std::vector<float> x(n), y(n), re1(n/2+1), im1(n/2+1), re2(n/2+1), im2(n/2+1);
+    std::vector<float> work(FFTPlan::scratchSize(n));
+    for (int k = 0; k < n; k++)
+        x[k] = cos(k * 2 * M_PI / 117.2) + sin(k * 4 * M_PI / 117.2);
+
+    // builtin matches a direct DFT, unscaled
+    FFT::plan(n, FFTForward, FFTBackendBuiltin)->run(x.data(), re1.data(), im1.data(), work.data());
+    double worst = 0;
+    for (int j = 0; j <= n/2; j++)
+    {
+        double c = 0, s = 0;
+        for (int k = 0; k < n; k++)
+        {
+            c += x[k] * cos(2 * M_PI * j * k / n);
+            s -= x[k] * sin(2 * M_PI * j * k / n);
+        }
+        worst = std::max(worst, std::max(fabs(re1[j] - c), fabs(im1[j] - s)));
+    }
+    CHECK(worst < 1e-2);
+
+    // and every other backend built in agrees with it
+    const fft_backend_t others[] = {FFTBackendVDSP, FFTBackendKiss};
+    for (fft_backend_t backend : others)
+    {
+        if (!FFT::available(backend))
+            continue;
+        FFT::plan(n, FFTForward, backend)->run(x.data(), re2.data(), im2.data(), work.data());
+        for (int j = 0; j <= n/2; j++)
+            CHECK(fabs(re1[j] - re2[j]) < 1e-3 && fabs(im1[j] - im2[j]) < 1e-3);
+    }
+
+    // round trip comes back scaled by n
+    FFT::plan(n, FFTInverse, FFTBackendBuiltin)->run(y.data(), re1.data(), im1.data(), work.data());
+    worst = 0;
+    for (int k = 0; k < n; k++)
+        worst = std::max(worst, fabs(y[k] / n - x[k]));
+    CHECK(worst < 1e-4);
+
+    // plans are shared, and sizes that aren't a power of two get none
+    CHECK(FFT::plan(n, FFTForward) == FFT::plan(n, FFTForward));
+    CHECK(FFT::plan(1000, FFTForward) == NULL);
+}
+
+static void test_grain_scheduler()
+{
+    GrainScheduler s;
+    s.schedule(5, 30.0);
+    s.schedule(2, 10.0);
+    s.schedule(9, 20.0);
+    s.schedule(7, 10.0);
+    CHECK(s.topVoice() == 2 && s.topOnset() == 10.0);
+
+    // move one to the front, drop another
+    s.schedule(5, 1.0);
+    s.cancel(9);
+    CHECK(!s.scheduled(9));
+
+    CHECK(s.pop() == 5);
+    CHECK(s.pop() == 2);
+    CHECK(s.pop() == 7);
+    CHECK(s.empty());
+}
+
+static void test_looper_spill()
+{
+    // one second resident, a take several times that long
+    const char * dir = getenv("TMPDIR");
+    Looper looper;
+    const int n = 512;
+    CHECK(looper.open(dir ? dir : "/tmp", 1, 44100, n, 1.0));
+    usleep(20000);  // for the first fresh chunks
+
+    float buf[n];
+    float * out[1] = {buf};
+    const int nblocks = 4 * 44100 / n;
+
+    looper.setMode(LoopRec);
+    for (int b = 0; b < nblocks; b++)
+    {
+        for (int k = 0; k < n; k++)
+            buf[k] = (float) ((b * n + k) % 1000);
+        looper.process(out, n);
+        usleep(200);    // give the spill thread the time a real block would
+    }
+
+    looper.setMode(LoopPlay);
+    int wrong = 0;
+    for (int b = 0; b < nblocks; b++)
+    {
+        memset(buf, 0, sizeof(buf));
+        looper.process(out, n);
+        for (int k = 0; k < n; k++)
+            wrong += buf[k] != (float) ((b * n + k) % 1000);
+        usleep(200);
+    }
+    CHECK(wrong == 0);
+    CHECK(looper.store().underrunFrames() == 0 && looper.store().overrunFrames() == 0);
+    looper.close();
+}
+
+static void test_record_tap()
+{
+    // mix and dry stems through the ring, then read them back
+    RecordTap tap;
+    const int n = 512;
+    std::string prefix = temp_path("recordtap");
+    CHECK(tap.start(prefix.c_str(), RecordStemMix | RecordStemDry, 1, 0, 44100, n, 0.5));
+    CHECK(tap.channels() == 2);
+
+    float mix[n], dry[n];
+    const float * src[2] = {mix, dry};
+    const int nblocks = 2 * 44100 / n;
+    for (int b = 0; b < nblocks; b++)
+    {
+        for (int k = 0; k < n; k++)
+        {
+            mix[k] = (float) ((b * n + k) % 1000);
+            dry[k] = -mix[k];
+        }
+        CHECK(tap.begin());
+        tap.push(src, n);
+        tap.end();
+        usleep(200);
+    }
+    tap.stop();
+    CHECK(tap.overrunFrames() == 0 && tap.framesRecorded() == (uint64_t) nblocks * n);
+
+    WavReader r;
+    CHECK(r.open((prefix + "-dry.wav").c_str()));
+    CHECK(r.frames() == (size_t) nblocks * n);
+    std::vector<float> back(r.frames());
+    float * dst[1] = {back.data()};
+    r.read(0, r.frames(), dst, 1);
+    int wrong = 0;
+    for (size_t k = 0; k < back.size(); k++)
+        wrong += back[k] != -(float) (k % 1000);
+    CHECK(wrong == 0);
+
+    unlink((prefix + "-mix.wav").c_str());
+    unlink((prefix + "-dry.wav").c_str());
+}
+
+static void test_midi_note_out()
+{
+    MidiOutBuffer out;
+    MidiNoteOut notes(1, 2);
+
+    // a one-hop blip isn't sent, a held set is
+    int a[3] = {60, 64, 67}, b[3] = {60, 65, 69}, blip[1] = {61};
+    notes.update(0, blip, 1, 100, out);
+    notes.update(256, a, 3, 100, out);
+    CHECK(out.count() == 0);
+    notes.update(512, a, 3, 100, out);
+    CHECK(out.count() == 3 && out.event(0).frame == 512 && out.event(0).data[0] == 0x91);
+
+    // moving to the next chord only touches the notes that changed, offs first
+    out.clear();
+    notes.update(768, b, 3, 100, out);
+    notes.update(1024, b, 3, 100, out);
+    CHECK(out.count() == 4);
+    CHECK(out.event(0).data[0] == 0x81 && out.event(1).data[0] == 0x81);
+    CHECK(out.event(2).data[0] == 0x91 && out.event(3).data[0] == 0x91);
+
+    out.clear();
+    notes.release(1280, out);
+    CHECK(out.count() == 3 && !notes.sounding());
+}
+
+static void test_meter()
+{
+    Meter meter;
+    meter.init(44100);
+
+    const int n = 512;
+    float x[n];
+    for (int b = 0; b < 200; b++)
+    {
+        for (int k = 0; k < n; k++)
+            x[k] = 0.5f * sinf(2 * M_PI * 441 * (b * n + k) / 44100.f);
+        meter.process(x, n);
+    }
+    meter_reading_t r = meter.reading();
+    CHECK_CLOSE(r.peak, 0.5, 1e-3);
+    CHECK_CLOSE(r.rms, 0.5 / sqrt(2), 1e-2);
+    CHECK(r.clips == 0);
+
+    x[7] = 1.5f;
+    x[9] = -1.f;
+    meter.process(x, n);
+    CHECK(meter.reading().clips == 2);
+
+    // silence lets the peak fall but the hold stays for a while
+    meter.silence(n * 100);
+    CHECK(meter.reading().peak < 0.2 && meter.reading().hold == 1.5f);
+}
+
+static void test_voicing_table()
+{
+    // one voice's row is contiguous, and the ratios match powf closely enough to be inaudible
+    VoicingTable tab(8, CHORD_KEY_NQUALITIES, 12);
+    tab.setInterval(5, CHORD_KEY_MIXOLYDIAN, 11, -7);
+    CHECK(tab.getInterval(5, CHORD_KEY_MIXOLYDIAN, 11) == -7);
+    CHECK(tab.row(CHORD_KEY_MIXOLYDIAN, 11)[5] == -7);
+    CHECK(tab.data()[(CHORD_KEY_MIXOLYDIAN * 12 + 11) * 8 + 5] == -7);
+
+    float semis[9] = {-24, -12, -7, -0.25f, 0, 0.5f, 7, 19, 24};
+    float ratio[9];
+    semitone_ratios(semis, ratio, 9);
+    for (int k = 0; k < 9; k++)
+        CHECK_CLOSE(ratio[k] / powf(2.f, semis[k] / 12), 1, 1e-6);
+}
+
+static void test_spectral_shifter()
+{
+    // a fifth up lands on 330 Hz at about the input level, on the harmony bus only
+    const int n = 44100;
+    std::vector<float> in(n), lead_l(n), lead_r(n), harm_l(n), harm_r(n);
+    for (int k = 0; k < n; k++)
+        for (int h = 1; h < 20; h++)
+            in[k] += 0.3f / h * sinf(2 * M_PI * 220 * h * k / 44100.);
+
+    SpectralShifter shifter;
+    shifter.init(1024, 4);
+    shifter.setPeriod(44100 / 220.f);
+    shifter.voice(1).ratio = 1.5f;
+    shifter.voice(1).gain_l = shifter.voice(1).gain_r = 1;
+    for (int k = 0; k < n; k += 300)
+        shifter.process(in.data() + k, std::min(300, n - k), lead_l.data() + k, lead_r.data() + k, harm_l.data() + k, harm_r.data() + k);
+    CHECK(!shifter.idle());
+
+    double e_in = 0, e_out = 0, e_lead = 0;
+    for (int k = 20000; k < 40000; k++)
+    {
+        e_in += in[k] * in[k];
+        e_out += harm_l[k] * harm_l[k];
+        e_lead += lead_l[k] * lead_l[k];
+    }
+    CHECK_CLOSE(sqrt(e_out / e_in), 1, 0.2);
+    CHECK(e_lead == 0);
+
+    float best_f = 0, best_m = 0;
+    for (float f = 200; f < 400; f += 1)
+    {
+        double c = 0, s = 0;
+        for (int k = 20000; k < 36384; k++)
+        {
+            c += harm_l[k] * cos(2 * M_PI * f * k / 44100.);
+            s += harm_l[k] * sin(2 * M_PI * f * k / 44100.);
+        }
+        if (hypot(c, s) > best_m)
+        {
+            best_m = hypot(c, s);
+            best_f = f;
+        }
+    }
+    CHECK_CLOSE(best_f, 330, 1);
+
+    // silenced, it rings out for one frame and reports idle
+    shifter.voice(1).gain_l = shifter.voice(1).gain_r = 0;
+    std::fill(in.begin(), in.end(), 0.f);
+    shifter.process(in.data(), 2048, lead_l.data(), lead_r.data(), harm_l.data(), harm_r.data());
+    CHECK(shifter.idle());
+}
+
+static void test_sinc_table()
+{
+    // a 10 kHz sine read between samples stays within -60 dB, where cubic is around -23 dB
+    const SincTable & table = SincTable::shared();
+    float x[64];
+    for (int k = 0; k < 64; k++)
+        x[k] = sinf(2 * M_PI * 10000 * k / 44100.);
+
+    float worst = 0;
+    for (int j = 0; j <= 100; j++)
+    {
+        float a = j / 100.f;
+        float ref = sinf(2 * M_PI * 10000 * (32 + a) / 44100.);
+        worst = std::max(worst, fabsf(table.read(x + 33 - SINC_TAPS / 2, a) - ref));
+    }
+    CHECK(worst < 1e-3);
+
+    // every phase passes DC unchanged
+    float dc[SINC_TAPS];
+    std::fill(dc, dc + SINC_TAPS, 0.5f);
+    for (int j = 0; j <= 10; j++)
+        CHECK_CLOSE(table.read(dc, j / 10.f), 0.5, 1e-6);
+}
+
+static void test_shared_tables()
+{
+    // one copy per size and rate while anyone holds it, gone after the last release
+    int before = SharedTables::liveCount();
+    const shared_tables_t * a = SharedTables::acquire(1024, 44100);
+    const shared_tables_t * b = SharedTables::acquire(1024, 44100);
+    const shared_tables_t * c = SharedTables::acquire(1024, 48000);
+    CHECK(a == b);
+    CHECK(a != c);
+    CHECK(SharedTables::liveCount() == before + 2);
+    CHECK((uintptr_t) a->hann % SHARED_TABLES_ALIGN == 0);
+    CHECK_CLOSE(a->hann[512], 1, 1e-6);
+    CHECK(a->hann[0] == 0.f);
+    CHECK(c->band_bin[0] > 0);
+    CHECK(c->band_bin[SPECTRUM_BANDS] <= 513);
+
+    SharedTables::release(a);
+    CHECK(SharedTables::liveCount() == before + 2);
+    SharedTables::release(b);
+    SharedTables::release(c);
+    CHECK(SharedTables::liveCount() == before);
+
+    CHECK(SharedTables::intervals()[0] == 1.f);
+    CHECK_CLOSE(SharedTables::intervals()[12], 2, 1e-6);
+    CHECK_CLOSE(SharedTables::intervals()[-12], 0.5, 1e-6);
+}
+
+// ---- main ----
+
+typedef struct kernel_test_s
+{
+    const char * name;
+    void (*run)();
+} kernel_test_t;
+
+static const kernel_test_t tests[] = {
+    {"ramps", test_ramps},
+    {"gate", test_gate},
+    {"preset bank", test_preset_bank},
+    {"spectrum", test_spectrum},
+    {"interval addresses", test_interval_addresses},
+    {"analysis modes", test_analysis_modes},
+    {"overdub spill", test_overdub_spill},
+    {"chord table", test_chord_table},
+    {"fft backends", test_fft_backends},
+    {"grain scheduler", test_grain_scheduler},
+    {"looper spill", test_looper_spill},
+    {"record tap", test_record_tap},
+    {"midi note out", test_midi_note_out},
+    {"meter", test_meter},
+    {"voicing table", test_voicing_table},
+    {"spectral shifter", test_spectral_shifter},
+    {"sinc table", test_sinc_table},
+    {"shared tables", test_shared_tables},
+};
+
+int main(int argc, char ** argv)
+{
+    int ran = 0;
+    for (const kernel_test_t & t : tests)
+    {
+        bool wanted = argc < 2;
+        for (int k = 1; k < argc; k++)
+            wanted |= strstr(t.name, argv[k]) != NULL;
+        if (!wanted)
+            continue;
+
+        int before = failures;
+        t.run();
+        printf("%-20s %s\n", t.name, failures == before ? "ok" : "FAILED");
+        ran++;
+    }
+    printf("%d tests, %d failed checks\n", ran, failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,617 @@
+//
+//  main.cpp
+//  RealtimeSafetyTest
+//
+//  Runs HarmonizerDSPKernel through a set of render scenarios with malloc,
+//  free, pthread_mutex_lock, write and stdio interposed. Any of those called
+//  from the render thread while it is inside process(), handleMIDIMessage()
+//  or a render-time setParameter() is a failure, reported with a backtrace.
+//
+//  usage: harmonizr-rtcheck [-b blockframes] [-n maxreports] [-d] [-l libharmonizr.so]
+//
+//      -d  leave denormals alone instead of setting FTZ/DAZ, to see what the
+//          flagged paths cost without them
+//      -l  also dlopen the C library and render through it on a thread that
+//          has never run it, so allocations a plugin host would see on its
+//          first process call (thread_local storage, lazy statics) count too
+//
+//  Every block also checks the FPU underflow flag. A scenario where more than
+//  a few percent of blocks produce subnormal results is flagged as denormal
+//  heavy; that doesn't fail the run (hosts set FTZ/DAZ), but it marks a path
+//  that will stall on hosts that don't.
+//
+//  Exit status is 0 when no violations were seen, 1 otherwise.
+//
+//  build (glibc):
+//      c++ -std=c++17 -O1 -g -rdynamic -pthread -I../../Shared main.cpp -ldl -o harmonizr-rtcheck
+//
+
+#include <cfenv>
+#include <cmath>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <xmmintrin.h>
+#endif
+
+#include "HarmonizerDSPKernel.hpp"
+#include "../libharmonizr/harmonizr.h"
+
+// ---- render scope ----
+
+static thread_local int rt_depth = 0;       // > 0 while this thread is rendering
+static thread_local int rt_reporting = 0;   // set while a violation is being reported
+static const char * rt_where = "";
+static int rt_block = 0;
+static int rt_violations = 0;
+static int rt_max_reports = 8;
+
+// marks the calling thread as the render thread for its lifetime
+class RenderScope {
+public:
+    RenderScope() { rt_depth++; }
+    ~RenderScope() { rt_depth--; }
+};
+
+static ssize_t (*real_write)(int, const void *, size_t) = NULL;
+static int (*real_mutex_lock)(pthread_mutex_t *) = NULL;
+static int (*real_vfprintf)(FILE *, const char *, va_list) = NULL;
+static size_t (*real_fwrite)(const void *, size_t, size_t, FILE *) = NULL;
+static int (*real_fputs)(const char *, FILE *) = NULL;
+static int (*real_puts)(const char *) = NULL;
+static int (*real_fputc)(int, FILE *) = NULL;
+
+static void report(const char * call)
+{
+    rt_reporting++;
+    rt_violations++;
+    if (rt_violations <= rt_max_reports)
+    {
+        char msg[256];
+        int n = snprintf(msg, sizeof(msg), "\nviolation: %s on the render thread (%s, block %d)\n", call, rt_where, rt_block);
+        real_write(2, msg, n);
+
+        void * frames[32];
+        int nframes = backtrace(frames, 32);
+        backtrace_symbols_fd(frames + 1, nframes - 1, 2);   // skip report() itself
+    }
+    rt_reporting--;
+}
+
+static inline void check(const char * call)
+{
+    if (rt_depth > 0 && !rt_reporting)
+        report(call);
+}
+
+// ---- interposers ----
+
+extern "C" {
+
+void * __libc_malloc(size_t);
+void * __libc_calloc(size_t, size_t);
+void * __libc_realloc(void *, size_t);
+void __libc_free(void *);
+
+void * malloc(size_t n)
+{
+    check("malloc");
+    return __libc_malloc(n);
+}
+
+void * calloc(size_t n, size_t size)
+{
+    check("calloc");
+    return __libc_calloc(n, size);
+}
+
+void * realloc(void * p, size_t n)
+{
+    check("realloc");
+    return __libc_realloc(p, n);
+}
+
+void free(void * p)
+{
+    if (p)
+        check("free");
+    __libc_free(p);
+}
+
+int pthread_mutex_lock(pthread_mutex_t * m)
+{
+    check("pthread_mutex_lock");
+    return real_mutex_lock(m);
+}
+
+ssize_t write(int fd, const void * buf, size_t n)
+{
+    check("write");
+    return real_write(fd, buf, n);
+}
+
+// libc's own stdio writes don't go through the exported write(), so catch them at the entry points
+int vfprintf(FILE * fp, const char * fmt, va_list ap)
+{
+    check("vfprintf");
+    return real_vfprintf(fp, fmt, ap);
+}
+
+int fprintf(FILE * fp, const char * fmt, ...)
+{
+    check("fprintf");
+    va_list ap;
+    va_start(ap, fmt);
+    int r = real_vfprintf(fp, fmt, ap);
+    va_end(ap);
+    return r;
+}
+
+int printf(const char * fmt, ...)
+{
+    check("printf");
+    va_list ap;
+    va_start(ap, fmt);
+    int r = real_vfprintf(stdout, fmt, ap);
+    va_end(ap);
+    return r;
+}
+
+// _FORTIFY_SOURCE builds call these instead
+int __fprintf_chk(FILE * fp, int, const char * fmt, ...)
+{
+    check("fprintf");
+    va_list ap;
+    va_start(ap, fmt);
+    int r = real_vfprintf(fp, fmt, ap);
+    va_end(ap);
+    return r;
+}
+
+int __printf_chk(int, const char * fmt, ...)
+{
+    check("printf");
+    va_list ap;
+    va_start(ap, fmt);
+    int r = real_vfprintf(stdout, fmt, ap);
+    va_end(ap);
+    return r;
+}
+
+size_t fwrite(const void * p, size_t size, size_t n, FILE * fp)
+{
+    check("fwrite");
+    return real_fwrite(p, size, n, fp);
+}
+
+int fputs(const char * s, FILE * fp)
+{
+    check("fputs");
+    return real_fputs(s, fp);
+}
+
+int puts(const char * s)
+{
+    check("puts");
+    return real_puts(s);
+}
+
+int fputc(int c, FILE * fp)
+{
+    check("fputc");
+    return real_fputc(c, fp);
+}
+
+int putchar(int c)
+{
+    check("putchar");
+    return real_fputc(c, stdout);
+}
+
+}
+
+// resolve everything up front, so no lookup (and its allocations) happens inside a scope
+static void resolve()
+{
+    real_write = (ssize_t (*)(int, const void *, size_t)) dlsym(RTLD_NEXT, "write");
+    real_mutex_lock = (int (*)(pthread_mutex_t *)) dlsym(RTLD_NEXT, "pthread_mutex_lock");
+    real_vfprintf = (int (*)(FILE *, const char *, va_list)) dlsym(RTLD_NEXT, "vfprintf");
+    real_fwrite = (size_t (*)(const void *, size_t, size_t, FILE *)) dlsym(RTLD_NEXT, "fwrite");
+    real_fputs = (int (*)(const char *, FILE *)) dlsym(RTLD_NEXT, "fputs");
+    real_puts = (int (*)(const char *)) dlsym(RTLD_NEXT, "puts");
+    real_fputc = (int (*)(int, FILE *)) dlsym(RTLD_NEXT, "fputc");
+
+    // backtrace() loads libgcc on first use; get that out of the way too
+    void * frames[2];
+    backtrace(frames, 2);
+}
+
+// ---- floating point ----
+
+static void set_flush_denormals(bool on)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int csr = _mm_getcsr();
+    csr = on ? (csr | 0x8040) : (csr & ~0x8040u);  // FTZ | DAZ
+    _mm_setcsr(csr);
+#elif defined(__aarch64__)
+    uint64_t fpcr;
+    __asm__ __volatile__("mrs %0, fpcr" : "=r"(fpcr));
+    fpcr = on ? (fpcr | (1ull << 24)) : (fpcr & ~(1ull << 24));  // FZ
+    __asm__ __volatile__("msr fpcr, %0" : : "r"(fpcr));
+#else
+    (void) on;
+#endif
+}
+
+static int count_subnormal(const float * x, int n)
+{
+    int c = 0;
+    for (int k = 0; k < n; k++)
+        c += (std::fpclassify(x[k]) == FP_SUBNORMAL);
+    return c;
+}
+
+// ---- scenarios ----
+
+typedef struct scenario_s
+{
+    const char * name;
+    int blocks;
+    void (*block)(HarmonizerDSPKernel & k, int b, float * in, int n);   // fills in and drives the kernel
+} scenario_t;
+
+static double phase = 0;
+
+static void voiced(float * in, int n, float f, float amp)
+{
+    for (int k = 0; k < n; k++)
+    {
+        in[k] = amp * (sinf(phase) + 0.4f * sinf(2 * phase) + 0.2f * sinf(3 * phase));
+        phase += 2 * M_PI * f / 44100;
+    }
+}
+
+static void midi(HarmonizerDSPKernel & k, uint8_t status, uint8_t d1, uint8_t d2)
+{
+    uint8_t msg[3] = {status, d1, d2};
+    k.handleMIDIMessage(msg, (status & 0xF0) == 0xC0 ? 2 : 3);
+}
+
+// all eight voices in the modal keys, with melody and harmony notes going out as MIDI,
+// cleared per block as a host does, and the display spectrum on
+static void auto_harmony(HarmonizerDSPKernel & k, int b, float * in, int n)
+{
+    voiced(in, n, 196.f * powf(2.f, (float) ((b / 40) % 5) / 12.f), 0.3f);
+    k.setParameter(HarmParamNvoices, HARM_AUTO_VOICES);
+    k.setParameter(HarmParamKeycenter, 12 * (CHORD_KEY_DORIAN + (b / 100) % 3) + 7);
+    k.setParameter(HarmParamMidiMelOut, 1);
+    k.setParameter(HarmParamMidiHarmOut, 1);
+    k.enableSpectrum(true);
+    k.midiOut().clear();
+    k.process(n, 0);
+}
+
+static void midi_voices(HarmonizerDSPKernel & k, int b, float * in, int n)
+{
+    voiced(in, n, 220.f, 0.3f);
+    if (b % 8 == 0)
+    {
+        // more held notes than there are voices, so the overflow path runs too
+        for (int j = 0; j < 16; j++)
+            midi(k, 0x90, 48 + ((b / 8 + j * 5) % 36), 100);
+    }
+    if (b % 8 == 4)
+    {
+        for (int j = 0; j < 16; j++)
+            midi(k, 0x80, 48 + ((b / 8 + j * 5) % 36), 0);
+    }
+    midi(k, 0xB0, 11, b & 0x7F);
+    midi(k, 0xB0, 64, (b & 16) ? 127 : 0);
+    if (b % 50 == 0)
+        midi(k, 0xC0, (b / 50) & 0x7F, 0);
+    k.process(n, 0);
+}
+
+static void automation(HarmonizerDSPKernel & k, int b, float * in, int n)
+{
+    voiced(in, n, 247.f, 0.3f);
+    float t = (float) (b % 64) / 63.f;
+    for (int p = HarmParamKeycenter; p <= HarmParamGateThresh; p++)
+    {
+        if (p == HarmParamBypass)
+            k.setParameter(p, (b % 40) < 5);
+        else if (p == HarmParamTuning)
+            k.setParameter(p, 440.f + 4 * t);
+        else if (p == HarmParamThreshold)
+            k.setParameter(p, 0.1f + 0.2f * t);
+        else if (p == HarmParamGateThresh)
+            k.setParameter(p, -96.f + 40 * t);
+        else
+            k.setParameter(p, t * 4);
+    }
+    k.setParameter(HarmParamInterval + (b % 48), (float) (b % 8));
+    k.setParameter(HarmonizerDSPKernel::intervalAddress(b % CHORD_KEY_NQUALITIES, b % HARM_DEGREES, b % HARM_AUTO_VOICES), (float) (b % 8));
+    k.process(n, 0);
+}
+
+// voiced, then a long decay into digital silence: the gate and grain tails
+static void tail(HarmonizerDSPKernel & k, int b, float * in, int n)
+{
+    float amp = (b < 100) ? 0.3f : 0.3f * expf(-(float) (b - 100) / 20.f);
+    voiced(in, n, 330.f, amp);
+    k.process(n, 0);
+}
+
+// odd sizes, non-zero offsets, and blocks longer than the kernel's scratch
+static void offsets(HarmonizerDSPKernel & k, int b, float * in, int n)
+{
+    voiced(in, n, 262.f, 0.3f);
+    int off = (b * 37) % (n / 2);
+    k.process(n - off, off);
+}
+
+// record a take longer than the looper keeps resident, then overdub and play it back
+static void looper(HarmonizerDSPKernel & k, int b, float * in, int n)
+{
+    voiced(in, n, 220.f, 0.3f);
+    if (b == 0)
+        k.setParameter(HarmParamLoop, LoopRec);
+    if (b == 400)
+        k.setParameter(HarmParamLoop, LoopPlayRec);
+    if (b == 800)
+        k.setParameter(HarmParamLoop, LoopPlay);
+    if (b == 1100)
+        k.setParameter(HarmParamLoop, LoopPause);
+    if (b == 1150)
+        k.setParameter(HarmParamLoop, LoopPlay);
+    k.process(n, 0);
+}
+
+// MIDI voices with every stem going to disk
+static void recording(HarmonizerDSPKernel & k, int b, float * in, int n)
+{
+    midi_voices(k, b, in, n);
+}
+
+// MIDI voices through the spectral engine, with a stretch of PSOLA in the middle for both switches
+static void spectral(HarmonizerDSPKernel & k, int b, float * in, int n)
+{
+    k.setParameter(HarmParamAlgorithm, (b >= 300 && b < 400) ? AlgorithmPSOLA : AlgorithmSpectral);
+    midi_voices(k, b, in, n);
+}
+
+// MIDI voices at each grain read quality in turn
+static void interpolation(HarmonizerDSPKernel & k, int b, float * in, int n)
+{
+    k.setInterpolation((b / 100) % 3 == 0 ? InterpSinc : ((b / 100) % 3 == 1 ? InterpLinear : InterpCubic));
+    midi_voices(k, b, in, n);
+}
+
+// auto harmony with the pitch analysis spread over the hop, or on the helper thread;
+// main() sets the mode, since starting the helper allocates
+static void sliced_analysis(HarmonizerDSPKernel & k, int b, float * in, int n)
+{
+    auto_harmony(k, b, in, n);
+}
+
+static void threaded_analysis(HarmonizerDSPKernel & k, int b, float * in, int n)
+{
+    auto_harmony(k, b, in, n);
+}
+
+static void remove_stems(const std::string & prefix)
+{
+    for (const char * stem : {"-mix", "-dry", "-lead", "-harmony"})
+        unlink((prefix + stem + ".wav").c_str());
+    for (int v = 0; v < RECORD_TAP_MAX_CHANNELS; v++)
+        unlink((prefix + "-voice" + std::to_string(v) + ".wav").c_str());
+}
+
+static const scenario_t scenarios[] = {
+    {"auto harmony", 800, auto_harmony},
+    {"midi voices", 800, midi_voices},
+    {"automation", 800, automation},
+    {"tail", 1200, tail},
+    {"offsets", 400, offsets},
+    {"looper", 1200, looper},
+    {"recording", 800, recording},
+    {"spectral", 800, spectral},
+    {"interpolation", 600, interpolation},
+    {"sliced yin", 800, sliced_analysis},
+    {"threaded yin", 800, threaded_analysis},
+};
+
+// ---- shared library ----
+
+// Creates an instance per engine on this thread, as a host does, then renders
+// its first blocks from a fresh thread. Returns the violations seen.
+static int check_library(const char * path, int block_frames)
+{
+    void * lib = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (!lib)
+    {
+        fprintf(stderr, "couldn't load %s: %s\n", path, dlerror());
+        return -1;
+    }
+    auto create = (harmonizr_t * (*)(int, double)) dlsym(lib, "harmonizr_create");
+    auto destroy = (void (*)(harmonizr_t *)) dlsym(lib, "harmonizr_destroy");
+    auto configure = (int (*)(harmonizr_t *, int, int)) dlsym(lib, "harmonizr_configure");
+    auto note_on = (void (*)(harmonizr_t *, int, int)) dlsym(lib, "harmonizr_note_on");
+    auto process = (void (*)(harmonizr_t *, const float * const *, float * const *, uint32_t)) dlsym(lib, "harmonizr_process");
+    if (!create || !destroy || !configure || !note_on || !process)
+    {
+        fprintf(stderr, "%s doesn't export the harmonizr API\n", path);
+        dlclose(lib);
+        return -1;
+    }
+
+    int before = rt_violations;
+    std::vector<float> in(block_frames), out_l(block_frames), out_r(block_frames);
+    const float * ins[2] = {in.data(), in.data()};
+    float * outs[2] = {out_l.data(), out_r.data()};
+    for (int engine : {HARMONIZR_ENGINE_PSOLA, HARMONIZR_ENGINE_SPECTRAL})
+    {
+        harmonizr_t * h = create(2, 44100);
+        if (!h)
+            continue;
+        configure(h, HARMONIZR_CONFIG_PRESET, HarmPresetMIDI);
+        configure(h, HARMONIZR_CONFIG_ENGINE, engine);
+        configure(h, HARMONIZR_CONFIG_ANALYSIS, HARMONIZR_ANALYSIS_THREADED);
+        rt_where = engine == HARMONIZR_ENGINE_PSOLA ? "dlopen psola" : "dlopen spectral";
+
+        std::thread render([&] {
+            RenderScope scope;
+            phase = 0;
+            for (int b = 0; b < 200; b++)
+            {
+                rt_block = b;
+                voiced(in.data(), block_frames, 220, 0.3f);
+                if (b == 20)
+                    note_on(h, 64, 100);
+                process(h, ins, outs, block_frames);
+            }
+        });
+        render.join();
+        destroy(h);
+    }
+    dlclose(lib);
+
+    int violations = rt_violations - before;
+    printf("%-14s %5d blocks  %4d violations\n", "dlopen", 400, violations);
+    return violations;
+}
+
+int main(int argc, char ** argv)
+{
+    int block_frames = 512;
+    bool flush = true;
+    const char * library = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:n:dl:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'b': block_frames = atoi(optarg); break;
+            case 'n': rt_max_reports = atoi(optarg); break;
+            case 'd': flush = false; break;
+            case 'l': library = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-b blockframes] [-n maxreports] [-d] [-l libharmonizr.so]\n", argv[0]);
+                return 2;
+        }
+    }
+    if (block_frames < 16)
+        block_frames = 16;
+
+    resolve();
+    set_flush_denormals(flush);
+
+    // the longest block is a bit over the kernel's scratch size, to exercise the split
+    int nbuf = block_frames + 4096;
+    float * in = (float *) calloc(nbuf, sizeof(float));
+    float * out_l = (float *) calloc(nbuf, sizeof(float));
+    float * out_r = (float *) calloc(nbuf, sizeof(float));
+    float * ins[2] = {in, in};
+    float * outs[2] = {out_l, out_r};
+
+    HarmonizerDSPKernel * kernel = new HarmonizerDSPKernel();
+    kernel->init(2, 44100);
+
+    const char * tmp = getenv("TMPDIR");
+    if (!kernel->enableLooper(tmp ? tmp : "/tmp", 1))
+        fprintf(stderr, "couldn't create the looper spill file, skipping its storage\n");
+
+    bool failed = false;
+    for (const scenario_t & s : scenarios)
+    {
+        kernel->reset();
+        bool midi_preset = strcmp(s.name, "midi voices") == 0 || strcmp(s.name, "recording") == 0 ||
+                           strcmp(s.name, "spectral") == 0 || strcmp(s.name, "interpolation") == 0;
+        kernel->setPreset(midi_preset ? HarmPresetMIDI : HarmPresetChords);
+        kernel->setParameter(HarmParamAlgorithm, AlgorithmPSOLA);
+        kernel->setInterpolation(InterpCubic);
+        kernel->setAnalysisMode(s.block == sliced_analysis ? AnalysisSliced :
+                                s.block == threaded_analysis ? AnalysisThreaded : AnalysisInline);
+        kernel->setBuffers(ins, outs);
+        phase = 0;
+
+        int n = strcmp(s.name, "offsets") == 0 ? block_frames + 4096 : block_frames;
+        int before = rt_violations;
+        int underflow_blocks = 0, subnormal = 0;
+        double worst_us = 0;
+        rt_where = s.name;
+
+        bool recording = strcmp(s.name, "recording") == 0;
+        std::string rec_prefix = std::string(tmp ? tmp : "/tmp") + "/rtcheck-" + std::to_string(getpid());
+        if (recording && !kernel->startRecording(rec_prefix.c_str(), RecordStemMix | RecordStemDry | RecordStemLead |
+                                                 RecordStemHarmony | RecordStemVoices))
+            fprintf(stderr, "couldn't open the stem files, recording nothing\n");
+
+        for (int b = 0; b < s.blocks; b++)
+        {
+            rt_block = b;
+            feclearexcept(FE_UNDERFLOW);
+            auto t0 = std::chrono::steady_clock::now();
+            {
+                RenderScope scope;
+                s.block(*kernel, b, in, n);
+            }
+            auto t1 = std::chrono::steady_clock::now();
+            worst_us = std::max(worst_us, std::chrono::duration<double, std::micro>(t1 - t0).count());
+
+            underflow_blocks += fetestexcept(FE_UNDERFLOW) != 0;
+            subnormal += count_subnormal(out_l, n) + count_subnormal(out_r, n);
+        }
+
+        if (strcmp(s.name, "looper") == 0)
+            printf("               looper: %u frames played as silence, %u not recorded\n",
+                   kernel->loop().store().underrunFrames(), kernel->loop().store().overrunFrames());
+
+        if (recording)
+        {
+            kernel->stopRecording();
+            printf("               recording: %llu frames recorded, %llu dropped\n",
+                   (unsigned long long) kernel->recordTap().framesRecorded(),
+                   (unsigned long long) kernel->recordTap().overrunFrames());
+            remove_stems(rec_prefix);
+        }
+
+        int violations = rt_violations - before;
+        bool denormal_heavy = underflow_blocks > s.blocks / 20 || subnormal > 0;
+        printf("%-14s %5d blocks  %4d violations  %5d underflowing blocks  %6d subnormal outputs  worst %7.1f us%s\n",
+               s.name, s.blocks, violations, underflow_blocks, subnormal, worst_us,
+               denormal_heavy ? "  [denormal heavy]" : "");
+        failed |= violations > 0;
+    }
+
+    // drain what the scenarios queued for the host
+    harm_event_t ev;
+    while (kernel->eventChannel().poll(ev))
+        ;
+
+    kernel->fini();
+    delete kernel;
+    free(in);
+    free(out_l);
+    free(out_r);
+
+    if (library)
+        failed |= check_library(library, block_frames) != 0;
+
+    printf("%s: %d realtime violations\n", failed ? "FAIL" : "ok", rt_violations);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,159 @@
+//
+//  harmonizr.cpp
+//  libharmonizr
+//
+//  The C interface in harmonizr.h over HarmonizerDSPKernel. Each call is a
+//  thin forward to the kernel; process only swaps buffer pointers in, so
+//  it's exactly as real-time safe as the kernel's own process, which the
+//  RealtimeSafetyTest checks (with -l, through the loaded library).
+//
+//  build (shared and static):
+//      c++ -std=c++17 -O2 -fPIC -fvisibility=hidden -pthread -I../../Shared -c harmonizr.cpp -o harmonizr.o
+//      c++ -shared -pthread -Wl,--version-script=harmonizr.map harmonizr.o -o libharmonizr.so
+//      ar rcs libharmonizr.a harmonizr.o
+//
+//  link a C host against the static library with -lstdc++ -lpthread -lm.
+//
+
+#include <new>
+
+#include "harmonizr.h"
+#include "HarmonizerDSPKernel.hpp"
+
+static_assert((int) HARMONIZR_PARAM_INTERVAL == (int) HarmParamInterval, "parameter addresses");
+static_assert((int) HARMONIZR_PARAM_ALGORITHM == (int) HarmParamAlgorithm, "parameter addresses");
+static_assert((int) HARMONIZR_ENGINE_SPECTRAL == (int) AlgorithmSpectral, "engine numbers");
+static_assert((int) HARMONIZR_INTERP_SINC == (int) InterpSinc, "interpolation tiers");
+static_assert((int) HARMONIZR_ANALYSIS_THREADED == (int) AnalysisThreaded, "analysis modes");
+static_assert(sizeof(harmonizr_midi_event_t) == sizeof(midi_out_event_t), "MIDI out layout");
+
+struct harmonizr
+{
+    HarmonizerDSPKernel kernel;
+    int channels;
+    float * in[2];
+    float * out[2];
+    uint32_t frames;    // length of the last process call
+};
+
+uint32_t harmonizr_abi_version(void)
+{
+    return HARMONIZR_ABI_VERSION;
+}
+
+harmonizr_t * harmonizr_create(int channels, double sample_rate)
+{
+    if (channels < 1 || channels > 2 || !(sample_rate >= 8000 && sample_rate <= 384000))
+        return NULL;
+
+    harmonizr_t * h = new (std::nothrow) harmonizr_t();
+    if (!h)
+        return NULL;
+    try
+    {
+        h->channels = channels;
+        h->kernel.init(channels, sample_rate);
+        h->kernel.reset();
+    }
+    catch (...)
+    {
+        delete h;
+        return NULL;
+    }
+    return h;
+}
+
+void harmonizr_destroy(harmonizr_t * h)
+{
+    if (!h)
+        return;
+    h->kernel.fini();
+    delete h;
+}
+
+void harmonizr_reset(harmonizr_t * h)
+{
+    h->kernel.reset();
+}
+
+int harmonizr_configure(harmonizr_t * h, int key, int value)
+{
+    switch (key)
+    {
+        case HARMONIZR_CONFIG_ENGINE:
+            h->kernel.setParameter(HarmParamAlgorithm, (float) value);
+            return 0;
+        case HARMONIZR_CONFIG_INTERPOLATION:
+            h->kernel.setInterpolation(value);
+            return 0;
+        case HARMONIZR_CONFIG_ANALYSIS:
+            h->kernel.setAnalysisMode(value);
+            return 0;
+        case HARMONIZR_CONFIG_PRESET:
+            h->kernel.setPreset(value);
+            return 0;
+    }
+    return -1;
+}
+
+void harmonizr_set_parameter(harmonizr_t * h, uint32_t address, float value)
+{
+    h->kernel.setParameter((param_address_t) address, value);
+}
+
+float harmonizr_get_parameter(const harmonizr_t * h, uint32_t address)
+{
+    return const_cast<HarmonizerDSPKernel &>(h->kernel).getParameter((param_address_t) address);
+}
+
+void harmonizr_note_on(harmonizr_t * h, int note, int velocity)
+{
+    uint8_t msg[3] = {0x90, (uint8_t) clamp(note, 0, 127), (uint8_t) clamp(velocity, 0, 127)};
+    h->kernel.handleMIDIMessage(msg, 3);
+}
+
+void harmonizr_note_off(harmonizr_t * h, int note)
+{
+    uint8_t msg[3] = {0x80, (uint8_t) clamp(note, 0, 127), 0};
+    h->kernel.handleMIDIMessage(msg, 3);
+}
+
+void harmonizr_midi(harmonizr_t * h, const uint8_t * data, size_t length)
+{
+    if (data && length <= 3)
+        h->kernel.handleMIDIMessage(data, (int) length);
+}
+
+void harmonizr_process(harmonizr_t * h, const float * const * in, float * const * out, uint32_t frames)
+{
+    // the kernel only reads its inputs; its pointer table just isn't const
+    for (int ch = 0; ch < h->channels; ch++)
+    {
+        h->in[ch] = const_cast<float *>(in[ch]);
+        h->out[ch] = out[ch];
+    }
+    h->kernel.setBuffers(h->in, h->out);
+    h->kernel.midiOut().clear();
+    h->frames = frames;
+
+    // the kernel splits blocks past its scratch size itself
+    h->kernel.process((frame_count_t) frames, 0);
+}
+
+int harmonizr_output_silent(const harmonizr_t * h)
+{
+    // the kernel counts the zeroed frames up to now, across its own splits
+    return h->frames > 0 && const_cast<HarmonizerDSPKernel &>(h->kernel).silentFrames() >= h->frames;
+}
+
+int harmonizr_midi_out(const harmonizr_t * h, harmonizr_midi_event_t * events, int max)
+{
+    const MidiOutBuffer & midi = const_cast<HarmonizerDSPKernel &>(h->kernel).midiOut();
+    int n = clamp(max, 0, midi.count());
+    for (int k = 0; k < n; k++)
+    {
+        events[k].frame = midi.event(k).frame;
+        memcpy(events[k].data, midi.event(k).data, 3);
+    }
+    return n;
+}
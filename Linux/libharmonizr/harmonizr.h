@@ -0,0 +1,164 @@
+/*
+    harmonizr.h
+    libharmonizr
+
+    C interface to the harmonizer kernel, for hosts that aren't Objective-C++
+    or JNI: audio servers in C, Rust through a plain extern block, anything
+    with a C FFI.
+
+    The handle is opaque and every call takes it first. Functions marked
+    "render thread" are the only ones a host may call while audio runs, and
+    they never allocate, take a lock or wait on another thread; the rest belong
+    to the host thread, never concurrently with the render thread or with
+    each other on the same handle. Separate handles are independent.
+
+    Nothing here throws or aborts: bad arguments are clamped or ignored,
+    create returns NULL when it can't allocate.
+
+    The ABI only grows. Functions, constants and struct layouts already here
+    don't change meaning; new ones come with a bump of HARMONIZR_ABI_VERSION,
+    so a host can check harmonizr_abi_version() against the header it was
+    built with.
+*/
+
+#ifndef harmonizr_h
+#define harmonizr_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32)
+#define HARMONIZR_API __declspec(dllexport)
+#else
+#define HARMONIZR_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define HARMONIZR_ABI_VERSION 2
+
+/* longest block one process call renders without splitting it internally */
+#define HARMONIZR_MAX_BLOCK 4096
+
+typedef struct harmonizr harmonizr_t;
+
+/* harmonizr_configure keys */
+enum {
+    HARMONIZR_CONFIG_ENGINE = 0,        /* HARMONIZR_ENGINE_* */
+    HARMONIZR_CONFIG_INTERPOLATION,     /* HARMONIZR_INTERP_*, grain read quality */
+    HARMONIZR_CONFIG_ANALYSIS,          /* HARMONIZR_ANALYSIS_*, where pitch analysis runs */
+    HARMONIZR_CONFIG_PRESET             /* factory preset number, as for program change */
+};
+
+enum {
+    HARMONIZR_ENGINE_PSOLA = 0,
+    HARMONIZR_ENGINE_SPECTRAL = 2
+};
+
+enum {
+    HARMONIZR_INTERP_LINEAR = 0,
+    HARMONIZR_INTERP_CUBIC,
+    HARMONIZR_INTERP_SINC
+};
+
+enum {
+    HARMONIZR_ANALYSIS_INLINE = 0,
+    HARMONIZR_ANALYSIS_SLICED,
+    HARMONIZR_ANALYSIS_THREADED
+};
+
+/* parameter addresses; interval table cells follow from HARMONIZR_PARAM_INTERVAL */
+enum {
+    HARMONIZR_PARAM_KEYCENTER = 0,
+    HARMONIZR_PARAM_INVERSION,
+    HARMONIZR_PARAM_NVOICES,
+    HARMONIZR_PARAM_AUTO,
+    HARMONIZR_PARAM_AUTO_STRENGTH,
+    HARMONIZR_PARAM_MIDI,
+    HARMONIZR_PARAM_MIDI_LINK,
+    HARMONIZR_PARAM_MIDI_LEGATO,
+    HARMONIZR_PARAM_TRIAD,
+    HARMONIZR_PARAM_BYPASS,
+    HARMONIZR_PARAM_DOUBLE,
+    HARMONIZR_PARAM_HGAIN,              /* harmony voices, 0-2 */
+    HARMONIZR_PARAM_VGAIN,              /* the corrected lead voice in auto and triad modes, 0-2 */
+    HARMONIZR_PARAM_DRY_MIX,            /* the uncorrected input, 0-1 */
+    HARMONIZR_PARAM_SPEED,
+    HARMONIZR_PARAM_TUNING,
+    HARMONIZR_PARAM_THRESHOLD,
+    HARMONIZR_PARAM_GATE_THRESH,
+    HARMONIZR_PARAM_LOOP,
+    HARMONIZR_PARAM_MIDI_MEL_OUT,
+    HARMONIZR_PARAM_MIDI_HARM_OUT,
+    HARMONIZR_PARAM_ALGORITHM,
+    HARMONIZR_PARAM_INTERVAL
+};
+
+/* a MIDI message the last process call sent, frame counted from its start */
+typedef struct harmonizr_midi_event {
+    int32_t frame;
+    uint8_t data[3];
+} harmonizr_midi_event_t;
+
+HARMONIZR_API uint32_t harmonizr_abi_version(void);
+
+/*
+    Host thread. channels is 1 or 2: the first input channel is the one
+    analysed and shifted, and a mono instance folds the stereo voices down.
+    Returns NULL for anything else, or when it can't allocate.
+*/
+HARMONIZR_API harmonizr_t * harmonizr_create(int channels, double sample_rate);
+
+/* host thread; NULL is fine */
+HARMONIZR_API void harmonizr_destroy(harmonizr_t * h);
+
+/* host thread: back to silence, voices and analysis cleared, settings kept */
+HARMONIZR_API void harmonizr_reset(harmonizr_t * h);
+
+/*
+    Host thread. Returns 0, or -1 for a key this library doesn't know, so a
+    host built against a newer header can tell. Values are clamped.
+*/
+HARMONIZR_API int harmonizr_configure(harmonizr_t * h, int key, int value);
+
+/* render thread, between process calls; takes effect with the next block */
+HARMONIZR_API void harmonizr_set_parameter(harmonizr_t * h, uint32_t address, float value);
+HARMONIZR_API float harmonizr_get_parameter(const harmonizr_t * h, uint32_t address);
+
+/* render thread, between process calls; channel 1 only, as the kernel listens */
+HARMONIZR_API void harmonizr_note_on(harmonizr_t * h, int note, int velocity);
+HARMONIZR_API void harmonizr_note_off(harmonizr_t * h, int note);
+
+/* render thread: any channel message of 2 or 3 bytes (note, CC, program change) */
+HARMONIZR_API void harmonizr_midi(harmonizr_t * h, const uint8_t * data, size_t length);
+
+/*
+    Render thread. in and out hold one pointer per channel, frames samples
+    each, all owned by the caller. Outputs mustn't overlap the first input,
+    which is read again after the first output is written. Any block length
+    works; longer ones than HARMONIZR_MAX_BLOCK are rendered in pieces.
+*/
+HARMONIZR_API void harmonizr_process(harmonizr_t * h, const float * const * in, float * const * out, uint32_t frames);
+
+/*
+    Render thread, after process: 1 when every output sample of the last
+    block was exactly zero because the input was gated and nothing was left
+    ringing out, so a host can skip mixing it or pass on a silence flag.
+    0 otherwise, including for a block that merely happened to be quiet.
+    Since ABI version 2.
+*/
+HARMONIZR_API int harmonizr_output_silent(const harmonizr_t * h);
+
+/*
+    Render thread, after process: copies up to max of the MIDI messages the
+    last block sent (melody and harmony out) and returns how many it copied.
+*/
+HARMONIZR_API int harmonizr_midi_out(const harmonizr_t * h, harmonizr_midi_event_t * events, int max);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* harmonizr_h */
@@ -11,14 +11,29 @@
 #import "../harmonizr-dsp/HarmonizerDSPKernel.hpp"
 #import "../harmonizr-dsp/Looper.h"
 #import "BufferedAudioBus.hpp"
+#import "Seqlock.hpp"
+#import "MidiOut.hpp"
 
 #include <dispatch/dispatch.h>
+#include <atomic>
 
 #pragma mark AUv3Harmonizer (Presets)
 
 static const UInt8 kNumberOfPresets = 9;
 static const NSInteger kDefaultFactoryPreset = 0;
 
+// what the UI polls, copied out of the kernel by the render block once per render call
+#define UI_NVOICES 4
+
+typedef struct ui_state_s
+{
+    float midi_note_number;
+    float root_key;
+    float rms;
+    int32_t voice_notes[UI_NVOICES];
+    uint64_t keys_down[2];      // one bit per key
+} ui_state_t;
+
 typedef struct FactoryPresetParameters {
     AUValue keycenterValue;
     AUValue inversionValue;
@@ -188,6 +203,13 @@ static AUAudioUnitPreset* NewAUPreset(NSInteger number, NSString *name)
     //Looper _looper;
     BufferedInputBus _inputBus;
     dispatch_semaphore_t _sem;
+    dispatch_semaphore_t _eventDone;    // signalled by the event loop as it exits
+    std::atomic<bool> _eventStop;
+    bool _eventRunning;
+    Seqlock<ui_state_t> *_uiState;
+    MidiOutBuffer _midiOut;     // render thread: this render call's notes for the host
+    MidiNoteOut _melOut;
+    MidiNoteOut _harmOut;
     
     bool embedded;
     
@@ -195,6 +217,7 @@ static AUAudioUnitPreset* NewAUPreset(NSInteger number, NSString *name)
     NSInteger           _currentFactoryPresetIndex;
     NSMutableArray<NSNumber *> *keysDown;
     NSArray<AUAudioUnitPreset *> *_presets;
+    NSArray<AUParameter *> *_intervalParams;    // interval_0 ... interval_143, by index
 }
 @synthesize parameterTree = _parameterTree;
 @synthesize factoryPresets = _presets;
@@ -514,6 +537,8 @@ static AUAudioUnitPreset* NewAUPreset(NSInteger number, NSString *name)
         [params addObject: keycenterIntervals[k]];
     }
     
+    _intervalParams = [NSArray arrayWithObjects:keycenterIntervals count:144];
+    
 //    AUParameterGroup *intervals = [AUParameterTree createGroupWithIdentifier:@"intervals" name:@"Auto-Harmony" children:ksparams];
 //    
 //    [params addObject: intervals];
@@ -552,6 +577,12 @@ static AUAudioUnitPreset* NewAUPreset(NSInteger number, NSString *name)
     
     _sem = dispatch_semaphore_create(0);
     _kernel.sem = _sem;
+    _eventDone = dispatch_semaphore_create(0);
+    _eventStop = false;
+    _eventRunning = false;
+    _uiState = new Seqlock<ui_state_t>();
+    _melOut.setChannel(0);
+    _harmOut.setChannel(1);
         
     _kernel.setParameter(HarmParamKeycenter, keycenterParam.value);
     _kernel.setParameter(HarmParamInversion, inversionParam.value);
@@ -623,6 +654,7 @@ static AUAudioUnitPreset* NewAUPreset(NSInteger number, NSString *name)
 
 -(void)dealloc {
     _presets = nil;
+    delete _uiState;
 }
 
 #pragma mark - AUAudioUnit (Overrides)
@@ -660,39 +692,7 @@ static AUAudioUnitPreset* NewAUPreset(NSInteger number, NSString *name)
 //        return NO;
 //    }
     
-    // start thread to listen for patch change events and update UI
-    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_LOW, 0), ^{
-        
-        while (true)
-        {
-            dispatch_time_t timeout = dispatch_time(DISPATCH_TIME_NOW, (int64_t)(0.1 * NSEC_PER_SEC));
-            long result = dispatch_semaphore_wait(self->_kernel.sem, timeout);
-
-            if (result == 0)
-            {
-                NSLog(@"signal received!\n");
-                if (self.delegate)
-                {
-                    if (self->_kernel.pc_flag)
-                    {
-                        NSLog(@"programChange!\n");
-                        dispatch_async(dispatch_get_main_queue(), ^{
-                            [self.delegate programChange:self->_kernel.program_change];
-                        });
-                        self->_kernel.pc_flag = 0;
-                    }
-                    if (self->_kernel.cc_flag)
-                    {
-                        NSLog(@"ccChange!\n");
-                        dispatch_async(dispatch_get_main_queue(), ^{
-                            [self.delegate ccValue:self->_kernel.cc_val forCc:self->_kernel.cc_num];
-                        });
-                        self->_kernel.cc_flag = 0;
-                    }
-                }
-            }
-        }
-    });
+    [self startEventLoop];
 	
 	_inputBus.allocateRenderResources(self.maximumFramesToRender);
 	
@@ -703,11 +703,60 @@ static AUAudioUnitPreset* NewAUPreset(NSInteger number, NSString *name)
 }
 	
 - (void)deallocateRenderResources {
+    [self stopEventLoop];
 	_inputBus.deallocateRenderResources();
     _kernel.fini();
     [super deallocateRenderResources];
 }
 
+// Forward program changes and CCs from the kernel to the delegate. The loop sleeps until the
+// kernel signals _sem, and exits on stopEventLoop, so reallocating never leaves one behind.
+- (void)startEventLoop {
+    [self stopEventLoop];
+    _eventStop = false;
+    _eventRunning = true;
+    
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_LOW, 0), ^{
+        
+        while (true)
+        {
+            dispatch_semaphore_wait(self->_kernel.sem, DISPATCH_TIME_FOREVER);
+            if (self->_eventStop)
+                break;
+
+            if (self.delegate)
+            {
+                if (self->_kernel.pc_flag)
+                {
+                    int program = (int) self->_kernel.program_change;
+                    dispatch_async(dispatch_get_main_queue(), ^{
+                        [self.delegate programChange:program];
+                    });
+                    self->_kernel.pc_flag = 0;
+                }
+                if (self->_kernel.cc_flag)
+                {
+                    int cc = (int) self->_kernel.cc_num, value = (int) self->_kernel.cc_val;
+                    dispatch_async(dispatch_get_main_queue(), ^{
+                        [self.delegate ccValue:value forCc:cc];
+                    });
+                    self->_kernel.cc_flag = 0;
+                }
+            }
+        }
+        dispatch_semaphore_signal(self->_eventDone);
+    });
+}
+
+- (void)stopEventLoop {
+    if (!_eventRunning)
+        return;
+    _eventStop = true;
+    dispatch_semaphore_signal(_sem);
+    dispatch_semaphore_wait(_eventDone, DISPATCH_TIME_FOREVER);
+    _eventRunning = false;
+}
+
 #pragma mark - AUAudioUnit (AUAudioUnitImplementation)
 
 - (NSArray<NSString *>*) MIDIOutputNames
@@ -724,6 +773,10 @@ static AUAudioUnitPreset* NewAUPreset(NSInteger number, NSString *name)
     // Specify captured objects are mutable.
 	__block HarmonizerDSPKernel *state = &_kernel;
 	__block BufferedInputBus *input = &_inputBus;
+    __block Seqlock<ui_state_t> *ui = _uiState;
+    __block MidiOutBuffer *midi = &_midiOut;
+    __block MidiNoteOut *mel_out = &_melOut;
+    __block MidiNoteOut *harm_out = &_harmOut;
     __block AUMIDIOutputEventBlock output_block = self.MIDIOutputEventBlock;
     
     return ^AUAudioUnitStatus(
@@ -774,18 +827,47 @@ static AUAudioUnitPreset* NewAUPreset(NSInteger number, NSString *name)
 		state->setBuffers(inAudioBufferList, outAudioBufferList);
 		state->processWithEvents(timestamp, frameCount, realtimeEventListHead, output_block);
         
-//        if (output_block)
-//        {
-//            uint8_t bytes[3];
-//            bytes[0] = 0x90;
-//            bytes[1] = 60;
-//            bytes[2] = 100;
-//            output_block(AUEventSampleTimeImmediate, 0, 3, bytes);
-//            bytes[0] = 0x80;
-//            bytes[1] = 60;
-//            bytes[2] = 100;
-//            output_block(AUEventSampleTimeImmediate, 0, 3, bytes);
-//        }
+        // one consistent copy for the UI, so it never sees fields from two different blocks
+        ui_state_t snapshot = {};
+        snapshot.midi_note_number = state->midi_note_number;
+        snapshot.root_key = state->root_key;
+        snapshot.rms = state->rms;
+        for (int k = 0; k < UI_NVOICES; k++)
+            snapshot.voice_notes[k] = state->ui_voice_notes[k];
+        for (int k = 0; k < 128; k++)
+            if (state->keys_down[k])
+                snapshot.keys_down[k >> 6] |= 1ull << (k & 63);
+        ui->publish(snapshot);
+        
+        /*
+            Melody on channel 1 and harmony on channel 2, from the notes the kernel
+            settled on this render call. A set has to hold for two calls before it
+            goes out, only changed notes are sent, and the harmony leaves out the
+            melody note the lead voice doubles. Stamped at the start of the buffer.
+        */
+        if (output_block) {
+            midi->clear();
+            int mel = state->midi_note_number > 0 ? (int) state->midi_note_number : -1;
+            if (state->getParameter(HarmParamMidiMelOut) > 0)
+                mel_out->update(0, &mel, 1, 100, *midi);
+            else
+                mel_out->release(0, *midi);
+            
+            if (state->getParameter(HarmParamMidiHarmOut) > 0) {
+                int nv = (int) state->getParameter(HarmParamNvoices);
+                int harm[UI_NVOICES];
+                for (int k = 0; k < UI_NVOICES; k++)
+                    harm[k] = (k < nv && snapshot.voice_notes[k] > 0 && snapshot.voice_notes[k] != mel) ? snapshot.voice_notes[k] : -1;
+                harm_out->update(0, harm, UI_NVOICES, 100, *midi);
+            }
+            else
+                harm_out->release(0, *midi);
+            
+            for (int k = 0; k < midi->count(); k++) {
+                const midi_out_event_t &e = midi->event(k);
+                output_block((AUEventSampleTime) timestamp->mSampleTime + e.frame, 0, 3, e.data);
+            }
+        }
         
 		return noErr;
 	};
@@ -824,14 +906,10 @@ static AUAudioUnitPreset* NewAUPreset(NSInteger number, NSString *name)
                 nvoicesParameter.value = presetParameters[factoryPreset.number].nvoicesValue;
                 triadParameter.value = presetParameters[factoryPreset.number].triadValue;
                 
+                // by index, not by formatting and looking up 144 keys
                 for (int k = 0; k < 144; k++)
                 {
-                    AUParameter * p = [self.parameterTree valueForKey: [NSString stringWithFormat:@"interval_%d", k]];
-                    if (p)
-                    {
-                        p.value = presetParameters[factoryPreset.number].intervalValues[k];
-                    }
-                    p = nil;
+                    _intervalParams[k].value = presetParameters[factoryPreset.number].intervalValues[k];
                 }
 //                
                 // set factory preset as current
@@ -865,21 +943,25 @@ static AUAudioUnitPreset* NewAUPreset(NSInteger number, NSString *name)
 #pragma mark -
 
 - (float) getCurrentNote {
-    return (float) _kernel.midi_note_number;
+    ui_state_t ui;
+    _uiState->read(ui);
+    return ui.midi_note_number;
 }
 
 - (NSArray *) getNotes {
     int nv = (int) _kernel.getParameter(HarmParamNvoices);
+    ui_state_t ui;
+    _uiState->read(ui);
 
     NSMutableArray * output = [[NSMutableArray alloc] initWithCapacity: nv + 1];
     
-    NSNumber *n = [NSNumber numberWithInt:_kernel.midi_note_number];
+    NSNumber *n = [NSNumber numberWithInt:(int) ui.midi_note_number];
     [output addObject:n];
     
     
-    for (int k = 0; k < nv; k++)
+    for (int k = 0; k < nv && k < UI_NVOICES; k++)
     {
-        NSNumber *n = [NSNumber numberWithInt:_kernel.ui_voice_notes[k]];
+        NSNumber *n = [NSNumber numberWithInt:ui.voice_notes[k]];
         [output addObject:n];
     }
     
@@ -887,9 +969,13 @@ static AUAudioUnitPreset* NewAUPreset(NSInteger number, NSString *name)
 }
 
 - (NSArray *) getKeysDown {
+    ui_state_t ui;
+    _uiState->read(ui);
+
     for (int k = 0; k < 128; k++)
     {
-        [keysDown replaceObjectAtIndex:k withObject:[NSNumber numberWithBool:_kernel.keys_down[k]]];
+        BOOL down = (ui.keys_down[k >> 6] >> (k & 63)) & 1;
+        [keysDown replaceObjectAtIndex:k withObject:[NSNumber numberWithBool:down]];
     }
     
     return keysDown;
@@ -922,11 +1008,15 @@ static AUAudioUnitPreset* NewAUPreset(NSInteger number, NSString *name)
 }
 
 - (float) getCurrentKeycenter {
-    return _kernel.root_key;
+    ui_state_t ui;
+    _uiState->read(ui);
+    return ui.root_key;
 }
 
 - (float) getCurrentLevel {
-    return _kernel.rms;
+    ui_state_t ui;
+    _uiState->read(ui);
+    return ui.rms;
 }
 
 - (float) getCurrentNumVoices {
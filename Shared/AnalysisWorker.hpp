@@ -0,0 +1,90 @@
+//
+//  AnalysisWorker.hpp
+//  Harmonizer
+//
+//  A helper thread that runs one job at a time for the render thread. The
+//  render thread fills the job's input, calls post() and carries on; on a
+//  later callback it checks idle() and only then reads the output. It never
+//  waits for the helper: a job that isn't finished in time is just picked
+//  up later (or skipped) by the caller.
+//
+//  post() and idle() don't allocate, lock or block. Waking the helper is an
+//  EventNotifier signal, the same one the event and spill threads use.
+//
+
+#ifndef AnalysisWorker_hpp
+#define AnalysisWorker_hpp
+
+#include <atomic>
+#include <functional>
+#include <thread>
+
+#include "EventChannel.hpp"
+
+class AnalysisWorker {
+public:
+    ~AnalysisWorker()
+    {
+        stop();
+    }
+
+    // host thread; the job runs on the helper once per post()
+    void start(std::function<void()> job_)
+    {
+        if (helper.joinable())
+            return;
+        job = std::move(job_);
+        busy.store(0);
+        stopping.store(0);
+        helper = std::thread([this] { run(); });
+    }
+
+    // host thread: lets a job in flight finish, then joins
+    void stop()
+    {
+        if (!helper.joinable())
+            return;
+        stopping.store(1);
+        notifier.post();
+        helper.join();
+        busy.store(0);
+    }
+
+    bool running() const { return helper.joinable(); }
+
+    // ---- render thread ----
+
+    // nothing in flight: the last job's output is complete and its input is free
+    bool idle() const { return busy.load(std::memory_order_acquire) == 0; }
+
+    // only while idle()
+    void post()
+    {
+        busy.store(1, std::memory_order_release);
+        notifier.post();
+    }
+
+private:
+    std::function<void()> job;
+    std::thread helper;
+    EventNotifier notifier;
+    std::atomic<int> busy{0};
+    std::atomic<int> stopping{0};
+
+    void run()
+    {
+        while (true)
+        {
+            notifier.wait();
+            if (stopping.load())
+                break;
+            if (busy.load(std::memory_order_acquire))
+            {
+                job();
+                busy.store(0, std::memory_order_release);
+            }
+        }
+    }
+};
+
+#endif /* AnalysisWorker_hpp */
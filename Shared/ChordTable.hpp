@@ -0,0 +1,196 @@
+//
+//  ChordTable.hpp
+//  Harmonizer
+//
+//  Chord recognition by table lookup: every set of held pitch classes is a
+//  12-bit mask, so all 4096 possible sets are scored once up front and
+//  recognising a chord is a single array access.
+//
+
+#ifndef ChordTable_hpp
+#define ChordTable_hpp
+
+#include <cstdint>
+#include <cstring>
+
+typedef enum chord_quality_e
+{
+    CHORD_NONE = 0,
+    CHORD_MAJOR,
+    CHORD_MINOR,
+    CHORD_DOM7,
+    CHORD_MAJ7,
+    CHORD_MIN7,
+    CHORD_MINMAJ7,
+    CHORD_DIM,
+    CHORD_DIM7,
+    CHORD_HALFDIM7,
+    CHORD_AUG,
+    CHORD_SUS2,
+    CHORD_SUS4,
+    CHORD_7SUS4,
+    CHORD_MAJ6,
+    CHORD_MIN6,
+    CHORD_ADD9,
+    CHORD_DOM9,
+    CHORD_MAJ9,
+    CHORD_MIN9,
+    CHORD_POWER,
+    CHORD_NQUALITIES
+} chord_quality_t;
+
+/*
+    Which of the kernel's interval tables a key uses. Chords only ever select
+    the first three; the modes are there for a key set by hand.
+*/
+enum {
+    CHORD_KEY_MAJOR = 0,
+    CHORD_KEY_MINOR,
+    CHORD_KEY_DOM,
+    CHORD_KEY_DORIAN,
+    CHORD_KEY_MIXOLYDIAN,
+    CHORD_KEY_HARMONIC_MINOR,
+    CHORD_KEY_NQUALITIES
+};
+
+typedef struct chord_info_s
+{
+    int8_t root;            // pitch class 0-11, or -1 if nothing matched
+    uint8_t quality;        // chord_quality_t
+    uint8_t key_quality;    // CHORD_KEY_*
+    uint8_t ntones;         // number of pitch classes in the mask
+    float confidence;       // fraction of template and held tones that agree, 0-1
+} chord_info_t;
+
+typedef struct chord_template_s
+{
+    chord_quality_t quality;
+    uint8_t key_quality;
+    uint16_t mask;          // pitch classes relative to the root, bit 0 = root
+    const char * name;
+} chord_template_t;
+
+#define PC(x) (1 << (x))
+
+// simpler chords first: on equal scores the earlier template wins
+static const chord_template_t chord_templates[] = {
+    {CHORD_MAJOR,    CHORD_KEY_MAJOR, PC(0)|PC(4)|PC(7),             ""},
+    {CHORD_MINOR,    CHORD_KEY_MINOR, PC(0)|PC(3)|PC(7),             "m"},
+    {CHORD_DOM7,     CHORD_KEY_DOM,   PC(0)|PC(4)|PC(7)|PC(10),      "7"},
+    {CHORD_MAJ7,     CHORD_KEY_MAJOR, PC(0)|PC(4)|PC(7)|PC(11),      "maj7"},
+    {CHORD_MIN7,     CHORD_KEY_MINOR, PC(0)|PC(3)|PC(7)|PC(10),      "m7"},
+    {CHORD_MINMAJ7,  CHORD_KEY_MINOR, PC(0)|PC(3)|PC(7)|PC(11),      "mMaj7"},
+    {CHORD_DIM,      CHORD_KEY_MINOR, PC(0)|PC(3)|PC(6),             "dim"},
+    {CHORD_DIM7,     CHORD_KEY_MINOR, PC(0)|PC(3)|PC(6)|PC(9),       "dim7"},
+    {CHORD_HALFDIM7, CHORD_KEY_MINOR, PC(0)|PC(3)|PC(6)|PC(10),      "m7b5"},
+    {CHORD_AUG,      CHORD_KEY_MAJOR, PC(0)|PC(4)|PC(8),             "aug"},
+    {CHORD_SUS2,     CHORD_KEY_MAJOR, PC(0)|PC(2)|PC(7),             "sus2"},
+    {CHORD_SUS4,     CHORD_KEY_MAJOR, PC(0)|PC(5)|PC(7),             "sus4"},
+    {CHORD_7SUS4,    CHORD_KEY_DOM,   PC(0)|PC(5)|PC(7)|PC(10),      "7sus4"},
+    {CHORD_MAJ6,     CHORD_KEY_MAJOR, PC(0)|PC(4)|PC(7)|PC(9),       "6"},
+    {CHORD_MIN6,     CHORD_KEY_MINOR, PC(0)|PC(3)|PC(7)|PC(9),       "m6"},
+    {CHORD_ADD9,     CHORD_KEY_MAJOR, PC(0)|PC(2)|PC(4)|PC(7),       "add9"},
+    {CHORD_DOM9,     CHORD_KEY_DOM,   PC(0)|PC(2)|PC(4)|PC(7)|PC(10), "9"},
+    {CHORD_MAJ9,     CHORD_KEY_MAJOR, PC(0)|PC(2)|PC(4)|PC(7)|PC(11), "maj9"},
+    {CHORD_MIN9,     CHORD_KEY_MINOR, PC(0)|PC(2)|PC(3)|PC(7)|PC(10), "m9"},
+    {CHORD_POWER,    CHORD_KEY_MAJOR, PC(0)|PC(7),                   "5"},
+};
+
+#undef PC
+
+static const int chord_ntemplates = sizeof(chord_templates) / sizeof(chord_template_t);
+
+static inline int chord_popcount(unsigned int x)
+{
+    int n = 0;
+    for (; x; x &= x - 1)
+        n++;
+    return n;
+}
+
+static inline unsigned int chord_rotate(unsigned int mask, int root)
+{
+    return ((mask << root) | (mask >> (12 - root))) & 0xfff;
+}
+
+class ChordTable {
+public:
+    enum { size = 4096 };
+
+    ChordTable()
+    {
+        for (int m = 0; m < size; m++)
+        {
+            entries[m] = classify((unsigned int) m);
+        }
+    }
+
+    const chord_info_t & lookup(unsigned int pc_mask) const
+    {
+        return entries[pc_mask & 0xfff];
+    }
+
+    static const ChordTable & shared()
+    {
+        // built on first use; call once from a non-realtime thread to pay for it up front
+        static const ChordTable table;
+        return table;
+    }
+
+private:
+    chord_info_t entries[size];
+
+    static chord_info_t classify(unsigned int mask)
+    {
+        chord_info_t best = {-1, CHORD_NONE, CHORD_KEY_MAJOR, (uint8_t) chord_popcount(mask), 0.f};
+
+        // a single pitch class (or nothing) isn't a chord
+        if (best.ntones < 2)
+            return best;
+
+        float best_score = -1e9;
+
+        for (int t = 0; t < chord_ntemplates; t++)
+        {
+            for (int root = 0; root < 12; root++)
+            {
+                unsigned int tmask = chord_rotate(chord_templates[t].mask, root);
+                int matched = chord_popcount(mask & tmask);
+                int missing = chord_popcount(tmask & ~mask);
+                int extra = chord_popcount(mask & ~tmask);
+
+                // a missing fifth is the most common omission, so it costs less
+                float missing_cost = (float) missing;
+                if ((tmask & ~mask) & (1u << ((root + 7) % 12)))
+                    missing_cost -= 0.5f;
+
+                float score = 2.f * matched - 1.5f * missing_cost - 1.f * extra;
+                if (!(mask & (1u << root)))
+                    score -= 1.f;
+
+                if (score > best_score)
+                {
+                    best_score = score;
+                    best.root = (int8_t) root;
+                    best.quality = (uint8_t) chord_templates[t].quality;
+                    best.key_quality = chord_templates[t].key_quality;
+                    best.confidence = (float) matched / (float) (matched + missing + extra);
+                }
+            }
+        }
+
+        return best;
+    }
+};
+
+static inline const char * chord_quality_name(int quality)
+{
+    for (int t = 0; t < chord_ntemplates; t++)
+    {
+        if (chord_templates[t].quality == quality)
+            return chord_templates[t].name;
+    }
+    return "?";
+}
+
+#endif /* ChordTable_hpp */
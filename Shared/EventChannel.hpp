@@ -0,0 +1,216 @@
+//
+//  EventChannel.hpp
+//  Harmonizer
+//
+//  Events from the render thread to the host: program changes, CCs for
+//  MIDI learn, voice overflow and detected key changes.
+//
+//  The producer side is a fixed-size single-producer/single-consumer ring
+//  and never allocates, locks or blocks. The consumer blocks in wait() on a
+//  futex (Linux, Android) or a Mach semaphore (Apple), which the producer
+//  only signals when the consumer is actually asleep, so an idle host
+//  doesn't wake up at all. shutdown() releases a blocked consumer for good.
+//
+
+#ifndef EventChannel_hpp
+#define EventChannel_hpp
+
+#include <atomic>
+#include <cstdint>
+
+#ifdef __APPLE__
+#include <mach/mach.h>
+#include <mach/semaphore.h>
+#else
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+enum {
+    HarmEventProgramChange = 1,     // a = program
+    HarmEventControlChange,         // a = controller, b = value
+    HarmEventVoiceOverflow,         // value = grains that couldn't be started in the block
+    HarmEventKeyChange,             // value = new key center, root + 12 * quality
+    HarmEventRecordOverrun          // value = frames the record tap had to drop
+};
+
+typedef struct harm_event_s
+{
+    uint8_t type;
+    uint8_t a;
+    uint8_t b;
+    int32_t value;
+    uint32_t sample;                // kernel sample count when it happened
+} harm_event_t;
+
+// counting wakeup used by the consumer; post() never blocks
+class EventNotifier {
+public:
+    EventNotifier()
+    {
+#ifdef __APPLE__
+        semaphore_create(mach_task_self(), &sem, SYNC_POLICY_FIFO, 0);
+#endif
+    }
+
+    ~EventNotifier()
+    {
+#ifdef __APPLE__
+        semaphore_destroy(mach_task_self(), sem);
+#endif
+    }
+
+    void post()
+    {
+#ifdef __APPLE__
+        semaphore_signal(sem);
+#else
+        count.fetch_add(1, std::memory_order_release);
+        syscall(SYS_futex, &count, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#endif
+    }
+
+    void wait()
+    {
+#ifdef __APPLE__
+        semaphore_wait(sem);
+#else
+        while (true)
+        {
+            uint32_t c = count.load(std::memory_order_acquire);
+            if (c > 0 && count.compare_exchange_weak(c, c - 1, std::memory_order_acquire))
+                return;
+            if (c == 0)
+                syscall(SYS_futex, &count, FUTEX_WAIT_PRIVATE, 0, NULL, NULL, 0);
+        }
+#endif
+    }
+
+private:
+#ifdef __APPLE__
+    semaphore_t sem;
+#else
+    std::atomic<uint32_t> count{0};
+#endif
+};
+
+template <typename T, unsigned int N>
+class SpscRing {
+    static_assert((N & (N - 1)) == 0, "ring size must be a power of two");
+
+public:
+    // producer; false (and the item is dropped) if the consumer has fallen N behind
+    bool push(const T & item)
+    {
+        uint32_t w = wpos.load(std::memory_order_relaxed);
+        if (w - rpos.load(std::memory_order_acquire) >= N)
+            return false;
+        items[w & (N - 1)] = item;
+        wpos.store(w + 1, std::memory_order_release);
+        return true;
+    }
+
+    // consumer
+    bool pop(T & item)
+    {
+        uint32_t r = rpos.load(std::memory_order_relaxed);
+        if (r == wpos.load(std::memory_order_acquire))
+            return false;
+        item = items[r & (N - 1)];
+        rpos.store(r + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const
+    {
+        return rpos.load(std::memory_order_acquire) == wpos.load(std::memory_order_acquire);
+    }
+
+private:
+    T items[N];
+    alignas(64) std::atomic<uint32_t> wpos{0};
+    alignas(64) std::atomic<uint32_t> rpos{0};
+};
+
+class EventChannel {
+public:
+    // render thread
+    void send(const harm_event_t & ev)
+    {
+        if (!ring.push(ev))
+        {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        // only pay for a wakeup when the consumer is actually asleep;
+        // the fence pairs with the one in wait()
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleeping.exchange(0, std::memory_order_acq_rel))
+            notifier.post();
+    }
+
+    /*
+        Consumer: block until an event arrives and return it, or return false
+        once shutdown() has been called. Events still queued at shutdown are
+        discarded.
+    */
+    bool wait(harm_event_t & ev)
+    {
+        while (true)
+        {
+            if (stopped.load(std::memory_order_acquire))
+                return false;
+            if (ring.pop(ev))
+                return true;
+
+            sleeping.store(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            // re-check after announcing, so a send() in between can't be missed
+            if (ring.empty() && !stopped.load(std::memory_order_relaxed))
+            {
+                notifier.wait();
+            }
+            else if (sleeping.exchange(0, std::memory_order_acq_rel) == 0)
+            {
+                // a producer saw the flag and posted anyway; absorb that wakeup
+                notifier.wait();
+            }
+        }
+    }
+
+    // non-blocking consumer read, e.g. for polling from a UI timer
+    bool poll(harm_event_t & ev)
+    {
+        return ring.pop(ev);
+    }
+
+    // any thread; wakes a blocked consumer, which then returns false
+    void shutdown()
+    {
+        stopped.store(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleeping.exchange(0, std::memory_order_acq_rel))
+            notifier.post();
+    }
+
+    // re-arm after shutdown, before starting a new consumer
+    void restart()
+    {
+        harm_event_t ev;
+        while (ring.pop(ev))
+            ;
+        stopped.store(0, std::memory_order_release);
+    }
+
+    unsigned int droppedEvents() const { return dropped.load(std::memory_order_relaxed); }
+
+private:
+    SpscRing<harm_event_t, 256> ring;
+    EventNotifier notifier;
+    std::atomic<int> sleeping{0};
+    std::atomic<int> stopped{0};
+    std::atomic<unsigned int> dropped{0};
+};
+
+#endif /* EventChannel_hpp */
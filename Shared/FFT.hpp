@@ -0,0 +1,405 @@
+//
+//  FFT.hpp
+//  Harmonizer
+//
+//  Real FFTs behind one small interface, with plans shared process-wide.
+//
+//  Backends:
+//    FFTBackendVDSP     Accelerate's vDSP_fft_zrip (Apple only)
+//    FFTBackendKiss     kiss_fft, when built with HARMONIZER_KISSFFT
+//    FFTBackendBuiltin  a radix-4 Stockham complex FFT of half the size
+//                       with the usual real split; no dependencies
+//
+//  Plans are immutable once built, so every kernel instance shares one per
+//  (backend, size, direction) through FFT::plan(). Working memory is the
+//  caller's, allocated with the rest of its buffers at init, so running a
+//  plan never allocates, not even lazily for thread-local storage.
+//
+//  Conventions, whatever the backend: forward takes n reals to n/2 + 1 bins
+//  of the unscaled DFT; inverse takes n/2 + 1 bins of a Hermitian spectrum
+//  back to n reals, scaled by n (so inverse(forward(x)) == n * x).
+//
+
+#ifndef FFT_hpp
+#define FFT_hpp
+
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#ifdef __APPLE__
+#include <Accelerate/Accelerate.h>
+#endif
+#ifdef HARMONIZER_KISSFFT
+#include "kiss_fft.h"
+#endif
+
+#define FFT_MAX_SIZE 4096
+
+typedef enum fft_backend_e
+{
+    FFTBackendDefault = 0,
+    FFTBackendBuiltin,
+    FFTBackendVDSP,
+    FFTBackendKiss
+} fft_backend_t;
+
+enum {
+    FFTForward = 0,
+    FFTInverse = 1
+};
+
+class FFTPlan {
+public:
+    FFTPlan(int n_, int direction_) : n(n_), direction(direction_) {}
+    virtual ~FFTPlan() {}
+
+    /*
+        FFTForward: read n reals from x, write n/2 + 1 bins to re/im.
+        FFTInverse: read n/2 + 1 bins from re/im, write n reals to x.
+        x and re/im must not overlap. scratch is the caller's working memory,
+        scratchSize(n) floats, 16-byte aligned (calloc's is); each thread
+        that runs plans at once needs its own.
+    */
+    virtual void run(float * x, float * re, float * im, float * scratch) const = 0;
+
+    // enough for any backend
+    static int scratchSize(int n) { return 4 * n; }
+
+    const int n;
+    const int direction;
+};
+
+typedef struct fft_cpx_s
+{
+    float r;
+    float i;
+} fft_cpx_t;
+
+class BuiltinFFTPlan : public FFTPlan {
+public:
+    BuiltinFFTPlan(int n_, int direction_) : FFTPlan(n_, direction_)
+    {
+        int m = n / 2;
+        float sign = direction == FFTForward ? -1.f : 1.f;
+
+        tw.resize(m);
+        for (int k = 0; k < m; k++)
+        {
+            tw[k].r = cosf(2 * M_PI * k / m);
+            tw[k].i = sign * sinf(2 * M_PI * k / m);
+        }
+
+        // e^(-+2 pi i k / n), for splitting the half-size transform into the real one
+        split.resize(m + 1);
+        for (int k = 0; k <= m; k++)
+        {
+            split[k].r = cosf(2 * M_PI * k / n);
+            split[k].i = sign * sinf(2 * M_PI * k / n);
+        }
+    }
+
+    void run(float * x, float * re, float * im, float * scratch) const override
+    {
+        int m = n / 2;
+        fft_cpx_t * z = (fft_cpx_t *) scratch;
+        fft_cpx_t * y = z + m;
+
+        if (direction == FFTForward)
+        {
+            // pack even samples as real, odd as imaginary
+            memcpy(z, x, n * sizeof(float));
+            fft_cpx_t * Z = transform(z, y);
+
+            for (int k = 0; k <= m; k++)
+            {
+                fft_cpx_t a = Z[k % m];
+                fft_cpx_t b = Z[(m - k) % m];
+                b.i = -b.i;
+
+                // E = (a + b) / 2, O = -i (a - b) / 2, X = E + w O
+                float er = 0.5f * (a.r + b.r), ei = 0.5f * (a.i + b.i);
+                float orr = 0.5f * (a.i - b.i), oi = -0.5f * (a.r - b.r);
+                const fft_cpx_t & w = split[k];
+                re[k] = er + w.r * orr - w.i * oi;
+                im[k] = ei + w.r * oi + w.i * orr;
+            }
+        }
+        else
+        {
+            for (int k = 0; k < m; k++)
+            {
+                float ar = re[k], ai = im[k];
+                float br = re[m - k], bi = -im[m - k];
+
+                // Z = (a + b) + i w (a - b)
+                float dr = ar - br, di = ai - bi;
+                const fft_cpx_t & w = split[k];
+                float wr = w.r * dr - w.i * di, wi = w.r * di + w.i * dr;
+                z[k].r = (ar + br) - wi;
+                z[k].i = (ai + bi) + wr;
+            }
+            fft_cpx_t * Z = transform(z, y);
+            memcpy(x, Z, n * sizeof(float));
+        }
+    }
+
+private:
+    std::vector<fft_cpx_t> tw;      // twiddles for the half-size complex transform
+    std::vector<fft_cpx_t> split;
+
+    // Stockham autosort, radix 4 with one radix-2 pass when needed; returns whichever buffer holds the result
+    fft_cpx_t * transform(fft_cpx_t * x, fft_cpx_t * y) const
+    {
+        int m = n / 2;
+        float jsign = direction == FFTForward ? -1.f : 1.f;   // multiply by -i forward, +i inverse
+
+        int len = m;
+        int s = 1;
+        while (len >= 4)
+        {
+            int l1 = len / 4;
+            int tstep = m / len;
+            for (int p = 0; p < l1; p++)
+            {
+                const fft_cpx_t w1 = tw[p * tstep];
+                const fft_cpx_t w2 = tw[2 * p * tstep];
+                const fft_cpx_t w3 = tw[3 * p * tstep];
+
+                for (int q = 0; q < s; q++)
+                {
+                    fft_cpx_t a = x[q + s * p];
+                    fft_cpx_t b = x[q + s * (p + l1)];
+                    fft_cpx_t c = x[q + s * (p + 2 * l1)];
+                    fft_cpx_t d = x[q + s * (p + 3 * l1)];
+
+                    float apcr = a.r + c.r, apci = a.i + c.i;
+                    float amcr = a.r - c.r, amci = a.i - c.i;
+                    float bpdr = b.r + d.r, bpdi = b.i + d.i;
+                    // j * (b - d), with j = -+i
+                    float jbr = -jsign * (b.i - d.i), jbi = jsign * (b.r - d.r);
+
+                    fft_cpx_t * o = y + q + s * 4 * p;
+                    o[0].r = apcr + bpdr;
+                    o[0].i = apci + bpdi;
+
+                    float t1r = amcr + jbr, t1i = amci + jbi;
+                    o[s].r = w1.r * t1r - w1.i * t1i;
+                    o[s].i = w1.r * t1i + w1.i * t1r;
+
+                    float t2r = apcr - bpdr, t2i = apci - bpdi;
+                    o[2 * s].r = w2.r * t2r - w2.i * t2i;
+                    o[2 * s].i = w2.r * t2i + w2.i * t2r;
+
+                    float t3r = amcr - jbr, t3i = amci - jbi;
+                    o[3 * s].r = w3.r * t3r - w3.i * t3i;
+                    o[3 * s].i = w3.r * t3i + w3.i * t3r;
+                }
+            }
+            fft_cpx_t * t = x; x = y; y = t;
+            len /= 4;
+            s *= 4;
+        }
+
+        if (len == 2)
+        {
+            for (int q = 0; q < s; q++)
+            {
+                fft_cpx_t a = x[q];
+                fft_cpx_t b = x[q + s];
+                y[q].r = a.r + b.r;
+                y[q].i = a.i + b.i;
+                y[q + s].r = a.r - b.r;
+                y[q + s].i = a.i - b.i;
+            }
+            fft_cpx_t * t = x; x = y; y = t;
+        }
+        return x;
+    }
+};
+
+#ifdef __APPLE__
+class VDSPFFTPlan : public FFTPlan {
+public:
+    VDSPFFTPlan(int n_, int direction_) : FFTPlan(n_, direction_)
+    {
+        log2n = (vDSP_Length) lrintf(log2f((float) n));
+        setup = vDSP_create_fftsetup(log2n, kFFTRadix2);
+    }
+
+    ~VDSPFFTPlan() override
+    {
+        vDSP_destroy_fftsetup(setup);
+    }
+
+    void run(float * x, float * re, float * im, float * scratch) const override
+    {
+        int m = n / 2;
+        DSPSplitComplex z = {scratch, scratch + m};
+
+        if (direction == FFTForward)
+        {
+            vDSP_ctoz((const DSPComplex *) x, 2, &z, 1, (vDSP_Length) m);
+            vDSP_fft_zrip(setup, &z, 1, log2n, FFT_FORWARD);
+
+            // zrip packs Nyquist into imagp[0] and scales by 2
+            float half = 0.5f;
+            re[0] = z.realp[0] * half;
+            im[0] = 0;
+            re[m] = z.imagp[0] * half;
+            im[m] = 0;
+            vDSP_vsmul(z.realp + 1, 1, &half, re + 1, 1, (vDSP_Length) (m - 1));
+            vDSP_vsmul(z.imagp + 1, 1, &half, im + 1, 1, (vDSP_Length) (m - 1));
+        }
+        else
+        {
+            memcpy(z.realp, re, m * sizeof(float));
+            memcpy(z.imagp, im, m * sizeof(float));
+            z.imagp[0] = re[m];
+            vDSP_fft_zrip(setup, &z, 1, log2n, FFT_INVERSE);
+            vDSP_ztoc(&z, 1, (DSPComplex *) x, 2, (vDSP_Length) m);
+        }
+    }
+
+private:
+    FFTSetup setup;
+    vDSP_Length log2n;
+};
+#endif
+
+#ifdef HARMONIZER_KISSFFT
+class KissFFTPlan : public FFTPlan {
+public:
+    KissFFTPlan(int n_, int direction_) : FFTPlan(n_, direction_)
+    {
+        cfg = kiss_fft_alloc(n, direction == FFTInverse, NULL, NULL);
+    }
+
+    ~KissFFTPlan() override
+    {
+        kiss_fft_free(cfg);
+    }
+
+    void run(float * x, float * re, float * im, float * scratch) const override
+    {
+        int m = n / 2;
+        kiss_fft_cpx * in = (kiss_fft_cpx *) scratch;
+        kiss_fft_cpx * out = in + n;
+
+        if (direction == FFTForward)
+        {
+            for (int k = 0; k < n; k++)
+            {
+                in[k].r = x[k];
+                in[k].i = 0;
+            }
+            kiss_fft(cfg, in, out);
+            for (int k = 0; k <= m; k++)
+            {
+                re[k] = out[k].r;
+                im[k] = out[k].i;
+            }
+        }
+        else
+        {
+            for (int k = 0; k <= m; k++)
+            {
+                in[k].r = re[k];
+                in[k].i = im[k];
+            }
+            for (int k = m + 1; k < n; k++)
+            {
+                in[k].r = re[n - k];
+                in[k].i = -im[n - k];
+            }
+            kiss_fft(cfg, in, out);
+            for (int k = 0; k < n; k++)
+                x[k] = out[k].r;
+        }
+    }
+
+private:
+    kiss_fft_cfg cfg;
+};
+#endif
+
+class FFT {
+public:
+    static fft_backend_t defaultBackend()
+    {
+#ifdef __APPLE__
+        return FFTBackendVDSP;
+#else
+        return FFTBackendBuiltin;
+#endif
+    }
+
+    static bool available(fft_backend_t backend)
+    {
+        switch (backend)
+        {
+            case FFTBackendDefault:
+            case FFTBackendBuiltin:
+                return true;
+#ifdef __APPLE__
+            case FFTBackendVDSP:
+                return true;
+#endif
+#ifdef HARMONIZER_KISSFFT
+            case FFTBackendKiss:
+                return true;
+#endif
+            default:
+                return false;
+        }
+    }
+
+    /*
+        The shared plan for a power-of-two size (8 to FFT_MAX_SIZE) and
+        direction, built on first request. Plans live until the process
+        exits. Takes a lock, so fetch plans at init time, not while rendering.
+    */
+    static const FFTPlan * plan(int n, int direction, fft_backend_t backend = FFTBackendDefault)
+    {
+        if (backend == FFTBackendDefault)
+            backend = defaultBackend();
+        if (!available(backend) || n < 8 || n > FFT_MAX_SIZE || (n & (n - 1)))
+            return NULL;
+
+        static std::mutex lock;
+        static std::vector<std::unique_ptr<FFTPlan>> plans;
+        static std::vector<fft_backend_t> backends;
+
+        std::lock_guard<std::mutex> guard(lock);
+        for (size_t k = 0; k < plans.size(); k++)
+        {
+            if (backends[k] == backend && plans[k]->n == n && plans[k]->direction == direction)
+                return plans[k].get();
+        }
+
+        FFTPlan * p = NULL;
+        switch (backend)
+        {
+#ifdef __APPLE__
+            case FFTBackendVDSP:
+                p = new VDSPFFTPlan(n, direction);
+                break;
+#endif
+#ifdef HARMONIZER_KISSFFT
+            case FFTBackendKiss:
+                p = new KissFFTPlan(n, direction);
+                break;
+#endif
+            default:
+                p = new BuiltinFFTPlan(n, direction);
+                break;
+        }
+        plans.emplace_back(p);
+        backends.push_back(backend);
+        return p;
+    }
+};
+
+#endif /* FFT_hpp */
@@ -0,0 +1,137 @@
+//
+//  GrainScheduler.hpp
+//  Harmonizer
+//
+//  Next grain onset of every sounding voice, in scheduler frames, kept in an
+//  indexed binary min-heap. The kernel only looks at the top each frame and
+//  pops the voices that are due, so the per-sample cost of scheduling no
+//  longer grows with the number of voices. Voices that go quiet are taken out
+//  and put back with their remaining countdown when they come back.
+//
+
+#ifndef GrainScheduler_hpp
+#define GrainScheduler_hpp
+
+#include <cstdint>
+
+#define GRAIN_SCHEDULER_MAX_VOICES 32
+
+class GrainScheduler {
+public:
+    GrainScheduler()
+    {
+        clear();
+    }
+
+    void clear()
+    {
+        n = 0;
+        for (int k = 0; k < GRAIN_SCHEDULER_MAX_VOICES; k++)
+            pos[k] = -1;
+    }
+
+    bool empty() const { return n == 0; }
+    bool scheduled(int vix) const { return pos[vix] >= 0; }
+
+    // earliest onset and its voice; only valid when !empty()
+    double topOnset() const { return heap[0].onset; }
+    int topVoice() const { return heap[0].vix; }
+
+    double onset(int vix) const { return heap[pos[vix]].onset; }
+
+    // insert vix, or move it if it's already scheduled
+    void schedule(int vix, double onset)
+    {
+        int i = pos[vix];
+        if (i < 0)
+        {
+            i = n++;
+            heap[i].vix = vix;
+            pos[vix] = i;
+        }
+        heap[i].onset = onset;
+        sift_up(i);
+        sift_down(pos[vix]);
+    }
+
+    void cancel(int vix)
+    {
+        int i = pos[vix];
+        if (i < 0)
+            return;
+
+        pos[vix] = -1;
+        if (--n == i)
+            return;
+
+        heap[i] = heap[n];
+        pos[heap[i].vix] = i;
+        sift_up(i);
+        sift_down(pos[heap[i].vix]);
+    }
+
+    int pop()
+    {
+        int vix = heap[0].vix;
+        cancel(vix);
+        return vix;
+    }
+
+private:
+    typedef struct entry_s
+    {
+        double onset;
+        int vix;
+    } entry_t;
+
+    entry_t heap[GRAIN_SCHEDULER_MAX_VOICES];
+    int pos[GRAIN_SCHEDULER_MAX_VOICES];    // heap index of each voice, -1 when not scheduled
+    int n;
+
+    // ties go to the lower voice, so grains start in the same order as a plain scan
+    bool before(const entry_t & a, const entry_t & b) const
+    {
+        return a.onset < b.onset || (a.onset == b.onset && a.vix < b.vix);
+    }
+
+    void swap(int i, int j)
+    {
+        entry_t t = heap[i];
+        heap[i] = heap[j];
+        heap[j] = t;
+        pos[heap[i].vix] = i;
+        pos[heap[j].vix] = j;
+    }
+
+    void sift_up(int i)
+    {
+        while (i > 0)
+        {
+            int parent = (i - 1) / 2;
+            if (!before(heap[i], heap[parent]))
+                break;
+            swap(i, parent);
+            i = parent;
+        }
+    }
+
+    void sift_down(int i)
+    {
+        while (true)
+        {
+            int l = 2 * i + 1;
+            int r = l + 1;
+            int m = i;
+            if (l < n && before(heap[l], heap[m]))
+                m = l;
+            if (r < n && before(heap[r], heap[m]))
+                m = r;
+            if (m == i)
+                break;
+            swap(i, m);
+            i = m;
+        }
+    }
+};
+
+#endif /* GrainScheduler_hpp */
@@ -12,11 +12,30 @@
 
 #import <vector>
 #import <cmath>
+#import <cstdio>
+#import <cstring>
+#import <string>
 #import <sys/time.h>
 
+#import "ParameterRamper.hpp"
+#import "ChordTable.hpp"
+#import "PitchTrack.hpp"
+#import "Telemetry.hpp"
+#import "EventChannel.hpp"
+#import "GrainScheduler.hpp"
+#import "Looper.hpp"
+#import "RecordTap.hpp"
+#import "PresetBank.hpp"
+#import "VoicingTable.hpp"
+#import "MidiOut.hpp"
+#import "FFT.hpp"
+#import "SpectralShifter.hpp"
+#import "SincTable.hpp"
+#import "AnalysisWorker.hpp"
+#import "SharedTables.hpp"
+
 #ifdef __APPLE__
 #import "DSPKernel.hpp"
-#import "ParameterRamper.hpp"
 #include <Accelerate/Accelerate.h>
 #include <dispatch/dispatch.h>
 
@@ -28,9 +47,10 @@ typedef AudioTimeStamp timestamp_t;
 typedef AUMIDIEvent midi_event_t;
 
 #else
-#include "kiss_fft.h"
 #import <algorithm>
+#ifdef __ANDROID__
 #include <android/log.h>
+#endif
 typedef int32_t frame_count_t;
 typedef int32_t param_address_t;
 typedef float param_value_t;
@@ -56,6 +76,8 @@ typedef struct grain_s
     float gain;
     float pan;
     int vix;
+    float wc, ws;           // Hann window phase, turned by rc, rs every sample
+    float rc, rs;
 } grain_t;
 
 typedef struct voice_s
@@ -64,7 +86,7 @@ typedef struct voice_s
     float ratio;
     float target_ratio;
     float formant_ratio;
-    float nextgrain;
+    float nextgrain;        // frames to the next grain while the voice is parked
     float pan;
     float ix1;
     float ix2;
@@ -79,14 +101,6 @@ typedef struct voice_s
     unsigned int sample_num;
 } voice_t;
 
-typedef struct triad_ratio_s
-{
-    float r1;
-    float r2;
-} triad_ratio_t;
-
-typedef float chord_ratio_t[4];
-
 typedef enum triads
 {
     TRIAD_MAJOR_R = 0,
@@ -121,15 +135,77 @@ enum {
     HarmParamTriad,
     HarmParamBypass,
     HarmParamDouble,
-    HarmParamHgain,
-    HarmParamVgain,
-    HarmParamDryMix,
+    HarmParamHgain,         // harmony voices, 0-2
+    HarmParamVgain,         // the corrected lead voice in auto and triad modes, 0-2
+    HarmParamDryMix,        // the uncorrected input, 0-1
     HarmParamSpeed,
     HarmParamTuning,
     HarmParamThreshold,
+    HarmParamGateThresh,
+    HarmParamLoop,
+    HarmParamMidiMelOut,
+    HarmParamMidiHarmOut,
+    HarmParamAlgorithm,
     HarmParamInterval
 };
 
+// AlgorithmInterp is the resampling engine of the other kernel; here it runs as PSOLA
+enum {
+    AlgorithmPSOLA = 0,
+    AlgorithmInterp,
+    AlgorithmSpectral
+};
+
+/*
+    How grains read the input, cheapest first; chosen per kernel with
+    setInterpolation(). Each tier is its own instance of the grain loop.
+*/
+enum {
+    InterpLinear = 0,
+    InterpCubic,
+    InterpSinc
+};
+
+/*
+    Where the pitch analysis runs; chosen per kernel with setAnalysisMode().
+    Inline does the whole YIN pass in the frame that ends the hop. Sliced
+    snapshots the window there and runs one YinStep* every 64 frames of the
+    following hop; threaded hands the window to a helper thread. Both of
+    those act on a hop's pitch one hop later, and keep any one callback
+    from carrying all of the analysis.
+*/
+enum {
+    AnalysisInline = 0,
+    AnalysisSliced,
+    AnalysisThreaded
+};
+
+enum {
+    YinStepFirstHalf = 0,
+    YinStepWhole,
+    YinStepCorrelate,
+    YinStepSearch,
+    YinSteps
+};
+
+// preset records store one value per address below the looper control
+static_assert(HarmParamLoop == PRESET_BANK_NPARAMS, "PresetBank parameter layout");
+
+/*
+    Voices 0 to HARM_AUTO_VOICES - 1 follow the interval table, the rest are
+    played from MIDI. Interval addresses from HarmParamInterval start with
+    the original 4-voice, 3-quality layout, then the whole table follows in
+    its own order, HARM_LEGACY_INTERVALS on.
+*/
+#define HARM_AUTO_VOICES 8
+#define HARM_MIDI_VOICES 13
+#define HARM_DEGREES 12
+#define HARM_LEGACY_INTERVALS 144
+
+static_assert(PRESET_BANK_NINTERVALS == HARM_AUTO_VOICES * HARM_DEGREES * CHORD_KEY_NQUALITIES, "PresetBank interval layout");
+static_assert(TELEMETRY_NVOICES == HARM_AUTO_VOICES + HARM_MIDI_VOICES, "telemetry voice count");
+static_assert(TELEMETRY_NAUTO == HARM_AUTO_VOICES, "telemetry auto voice count");
+
 enum {
     HarmPresetChords=0,
     HarmPresetDiatonic,
@@ -180,38 +256,47 @@ public:
         fprintf(stderr,"**** init with %d channels! at %f Hz\n", n_channels, inSampleRate);
 		
 		sampleRate = float(inSampleRate);
-#ifdef __APPLE__
-        fft_s = vDSP_create_fftsetup(11, 2);
-        
-        fft_in.realp = (float *) calloc(2048, sizeof(float));
-        fft_in.imagp = (float *) calloc(2048, sizeof(float));
-        
-        fft_out.realp = (float *) calloc(2048, sizeof(float));
-        fft_out.imagp = (float *) calloc(2048, sizeof(float));
-        
-        fft_out2.realp = (float *) calloc(2048, sizeof(float));
-        fft_out2.imagp = (float *) calloc(2048, sizeof(float));
-        
-        fft_buf.realp = (float *) calloc(2048, sizeof(float));
-        fft_buf.imagp = (float *) calloc(2048, sizeof(float));
-
-#else
-        fft_s = kiss_fft_alloc(2048,0,NULL,0);
-        ifft_s = kiss_fft_alloc(2048,1,NULL,0);
-        fft_in = (kiss_fft_cpx *) calloc(2048, sizeof(kiss_fft_cpx));
-        fft_out = (kiss_fft_cpx *) calloc(2048, sizeof(kiss_fft_cpx));
-        fft_out2 = (kiss_fft_cpx *) calloc(2048, sizeof(kiss_fft_cpx));
-#endif
+        // plans are shared by every instance; see FFT.hpp
+        fft_fwd = FFT::plan(nfft, FFTForward);
+        fft_inv = FFT::plan(nfft, FFTInverse);
+        fft_x = (float *) calloc(nfft, sizeof(float));
+        fft_spec = (float *) calloc(4 * (nfft/2 + 1), sizeof(float));
+        fft_work = (float *) calloc(FFTPlan::scratchSize(nfft), sizeof(float));
         
         ncbuf = 4096;
         cbuf = (float *) calloc(ncbuf + 3, sizeof(float));
+        ana_buf = (float *) calloc(2*maxT, sizeof(float));
         
-        nvoices = 16;
+        nvoices = HARM_AUTO_VOICES + HARM_MIDI_VOICES;
         voices = (voice_t *) calloc(nvoices, sizeof(voice_t));
         voice_ix = 1;
+        sched.clear();
+        sched_frames = 0;
+        ramping = 0;
+        voices_dirty = 1;
         
         in_buffers = (float **) calloc(channelCount, sizeof(float *));
         out_buffers = (float **) calloc(channelCount, sizeof(float *));
+
+        // per-block scratch: synthesis accumulates here, then gains are applied as vector ops
+        wet_l = (float *) calloc(max_frames, sizeof(float));
+        wet_r = (float *) calloc(max_frames, sizeof(float));
+        harm_l = (float *) calloc(max_frames, sizeof(float));
+        harm_r = (float *) calloc(max_frames, sizeof(float));
+        mix_buf = (float *) calloc(max_frames, sizeof(float));
+        voicegain_buf = (float *) calloc(max_frames, sizeof(float));
+        harmgain_buf = (float *) calloc(max_frames, sizeof(float));
+        drygain_buf = (float *) calloc(max_frames, sizeof(float));
+        midigain_buf = (float *) calloc(max_frames, sizeof(float));
+
+        ramp_frames = (ramp_count_t) (0.02 * sampleRate);
+        voicegainRamper.init();
+        harmgainRamper.init();
+        drymixRamper.init();
+        dryenableRamper.init();
+        midigainRamper.init();
+        corrRamper.init();
+        speedRamper.init();
         
         for (int k = 0; k < nvoices; k++)
         {
@@ -229,12 +314,7 @@ public:
             
             voices[k].gain = 1.0;
             voices[k].target_gain = 1.0;
-            
-            if (k >= 3)
-            {
-                voices[k].pan = ((float)(k - 3) / (float)(nvoices - 3)) - 0.5;
-                //voices[k].formant_ratio = ((float)(k - 3) / (float)(nvoices - 3)) + 0.5;
-            }
+            voices[k].pan = voice_pan(k);
         }
         
         voices[1].formant_ratio = 0.99;
@@ -252,116 +332,68 @@ public:
             grains[k].ix = 0;
             grains[k].gain = 1;
         }
+
+        // the spectral engine's frame spans about 23 ms at any rate
+        shifter.init(sampleRate > 64000 ? 2048 : 1024, nvoices);
+        shifter_live = false;
         
         memset(Tbuf, 0, 5*sizeof(float));
+        memset(Tsrt, 0, 5*sizeof(float));
         Tix = 0;
+
+        // built here so the first sinc read doesn't pay for it
+        sinc = &SincTable::shared();
         
-        // create grain window with zero-padded shoulders
-        grain_window = new float[graintablesize + 6];
-        memset(grain_window, 0, (graintablesize + 6) * sizeof(float));
-        
-        for (int k = 0; k < graintablesize; k++)
-        {
-            grain_window [3 + k] = 0.5 * (1 - cosf (2 * M_PI * k / graintablesize));
-        }
-        
-        // define equal tempered interval ratios
-        
-        intervals = interval_table + 24;
-        
-        for (int k = -23; k < 24; k++)
-        {
-            intervals[k] = powf(2.0, (float) (k) / 12);
-        }
-        
-        // define triad ratios
-        
-        triads[TRIAD_MAJOR_R].r1 = intervals[4];
-        triads[TRIAD_MAJOR_R].r2 = intervals[7];
-        triads[TRIAD_MAJOR_1].r1 = intervals[5];
-        triads[TRIAD_MAJOR_1].r2 = intervals[9];
-        triads[TRIAD_MAJOR_2].r1 = intervals[3];
-        triads[TRIAD_MAJOR_2].r2 = intervals[8];
-        
-        triads[TRIAD_MINOR_R].r1 = intervals[3];
-        triads[TRIAD_MINOR_R].r2 = intervals[7];
-        triads[TRIAD_MINOR_1].r1 = intervals[5];
-        triads[TRIAD_MINOR_1].r2 = intervals[8];
-        triads[TRIAD_MINOR_2].r1 = intervals[4];
-        triads[TRIAD_MINOR_2].r2 = intervals[9];
-        
-        triads[TRIAD_DIM_R].r1 = intervals[3];
-        triads[TRIAD_DIM_R].r2 = intervals[6];
-        triads[TRIAD_DIM_1].r1 = intervals[6];
-        triads[TRIAD_DIM_1].r2 = intervals[9];
-        triads[TRIAD_DIM_2].r1 = intervals[3];
-        triads[TRIAD_DIM_2].r2 = intervals[9];
-        
-        triads[TRIAD_SUS4_R].r1 = intervals[5];
-        triads[TRIAD_SUS4_R].r2 = intervals[7];
-        triads[TRIAD_SUS4_1].r1 = intervals[2];
-        triads[TRIAD_SUS4_1].r2 = intervals[7];
-        triads[TRIAD_SUS4_2].r1 = intervals[5];
-        triads[TRIAD_SUS4_2].r2 = intervals[10];
-        
-        triads[TRIAD_SUS2_R].r1 = intervals[2];
-        triads[TRIAD_SUS2_R].r2 = intervals[7];
-        
-        triads[TRIAD_SUS2_1].r1 = intervals[5];
-        triads[TRIAD_SUS2_1].r2 = intervals[10];
-        
-        triads[TRIAD_SUS2_2].r1 = intervals[5];
-        triads[TRIAD_SUS2_2].r2 = intervals[7];
-        
-        triads[TRIAD_AUG].r1 = intervals[4];
-        triads[TRIAD_AUG].r2 = intervals[8];
-        
-        triads[TRIAD_5TH].r1 = 3.0/2.0;
-        triads[TRIAD_5TH].r2 = 2.0;
-        
-        triads[TRIAD_OCT].r1 = 0.5;
-        triads[TRIAD_OCT].r2 = 2.0;
+        // equal tempered ratios, one copy for the whole process
+        intervals = SharedTables::intervals();
         
-        memset(midinotes, 0, 128 * sizeof(int));
+        memset(keys_down, 0, sizeof(keys_down));
+        memset(pc_count, 0, sizeof(pc_count));
+        pc_mask = 0;
+        ChordTable::shared(); // build the lookup table here rather than on the render thread
 
-        int chords_intervals[] = {0,4,7,12, -1,3,6,11, 2,5,10,14, 1,4,9,13, 0,3,8,12, -1,2,7,11, 1,6,10,13, 0,5,9,12, -1,4,8,11, 0,3,7,10, 2,6,9,14, 1,5,8,13, // major
-                           0,3,7,12, -1,2,6,11, 1,5,10,13, 0,4,9,12, -1,3,8,11, -1,2,7,10, 1,6,9,13, 0,5,8,12, 0,4,7,11, 0,3,6,10, 0,5,9,14, 1,4,8,13, // minor
-                           0,4,10,12, -1,3,9,11, -2,2,8,10, 1,4,7,9, 0,3,6,8, 2,5,7,11, 1,4,6,10, 0,3,5,9, -1,2,4,8, 1,3,7,10, 0,2,6,9, -1,1,5,8, //dom
-        };
-        for (int i = 0; i < 144; i++)
-        {
-            setParameter(HarmParamInterval+i,(float) chords_intervals[i]);
-        }
+        init_spectrum();
+        meter_in.init(sampleRate);
+        meter_lead.init(sampleRate);
+        meter_harm.init(sampleRate);
+        for (int ch = 0; ch < 2; ch++)
+            meter_out[ch].init(sampleRate);
+
+        // the factory bank is built here rather than on the render thread, like the chord table
+        program_bank = &factoryBank();
+        apply_intervals(factoryBank().preset(HarmPresetChords)->intervals);
         
 	}
     
     void fini() {
-#ifdef __APPLE__
-        vDSP_destroy_fftsetup(fft_s);
-        free(fft_in.realp);
-        free(fft_in.imagp);
-        free(fft_out.realp);
-        free(fft_out.imagp);
-        free(fft_out2.realp);
-        free(fft_out2.imagp);
-        free(fft_buf.realp);
-        free(fft_buf.imagp);
-#else
-        kiss_fft_free(fft_s);
-        free(fft_in);
-        free(fft_out);
-        free(fft_out2);
-        free(fft_buf);
-#endif
-
-        delete grain_window;
-        delete grains;
+        worker.stop();
+        looper.close();
+        recorder.stop();
+        SharedTables::release(spectrum_tables);
+        spectrum_tables = NULL;
+        shifter.fini();
+        free(fft_x);
+        free(fft_spec);
+        free(fft_work);
+
+        delete[] grains;
 
         free(cbuf);
+        free(ana_buf);
         free(voices);
         
         free(in_buffers);
         free(out_buffers);
+
+        free(wet_l);
+        free(wet_r);
+        free(harm_l);
+        free(harm_r);
+        free(mix_buf);
+        free(voicegain_buf);
+        free(harmgain_buf);
+        free(drygain_buf);
+        free(midigain_buf);
     }
 	
 	void reset() {
@@ -373,25 +405,42 @@ public:
             voices[k].target_ratio = 1.0;
             voices[k].formant_ratio = 1;
             voices[k].nextgrain = 250;
-            
-            if (k >= 3)
-            {
-                voices[k].pan = ((float)(k - 3) / (float)(nvoices - 3)) - 0.5;
-                //voices[k].formant_ratio = ((float)(k - 3) / (float)(nvoices - 3)) + 0.5;
-            }
+            voices[k].pan = voice_pan(k);
         }
         voice_ix = 1;
+        sched.clear();
+        sched_frames = 0;
+        ramping = 0;
+        voices_dirty = 1;
         
         cix = 0;
         rix = 0;
         rcnt = 256;
         T = 400;
+        input_frames = 0;
+        track_mark = 0;
+        last_nn = 0;
+        was_voiced = 0;
         
         pitchmark[0] = 0;
         pitchmark[1] = -1;
         pitchmark[2] = -1;
+
+        yin_job = false;
+        yin_next = YinSteps;
+
+        shifter.reset();
 	}
     
+    // auto voices alternate around the lead, MIDI voices spread left to right
+    float voice_pan(int k)
+    {
+        static const float auto_pan[HARM_AUTO_VOICES] = {0, 0.5, -0.5, -0.5, 0.25, -0.25, 0.75, -0.75};
+        if (k < HARM_AUTO_VOICES)
+            return auto_pan[k];
+        return ((float)(k - HARM_AUTO_VOICES) / (float)(nvoices - HARM_AUTO_VOICES)) - 0.5;
+    }
+
     float cubic (float *v, float a)
     {
         float b, c;
@@ -407,18 +456,17 @@ public:
         return v[0] * (1 - a) + v[1] * a;
     }
     
-    bof!
 	
 	void setParameter(param_address_t address, param_value_t value) {
         switch (address) {
             case HarmParamKeycenter:
-                root_key = (int) clamp(value,0.f,47.f);
+                root_key = (int) clamp(value, 0.f, (float) (12 * CHORD_KEY_NQUALITIES - 1));
                 break;
             case HarmParamInversion:
                 inversion = (int) clamp(value,0.f,3.f);
                 break;
             case HarmParamNvoices:
-                n_auto = (int) clamp(value,1.f,4.f);
+                n_auto = (int) clamp(value, 1.f, (float) HARM_AUTO_VOICES);
                 //fprintf(stderr, "nvoices: %d\n", n_auto);
                 break;
             case HarmParamAuto:
@@ -426,11 +474,11 @@ public:
                 //fprintf(stderr, "autotune: %d\n", autotune);
                 break;
             case HarmParamAutoStrength:
-                corr_strength = clamp(value, 0.f, 1.f);
+                corrRamper.setUIValue(clamp(value, 0.f, 1.f));
                 break;
             case HarmParamMidi:
                 midi_enable = (int) clamp(value,0.f,1.f);
-                printf("set midi_enable to %d\n", midi_enable);
+                //printf("set midi_enable to %d\n", midi_enable);
                 break;
             case HarmParamMidiLink:
                 midi_link = (int) clamp(value,0.f,1.f);
@@ -443,19 +491,19 @@ public:
                 break;
             case HarmParamBypass:
                 bypass = (int) clamp(value,0.f,1.f);
-                printf("set bypass to %d\n", bypass);
+                //printf("set bypass to %d\n", bypass);
                 break;
             case HarmParamHgain:
-                harmgain_target = clamp(value, 0.f, 2.f);
+                harmgainRamper.setUIValue(clamp(value, 0.f, 2.f));
                 break;
             case HarmParamVgain:
-                voicegain_target = clamp(value, 0.f, 2.f);
+                voicegainRamper.setUIValue(clamp(value, 0.f, 2.f));
                 break;
             case HarmParamDryMix:
-                dry_mix = clamp(value, 0.f, 1.f);
+                drymixRamper.setUIValue(clamp(value, 0.f, 1.f));
                 break;
             case HarmParamSpeed:
-                speed = clamp(value, 0.f, 1.f);
+                speedRamper.setUIValue(clamp(value, 0.f, 1.f));
                 break;
             case HarmParamTuning:
                 baseTuning = value;
@@ -463,21 +511,29 @@ public:
             case HarmParamThreshold:
                 threshold = value;
                 break;
+            case HarmParamGateThresh:
+                gate_thresh = clamp(value, -96.f, 0.f);
+                gate_level = powf(10.f, gate_thresh / 20.f);
+                break;
+            case HarmParamLoop:
+                looper.setMode((int) value);
+                break;
+            case HarmParamMidiMelOut:
+                midi_tx_mel = (int) clamp(value, 0.f, 1.f);
+                break;
+            case HarmParamMidiHarmOut:
+                midi_tx_harm = (int) clamp(value, 0.f, 1.f);
+                break;
+            case HarmParamAlgorithm:
+                algorithm = (int) clamp(value, 0.f, (float) AlgorithmSpectral);
+                break;
             case HarmParamInterval:
             default:
-                int addr = (int) address - (int) HarmParamInterval;
-                int scale_degree = addr / 4;
-                
-                chord_ratio_t * table = major_chord_table;
-                if (scale_degree > 11)
-                    table = minor_chord_table;
-                if (scale_degree > 23)
-                    table = blues_chord_table;
-                
-                float * ratios = (float *) &table[scale_degree%12];
-                //fprintf(stderr, "addr = %d\n", addr);
-                interval_offsets[addr] = (int) value;
-                ratios[addr & 0x3] = intervals[(int) value];
+                // unhandled addresses below the interval block land here too
+                int32_t * cell = interval_cell((int) address - (int) HarmParamInterval);
+                if (!cell || value < -23 || value > 23)
+                    break;
+                *cell = (int32_t) value;
                 break;
         }
 	}
@@ -493,7 +549,7 @@ public:
             case HarmParamAuto:
                 return (float) autotune;
             case HarmParamAutoStrength:
-                return (float) corr_strength;
+                return corrRamper.getUIValue();
             case HarmParamMidi:
                 return (float) midi_enable;
             case HarmParamMidiLink:
@@ -505,31 +561,31 @@ public:
             case HarmParamBypass:
                 return (float) bypass;
             case HarmParamHgain:
-                return harmgain_target;
+                return harmgainRamper.getUIValue();
             case HarmParamVgain:
-                return voicegain_target;
+                return voicegainRamper.getUIValue();
             case HarmParamDryMix:
-                return dry_mix;
+                return drymixRamper.getUIValue();
             case HarmParamSpeed:
-                return speed;
+                return speedRamper.getUIValue();
             case HarmParamTuning:
                 return baseTuning;
             case HarmParamThreshold:
                 return threshold;
+            case HarmParamGateThresh:
+                return gate_thresh;
+            case HarmParamLoop:
+                return (float) looper.mode();
+            case HarmParamMidiMelOut:
+                return (float) midi_tx_mel;
+            case HarmParamMidiHarmOut:
+                return (float) midi_tx_harm;
+            case HarmParamAlgorithm:
+                return (float) algorithm;
             case HarmParamInterval:
             default:
-                int addr = (int) address - (int) HarmParamInterval;
-                int scale_degree = addr / 4;
-                
-                chord_ratio_t * table = major_chord_table;
-                if (scale_degree > 11)
-                    table = minor_chord_table;
-                if (scale_degree > 23)
-                    table = blues_chord_table;
-                
-                float * ratios = (float *) &table[scale_degree%12];
-                return interval_offsets[addr];;
-                return round(log2(ratios[addr & 0x3])*12);
+                int32_t * cell = interval_cell((int) address - (int) HarmParamInterval);
+                return cell ? (float) *cell : 0;
         }
 	}
 
@@ -543,115 +599,205 @@ public:
     }
 
 
-    void setPreset(int preset_ix_)
+    // interval table entry for an address relative to HarmParamInterval, NULL if there isn't one
+    int32_t * interval_cell(int addr)
     {
-        int chords_intervals[] = {
-                0,4,7,12, -1,3,6,11, 2,5,10,14, 1,4,9,13, 0,3,8,12, -1,2,7,11, 1,6,10,13, 0,5,9,12, -1,4,8,11, 0,3,7,10, 2,6,9,14, 1,5,8,13, // major
-                0,3,7,12, -1,2,6,11, 1,5,10,13, 0,4,9,12, -1,3,8,11, -1,2,7,10, 1,6,9,13, 0,5,8,12, 0,4,7,11, 0,3,6,10, 0,5,9,14, 1,4,8,13, // minor
-                0,4,10,12, -1,3,9,11, -2,2,8,10, 1,4,7,9, 0,3,6,8, 2,5,7,11, 1,4,6,10, 0,3,5,9, -1,2,4,8, 1,3,7,10, 0,2,6,9, -1,1,5,8, //dom
-        };
-        int diatonic_intervals[] = {
-                0,4,7,12, -1,3,6,11, 0,5,10,12, 1,4,9,13, 0,3,8,12, 0,2,7,11, 1,6,10,13, 0,5,9,12, -1,4,8,11, 0,3,7,12, 1,2,6,13, 0,1,5,12, // major
-                0,3,7,12, -1,2,6,11, 0,5,10,12, 0,4,9,12, -1,3,8,11, -2,2,7,10, 1,6,9,13, 0,5,8,12, -1,4,7,11, 0,3,6,10, 2,5,9,14, 1,4,8,13, // minor
-                0,4,7,10, -1,3,9,11, -2,2,8,10, 1,4,7,9, 0,3,6,8, 2,5,7,11, 1,4,6,10, 0,3,5,9, -1,2,4,8, 1,3,7,10, 0,2,6,9, -1,1,5,8, //dom
-        };
-        int chromatic_intervals[] = {
-                0,4,7,12, 0,3,6,12, 0,3,7,12, 0,3,9,12, 0,3,8,12, 0,4,7,12, 0,3,9,12, 0,5,9,12, 0,4,8,12, 0,5,8,12, 0,4,7,12, 0,3,6,12, // major
-                0,3,7,12, 0,4,7,12, 0,3,9,12, 0,4,9,12, 0,3,8,12, 0,3,7,12, 0,6,9,12, 0,4,7,12, 0,4,7,12, 0,3,6,12, 0,5,9,12, 0,3,7,12, // minor
-                0,4,7,12, 0,3,9,12, 0,2,8,12, 0,4,7,12, 0,3,6,12, 0,5,7,12, 0,4,6,12, 0,3,5,12, 0,2,4,12, 0,3,7,12, 0,2,6,12, 0,1,5,12, //dom
-        };
-        int barbershop_intervals[] = {
-                0,4,7,12, 0,3,5,9, 0,3,5,9, 0,3,6,9, 0,3,8,12, 0,2,6,9, 0,3,5,9, 0,5,9,12, 0,3,6,9, 0,3,5,9, 0,3,6,9, 0,3,6,8, // major
-                0,3,7,12, 0,4,7,10, 0,3,5,9, 0,4,9,12, 0,3,6,8, 0,3,7,9, 0,3,6,8, 0,5,8,12, 0,4,7,10, 0,3,6,10, 0,4,7,10, 0,3,6,8, // minor
-                0,4,7,10, 0,3,6,9, 0,3,5,9, 0,3,6,9, 0,3,6,8, 0,2,6,9, 0,3,5,9, 0,3,5,9, 0,2,4,8, 0,3,6,9, 0,2,6,9, 0,4,7,10 //dom
-        };
-        int justmidi_intervals[] = {
-                0,4,7,12, -1,3,6,11, 2,5,10,14, 1,4,9,13, 0,3,8,12, -1,2,7,11, 1,6,10,13, 0,5,9,12, -1,4,8,11, 0,3,7,10, 2,6,9,14, 1,5,8,13, // major
-                0,3,7,12, -1,2,6,11, 1,5,10,13, 0,4,9,12, -1,3,8,11, -1,2,7,10, 1,6,9,13, 0,5,8,12, 0,4,7,11, 0,3,6,10, 0,5,9,14, 1,4,8,13, // minor
-                0,4,10,12, -1,3,9,11, -2,2,8,10, 1,4,7,9, 0,3,6,8, 2,5,7,11, 1,4,6,10, 0,3,5,9, -1,2,4,8, 1,3,7,10, 0,2,6,9, -1,1,5,8, //dom
+        if (addr < 0)
+            return NULL;
+        if (addr < HARM_LEGACY_INTERVALS)
+            return interval_offsets.cell(addr & 3, addr / 48, (addr / 4) % 12);
+        addr -= HARM_LEGACY_INTERVALS;
+        if (addr < interval_offsets.size())
+            return interval_offsets.data() + addr;
+        return NULL;
+    }
+
+    // parameter address of one interval in the full table
+    static param_address_t intervalAddress(int quality, int degree, int voice)
+    {
+        return HarmParamInterval + HARM_LEGACY_INTERVALS + (quality * HARM_DEGREES + degree) * HARM_AUTO_VOICES + voice;
+    }
+
+    // offsets already checked to be in -23..23, as PresetBank does when it opens a bank
+    void apply_intervals(const int32_t * offsets)
+    {
+        memcpy(interval_offsets.data(), offsets, PRESET_BANK_NINTERVALS * sizeof(int32_t));
+    }
+
+    /*
+        The factory presets, in HarmPreset order. Only the parameters listed
+        here are part of a preset; the rest stay as the user left them.
+    */
+    static const PresetBank & factoryBank()
+    {
+        typedef struct factory_preset_s
+        {
+            const char * name;
+            float inversion, nvoices, autotune, triad;
+            int8_t intervals[144];
+        } factory_preset_t;
+
+        static const factory_preset_t factory[] = {
+            {"Chords", 2, 4, 0, -1,
+                 0,4,7,12, -1,3,6,11, 2,5,10,14, 1,4,9,13, 0,3,8,12, -1,2,7,11, 1,6,10,13, 0,5,9,12, -1,4,8,11, 0,3,7,10, 2,6,9,14, 1,5,8,13,  // major
+                 0,3,7,12, -1,2,6,11, 1,5,10,13, 0,4,9,12, -1,3,8,11, -1,2,7,10, 1,6,9,13, 0,5,8,12, 0,4,7,11, 0,3,6,10, 0,5,9,14, 1,4,8,13,  // minor
+                 0,4,10,12, -1,3,9,11, -2,2,8,10, 1,4,7,9, 0,3,6,8, 2,5,7,11, 1,4,6,10, 0,3,5,9, -1,2,4,8, 1,3,7,10, 0,2,6,9, -1,1,5,8,  // dom
+            },
+            {"Diatonic", 2, 4, 0, -1,
+                 0,4,7,12, -1,3,6,11, 0,5,10,12, 1,4,9,13, 0,3,8,12, 0,2,7,11, 1,6,10,13, 0,5,9,12, -1,4,8,11, 0,3,7,12, 1,2,6,13, 0,1,5,12,  // major
+                 0,3,7,12, -1,2,6,11, 0,5,10,12, 0,4,9,12, -1,3,8,11, -2,2,7,10, 1,6,9,13, 0,5,8,12, -1,4,7,11, 0,3,6,10, 2,5,9,14, 1,4,8,13,  // minor
+                 0,4,7,10, -1,3,9,11, -2,2,8,10, 1,4,7,9, 0,3,6,8, 2,5,7,11, 1,4,6,10, 0,3,5,9, -1,2,4,8, 1,3,7,10, 0,2,6,9, -1,1,5,8,  // dom
+            },
+            {"Chromatic", 2, 4, 0, -1,
+                 0,4,7,12, 0,3,6,12, 0,3,7,12, 0,3,9,12, 0,3,8,12, 0,4,7,12, 0,3,9,12, 0,5,9,12, 0,4,8,12, 0,5,8,12, 0,4,7,12, 0,3,6,12,  // major
+                 0,3,7,12, 0,4,7,12, 0,3,9,12, 0,4,9,12, 0,3,8,12, 0,3,7,12, 0,6,9,12, 0,4,7,12, 0,4,7,12, 0,3,6,12, 0,5,9,12, 0,3,7,12,  // minor
+                 0,4,7,12, 0,3,9,12, 0,2,8,12, 0,4,7,12, 0,3,6,12, 0,5,7,12, 0,4,6,12, 0,3,5,12, 0,2,4,12, 0,3,7,12, 0,2,6,12, 0,1,5,12,  // dom
+            },
+            {"Barbershop", 1, 4, 0, -1,
+                 0,4,7,12, 0,3,5,9, 0,3,5,9, 0,3,6,9, 0,3,8,12, 0,2,6,9, 0,3,5,9, 0,5,9,12, 0,3,6,9, 0,3,5,9, 0,3,6,9, 0,3,6,8,  // major
+                 0,3,7,12, 0,4,7,10, 0,3,5,9, 0,4,9,12, 0,3,6,8, 0,3,7,9, 0,3,6,8, 0,5,8,12, 0,4,7,10, 0,3,6,10, 0,4,7,10, 0,3,6,8,  // minor
+                 0,4,7,10, 0,3,6,9, 0,3,5,9, 0,3,6,9, 0,3,6,8, 0,2,6,9, 0,3,5,9, 0,3,5,9, 0,2,4,8, 0,3,6,9, 0,2,6,9, 0,4,7,10,  // dom
+            },
+            {"JustMidi", 2, 1, 0, -1,
+                 0,4,7,12, 0,3,6,11, 0,5,10,14, 0,4,9,13, 0,3,8,12, 0,2,7,11, 0,6,10,13, 0,5,9,12, 0,4,8,11, 0,3,7,10, 0,6,9,14, 0,5,8,13,  // major
+                 0,3,7,12, 0,2,6,11, 0,5,10,13, 0,4,9,12, 0,3,8,11, 0,2,7,10, 0,6,9,13, 0,5,8,12, 0,4,7,11, 0,3,6,10, 0,5,9,14, 0,4,8,13,  // minor
+                 0,4,10,12, 0,3,9,11, 0,2,8,10, 0,4,7,9, 0,3,6,8, 0,5,7,11, 0,4,6,10, 0,3,5,9, 0,2,4,8, 0,3,7,10, 0,2,6,9, 0,1,5,8,  // dom
+            },
+            {"Bohemian?", 3, 4, 0, -1,
+                 0,4,7,9, 0,3,6,8, 0,3,7,10, 0,3,6,9, 0,3,5,8, 0,4,7,9, 0,3,6,9, 0,2,5,9, 0,3,6,9, 0,3,5,8, 0,2,6,9, 0,1,5,8,  // major
+                 0,3,7,10, 0,3,6,8, 0,3,6,9, 0,4,7,9, 0,3,5,8, 0,3,6,9, 0,3,6,9, 0,3,5,8, 0,3,6,9, 0,3,6,10, 0,4,7,10, 0,3,6,9,  // minor
+                 0,4,7,10, 0,3,6,9, 0,3,5,8, 0,3,6,9, 0,3,6,8, 0,2,5,9, 0,3,5,9, 0,3,5,9, 0,2,6,9, 0,1,5,8, 0,2,6,9, 0,3,6,9,  // dom
+            },
+            {"Bass!", 1, 1, 0, 1,
+                 -12,-12,-12,-12, -12,-12,-12,-12, -12,-12,-12,-12, -12,-12,-12,-12, -12,-12,-12,-12, -12,-12,-12,-12, -12,-12,-12,-12, -12,-12,-12,-12, -12,-12,-12,-12, -12,-12,-12,-12, -12,-12,-12,-12, -12,-12,-12,-12,  // major
+                 -12,-12,-12,-12, -12,-12,-12,-12, -12,-12,-12,-12, -12,-12,-12,-12, -12,-12,-12,-12, -12,-12,-12,-12, -12,-12,-12,-12, -12,-12,-12,-12, -12,-12,-12,-12, -12,-12,-12,-12, -12,-12,-12,-12, -12,-12,-12,-12,  // minor
+                 -12,-12,-12,-12, -12,-12,-12,-12, -12,-12,-12,-12, -12,-12,-12,-12, -12,-12,-12,-12, -12,-12,-12,-12, -12,-12,-12,-12, -12,-12,-12,-12, -12,-12,-12,-12, -12,-12,-12,-12, -12,-12,-12,-12, -12,-12,-12,-12,  // dom
+            },
+            {"4ths", 2, 3, 0, 1,
+                 0,-5,7,12, 0,0,0,0, 0,0,0,0, 0,0,0,0, 0,0,0,0, 0,0,0,0, 0,0,0,0, 0,0,0,0, 0,0,0,0, 0,0,0,0, 0,0,0,0, 0,0,0,0,  // major
+                 0,0,0,0, 0,0,0,0, 0,0,0,0, 0,0,0,0, 0,0,0,0, 0,0,0,0, 0,0,0,0, 0,0,0,0, 0,0,0,0, 0,0,0,0, 0,0,0,0, 0,0,0,0,  // minor
+                 0,0,0,0, 0,0,0,0, 0,0,0,0, 0,0,0,0, 0,0,0,0, 0,0,0,0, 0,0,0,0, 0,0,0,0, 0,0,0,0, 0,0,0,0, 0,0,0,0, 0,0,0,0,  // dom
+            },
+            {"Modes", 3, 4, 0, -1,
+                 0,4,7,11, 0,3,6,10, 0,3,7,10, 0,3,6,9, 0,3,7,10, 0,4,7,11, 0,3,6,10, 0,4,7,10, 0,4,8,11, 0,3,7,10, 0,4,7,11, 0,3,6,10,  // major
+                 0,3,7,11, 0,3,7,10, 0,3,7,10, 0,4,8,11, 0,4,7,10, 0,4,7,10, 0,4,7,10, 0,4,7,10, 0,4,7,11, 0,3,6,10, 0,3,6,10, 0,3,6,10,  // minor
+                 0,4,7,10, 0,3,7,10, 0,3,7,10, 0,3,6,10, 0,3,6,10, 0,4,7,11, 0,3,7,10, 0,3,7,10, 0,3,7,10, 0,3,7,10, 0,4,7,11, 0,4,7,10,  // dom
+            },
         };
 
-        int bohemian_intervals[] = {};
-        int bass_intervals[] = {};
-        int fourths_intervals[] = {};
-        int modes_intervals[] = {};
+        static const PresetBank bank([] {
+            const int n = sizeof(factory) / sizeof(factory[0]);
+            std::vector<harm_preset_t> presets(n);
+            for (int k = 0; k < n; k++)
+            {
+                harm_preset_t & p = presets[k];
+                memset(&p, 0, sizeof(p));
+                snprintf(p.name, sizeof(p.name), "%s", factory[k].name);
+                for (int i = 0; i < PRESET_BANK_NPARAMS; i++)
+                    p.params[i] = NAN;
+                p.params[HarmParamInversion] = factory[k].inversion;
+                p.params[HarmParamNvoices] = factory[k].nvoices;
+                p.params[HarmParamAuto] = factory[k].autotune;
+                p.params[HarmParamTriad] = factory[k].triad;
+                for (int q = 0; q < CHORD_KEY_NQUALITIES; q++)
+                    for (int d = 0; d < HARM_DEGREES; d++)
+                        factory_voicing(factory[k].intervals, q, d, p.intervals + (q * HARM_DEGREES + d) * HARM_AUTO_VOICES);
+            }
+            return PresetBank::build(presets.data(), n);
+        }());
+        return bank;
+    }
 
-        int * intervals = chords_intervals;
+    /*
+        One degree of a factory preset in the full table. Major, minor and
+        dominant come from the preset's own four voices; the modes stack
+        thirds on the scale tone at or below the sung note. The voices past
+        the fourth double the second and third an octave down, then an
+        octave up, folded back into range.
+    */
+    static void factory_voicing(const int8_t * legacy, int quality, int degree, int32_t * row)
+    {
+        if (quality < CHORD_KEY_DORIAN)
+        {
+            for (int v = 0; v < 4; v++)
+                row[v] = legacy[quality * 48 + degree * 4 + v];
+        }
+        else
+        {
+            static const int scales[3][7] = {
+                {0, 2, 3, 5, 7, 9, 10},     // dorian
+                {0, 2, 4, 5, 7, 9, 10},     // mixolydian
+                {0, 2, 3, 5, 7, 8, 11},     // harmonic minor
+            };
+            const int * scale = scales[quality - CHORD_KEY_DORIAN];
+            int s = 6;
+            while (scale[s] > degree)
+                s--;
+            row[0] = scale[s] - degree;
+            row[1] = scale[(s + 2) % 7] + 12 * ((s + 2) / 7) - degree;
+            row[2] = scale[(s + 4) % 7] + 12 * ((s + 4) / 7) - degree;
+            row[3] = row[0] + 12;
+        }
 
+        static_assert(HARM_AUTO_VOICES == 8, "one doubling for each voice past the fourth");
+        static const int source[4] = {1, 2, 1, 2};
+        static const int shift[4] = {-12, -12, 12, 12};
+        for (int v = 4; v < HARM_AUTO_VOICES; v++)
+        {
+            int x = row[source[v - 4]] + shift[v - 4];
+            while (x < -23)
+                x += 12;
+            while (x > 23)
+                x -= 12;
+            row[v] = x;
+        }
+    }
 
-        preset_ix = preset_ix_;
-        switch (preset_ix_)
-        {
-            case HarmPresetChords:
-                intervals = chords_intervals;
-                setParameter(HarmParamNvoices,4);
-                setParameter(HarmParamInversion,3);
-                setParameter(HarmParamAuto,0);
-                setParameter(HarmParamTriad,-1);
-                break;
-            case HarmPresetDiatonic:
-                intervals = diatonic_intervals;
-                setParameter(HarmParamNvoices,4);
-                setParameter(HarmParamInversion,3);
-                setParameter(HarmParamAuto,0);
-                setParameter(HarmParamTriad,-1);
-                break;
-            case HarmPresetChromatic:
-                intervals = chromatic_intervals;
-                setParameter(HarmParamNvoices,4);
-                setParameter(HarmParamInversion,3);
-                setParameter(HarmParamAuto,0);
-                setParameter(HarmParamTriad,-1);
-                break;
-            case HarmPresetBarbershop:
-                intervals = barbershop_intervals;
-                setParameter(HarmParamNvoices,4);
-                setParameter(HarmParamInversion,2);
-                setParameter(HarmParamAuto,0);
-                setParameter(HarmParamTriad,-1);
-                break;
-            case HarmPresetMIDI:
-                intervals = chords_intervals;
-                setParameter(HarmParamNvoices,1);
-                setParameter(HarmParamInversion,0);
-                setParameter(HarmParamAuto,0);
-                setParameter(HarmParamTriad,-1);
-                break;
-            case HarmPresetBohemian:
-                intervals = chords_intervals;
-                break;
-            case HarmPresetBass:
-                setParameter(HarmParamNvoices,1);
-                setParameter(HarmParamInversion,1);
-                setParameter(HarmParamAuto,0);
-                setParameter(HarmParamTriad,0);
-                intervals = chords_intervals;
-                break;
-            case HarmPreset4ths:
-                setParameter(HarmParamNvoices,1);
-                setParameter(HarmParamInversion,1);
-                setParameter(HarmParamAuto,0);
-                setParameter(HarmParamTriad,0);
-                intervals = chords_intervals;
-                break;
-            case HarmPresetModes:
-                setParameter(HarmParamNvoices,4);
-                setParameter(HarmParamInversion,3);
-                setParameter(HarmParamAuto,0);
-                setParameter(HarmParamTriad,-1);
-                intervals = chords_intervals;
-                break;
-            default:
-                preset_ix = 0;
-                return;
+    void setPreset(int preset_ix_)
+    {
+        const harm_preset_t * p = factoryBank().preset(preset_ix_);
+        if (!p)
+        {
+            preset_ix = 0;
+            return;
         }
+        preset_ix = preset_ix_;
+        applyPreset(*p);
+    }
 
-        for (int i = 0; i < 144; i++)
+    // any preset record: the parameters it sets, then the interval table in one copy
+    void applyPreset(const harm_preset_t & p)
+    {
+        for (int k = 0; k < PRESET_BANK_NPARAMS; k++)
         {
-            setParameter(HarmParamInterval+i,(float) intervals[i]);
+            if (!std::isnan(p.params[k]))
+                setParameter(k, p.params[k]);
         }
+        apply_intervals(p.intervals);
+    }
+
+    // the inverse, for hosts saving the current state into a bank
+    void capturePreset(harm_preset_t & p, const char * name)
+    {
+        memset(&p, 0, sizeof(p));
+        snprintf(p.name, sizeof(p.name), "%s", name);
+        for (int k = 0; k < PRESET_BANK_NPARAMS; k++)
+            p.params[k] = getParameter(k);
+        memcpy(p.intervals, interval_offsets.data(), sizeof(p.intervals));
+    }
 
+    /*
+        Bank that MIDI program changes select from; NULL goes back to the
+        factory presets. Host thread, while not rendering: the kernel reads
+        records straight out of the bank, so it has to outlive its use here.
+    */
+    void setPresetBank(const PresetBank * bank)
+    {
+        program_bank = bank ? bank : &factoryBank();
     }
+
+    const PresetBank & presetBank() const { return *program_bank; }
+
     int getPreset()
     {
         return preset_ix;
@@ -660,7 +806,13 @@ public:
 #ifdef __APPLE__
 
 	void startRamp(AUParameterAddress address, AUValue value, AUAudioFrameCount duration) override {
-        return;
+        // setParameter clamps and posts the new value; picking it up here
+        // starts the ramp at this sample with the host's duration.
+        setParameter(address, value);
+
+        ParameterRamper * ramper = ramperFor(address);
+        if (ramper)
+            ramper->dezipperCheck(duration);
 	}
 
 	void setBuffers(AudioBufferList* inBufferList, AudioBufferList* outBufferList) {
@@ -674,23 +826,46 @@ public:
     }
     
     virtual void handleMIDIEvent(midi_event_t const& midiEvent) override {
-        if (midiEvent.length != 3) return;
-        uint8_t status = midiEvent.data[0] & 0xF0;
-        uint8_t channel = midiEvent.data[0] & 0x0F; // works in omni mode.
+        handleMIDIMessage(midiEvent.data, midiEvent.length);
+    }
+
+#else
+
+#endif
+
+    // raw channel message, for hosts that don't deliver AUMIDIEvents
+    void handleMIDIMessage(const uint8_t * data, int length) {
+        if (length < 2) return;
+        uint8_t status = data[0] & 0xF0;
+        uint8_t channel = data[0] & 0x0F; // works in omni mode.
         
         if (channel != 0)
             return;
         
+        if (status == 0xC0) // program change, the only two-byte message we take
+        {
+            int program = data[1] & 0x7F;
+            const harm_preset_t * p = program_bank ? program_bank->preset(program) : NULL;
+            if (p)
+            {
+                preset_ix = program;
+                applyPreset(*p);
+            }
+            send_event(HarmEventProgramChange, program, 0, program);
+            return;
+        }
+        if (length != 3) return;
+
         switch (status) {
             case 0x80 : { // note off
-                uint8_t note = midiEvent.data[1];
+                uint8_t note = data[1];
                 if (note > 127) break;
                 remnote((int)note);
                 break;
             }
             case 0x90 : { // note on
-                uint8_t note = midiEvent.data[1];
-                uint8_t veloc = midiEvent.data[2];
+                uint8_t note = data[1];
+                uint8_t veloc = data[2];
                 if (note > 127 || veloc > 127) break;
                 if (veloc == 0)
                     remnote((int)note);
@@ -699,11 +874,13 @@ public:
                 break;
             }
             case 0xB0 : { // control
-                uint8_t num = midiEvent.data[1];
-                uint8_t val = midiEvent.data[2];
+                uint8_t num = data[1];
+                uint8_t val = data[2];
+                // every controller goes to the host too, for MIDI learn
+                send_event(HarmEventControlChange, num, val, val);
                 if (num == 11)
                 {
-                    midigain = (float) val / 127.0;
+                    midigainRamper.startRamp((float) val / 127.0, ramp_frames);
                 }
                 if (num == 64)
                 {
@@ -717,49 +894,63 @@ public:
         }
     }
 
-#else
-
-#endif
-
 #ifdef __APPLE__
 	void process(frame_count_t frameCount, frame_count_t bufferOffset) override {
 #else
     void process(frame_count_t frameCount, frame_count_t bufferOffset) {
 #endif
 
-		int channelCount = n_channels;
+        // scratch buffers hold max_frames; split anything longer
+        if (frameCount > max_frames)
+        {
+            process(max_frames, bufferOffset);
+            process(frameCount - max_frames, bufferOffset + max_frames);
+            return;
+        }
+
         sample_count += frameCount;
-        
-        if (bufferOffset != 0)
-            fprintf(stderr, "buffer_offset = %d\n", bufferOffset);
-        
+        uint64_t block_start = input_frames;
+        input_frames += frameCount;
+
+        tapping = recorder.begin();
+        tap_voices = tapping && (recorder.stemMask() & RecordStemVoices);
+        if (tap_voices)
+            recorder.clearVoiceBuffers(frameCount);
+
+        if (bypass)
+        {
+            release_midi_notes(bufferOffset);
+            render_bypass(frameCount, bufferOffset);
+            end_block(frameCount, bufferOffset, false);
+            return;
+        }
+
+        // below the gate with nothing left ringing out: skip analysis and synthesis entirely
+        bool spectral = algorithm == AlgorithmSpectral;
+        if (!update_gate(in_buffers[0] + bufferOffset, frameCount) && grains_idle() && (!spectral || shifter.idle()))
+        {
+            release_midi_notes(bufferOffset);
+            render_silence(frameCount, bufferOffset);
+            end_block(frameCount, bufferOffset, false);
+            return;
+        }
+        silent_frames = 0;
+
+        prepare_ramps(frameCount);
+        voices_dirty = 1;
+
+        memset(wet_l, 0, frameCount * sizeof(float));
+        memset(wet_r, 0, frameCount * sizeof(float));
+        memset(harm_l, 0, frameCount * sizeof(float));
+        memset(harm_r, 0, frameCount * sizeof(float));
+
         // For each sample.
 		for (int frameIndex = 0; frameIndex < frameCount; ++frameIndex)
         {
             int frameOffset = int(frameIndex + bufferOffset);
-						
-            float* in  = in_buffers[0] + frameOffset;
-            float* out = out_buffers[0] + frameOffset;
-            float* out2 = out;
-            
-            if (channelCount > 1)
-            {
-                out2 = out_buffers[1] + frameOffset;
-            }
 
-            cbuf[cix] = *in;
-            
-            if (bypass)
-            {
-                *out = *in / 2;
-                *out2 = *out;
-                continue;
-            }
-            else
-            {
-                *out = *out2 = 0;
-            }
-            
+            cbuf[cix] = in_buffers[0][frameOffset];
+
             if (cix < 3)
             {
                 cbuf[ncbuf+cix] = cbuf[cix];
@@ -767,11 +958,22 @@ public:
             if (++cix >= ncbuf)
                 cix = 0;
             
+            if (!gate_open)
+            {
+                // let the remaining grains ring out, but don't analyze or start new ones
+                release_midi_notes(frameOffset);
+                render_grains(frameIndex);
+                continue;
+            }
+
+            // the synthesis reference point trails the newest input by 2*maxT
+            double ref = (double) (block_start + frameIndex + 1) - 2*maxT;
+
             if (--rcnt == 0)
             {
                 rcnt = 256;
                 int oldT = T;
-                float p = estimate_pitch(cix - 2*maxT);
+                float p = track ? pitch_track_period(track, ref) : next_pitch(cix - 2*maxT);
                 if (p > 0)
                     T = p;
                 else
@@ -780,210 +982,921 @@ public:
                 voiced = (p != 0);
                 
                 update_voices();
+                voices_dirty = 1;
+                send_midi_notes(frameOffset);
             }
             
-            float dp = cix - 2*maxT - pitchmark[0];
-            if (dp < 0)
-                dp += ncbuf;
-            
-            if (dp > (T + T/4))
-            {
-                findmark();
-            
-                //printf("pitchmark[0,1,2] = %.2f,%.2f,%.2f\ninput = %d\n", pitchmark[0],pitchmark[1],pitchmark[2],cix);
-            }
-            
-            int first_psola_voice = 0;
-            
-            voicegain_target = 0;
-            if (!autotune && triad < 0)
+            // the sliced analysis steps land mid-hop, away from the trigger
+            if (yin_next < YinSteps && (int) rcnt % 64 == 32)
             {
-                first_psola_voice = 1;
-                voicegain_target = dry_mix;
+                yin_raw = yin_step(ana_buf, yin_next);
+                yin_next++;
             }
-            
-            *out = *in * voicegain / 2;
-            *out2 = *out;
-            
-            int nonvoiced_count = (int) (voicegain > 0);
-            
-            // Ramp Gain
-            voicegain += .001 * sgn(voicegain_target - voicegain);
-            harmgain += .001 * sgn(harmgain_target - harmgain);
-    
-            for (int vix = first_psola_voice; vix < nvoices; vix++)
+
+            if (track)
             {
-                voices[vix].target_gain = ((voiced || nonvoiced_count == 0) && voices[vix].midinote > 0) ? 1.0 : 0.0;
-                
-                if (voices[vix].target_gain > 0)
-                    nonvoiced_count++;
-                
-                if (vix == 0 && (autotune || triad >= 0)) voices[vix].target_gain = dry_mix;
-                //voices[vix].gain += .001 * sgn(voices[vix].target_gain - voices[vix].gain);
-                voices[vix].gain = inc_to_target(voices[vix].gain, voices[vix].target_gain, 0.9, 0.001, -0.0004);
-                
-                if (voices[vix].gain < 0.001)
-                {
-                    continue;
-                }
-                
-                if (vix > n_auto && !midi_enable)
-                    continue;
-                
-                float unvoiced_offset = 0;
-//                if (!voiced && vix > 5)
-//                {
-//                    continue;
-//                    //unvoiced_offset = T * (0.5 - (float) rand() / RAND_MAX);
-//                }
-                
-                float midigain_local = 1.0;
-                if (vix >= 3)
-                    midigain_local = midigain;
-                
-                if (--voices[vix].nextgrain < 0)
-                {
-                    // search for the first open grain
-                    int found_grain = 0;
-                    for (int k = 0; k < ngrains; k++)
-                    {
-                        if (grains[k].size < 0)
-                        {
-                            grains[k].size = 2 * T;
-                            grains[k].start = pitchmark[0] - voices[vix].nextgrain - T + unvoiced_offset;
-                            grains[k].ratio = voices[vix].formant_ratio;
-                            
-                            grains[k].ix = 0;
-                            grains[k].gain = midigain_local * (float) voices[vix].midivel / 127.0;
-                            grains[k].pan = voices[vix].pan;
-                            grains[k].vix = vix;
-                            
-                            if (vix == 0)
-                            {
-                                grains[k].gain = 1.0;
-                            }
-                            
-                            if (!voiced)
-                            {
-                                grains[k].ratio = 1.0; //voices[vix].ratio;
-                            }
-                            else
-                            {
-                                // for low transpositions, increase gain
-                                if (voices[vix].ratio < 1)
-                                    grains[k].gain *= powf(1/voices[vix].ratio,0.5);
-                                
-                                // for high transpositions, start shortening the blips.
-                                if (voices[vix].ratio > 1.7)
-                                {
-                                    //grains[k].size = T/2;
-                                    grains[k].ratio *= (1 + (voices[vix].ratio - 1.7)/2);
-                                    //grains[k].gain *= powf(voices[vix].ratio,0.5);
-                                }
-                            }
-                            
-                            voices[vix].nextgrain += voiced ? (T / voices[vix].ratio) : T;
-                            
-                            //printf("maxgrain = %d\n", maxgrain);
-                            if (k > maxgrain)
-                                maxgrain = k;
-                            
-                            found_grain = true;
-                            break;
-                        }
-                    }
-                    
-                    if (found_grain == false)
-                    {
-                        fprintf(stderr, "couldn't find grain!\n");
-                    }
-                    for (int k = maxgrain; k > 0; k--)
-                    {
-                        if (grains[k].size >= 0)
-                            break;
-                        
-                        maxgrain = k;
-                    }
-                }
+                next_track_marks(ref);
             }
-            
-            for (int ix = 0; ix <= maxgrain; ix++)
+            else
             {
-                grain_t g = grains[ix];
-                
-                // if this grain has been "triggered", it's size is > 0
-                if (g.size > 0)
+                float dp = cix - 2*maxT - pitchmark[0];
+                if (dp < 0)
+                    dp += ncbuf;
+
+                if (dp > (T + T/4))
                 {
-                    float fi = g.start + g.ix;
-                    
-                    if (fi >= ncbuf)
-                        fi -= ncbuf;
-                    else if (fi < 0)
-                        fi += ncbuf;
-                    
-                    int i = (int) fi;
-                    //float u = cbuf[i];
-                    float u = cubic (cbuf + i, fi - i);
-                    
-                    float wi = 2 + graintablesize * (g.ix / g.size);
-                    i = (int) wi;
-                    float w = cubic (grain_window + i, wi - i);
-                    
-                    float hgain = g.vix ? harmgain : 1.0;
-                    
-                    *out += u * hgain * w * g.gain * voices[g.vix].gain * (g.pan + 1.0)/2;
-                    *out2 += u * hgain * w * g.gain * voices[g.vix].gain * (-g.pan + 1)/2;
-                    
-                    g.ix += g.ratio;
-                    
-                    if (g.ix > g.size)
-                    {
-                        g.size = -1;
-                        //printf("ending grain %d\n", ix);
-                    }
-                    
-                    grains[ix] = g;
+                    findmark();
+
+                    //printf("pitchmark[0,1,2] = %.2f,%.2f,%.2f\ninput = %d\n", pitchmark[0],pitchmark[1],pitchmark[2],cix);
                 }
             }
             
+            // the spectral engine starts no grains, but lets any left from PSOLA finish
+            if (!spectral)
+                run_voices(frameIndex);
+
+            render_grains(frameIndex);
 		}
+
+        if (spectral)
+            render_spectral(frameCount, bufferOffset);
+        else
+            shifter_live = false;
+
+        mix_block(frameCount, bufferOffset);
+        end_block(frameCount, bufferOffset, true);
+
+        if (grain_overflow)
+        {
+            send_event(HarmEventVoiceOverflow, 0, 0, grain_overflow);
+            grain_overflow = 0;
+        }
 	}
 
-#ifdef __APPLE__
-    float estimate_pitch(int start_ix)
+    // voice 0 is only resynthesized when it's corrected; otherwise the dry input stands in for it
+    int first_psola_voice()
     {
-        memset(fft_in.realp, 0, nfft * sizeof(float));
-        memset(fft_in.imagp, 0, nfft * sizeof(float));
-        
-        for (int k = 0; k < maxT; k++)
+        return (!autotune && triad < 0) ? 1 : 0;
+    }
+
+    /*
+        Notes out for the host, once per analysis hop: the tracked note on
+        one channel, the harmony notes on the next. The harmony set leaves
+        out the melody note, which the lead voice usually doubles.
+    */
+    void send_midi_notes(int frame)
+    {
+        int mel = (int) midi_note_number;
+
+        if (midi_tx_mel)
+            mel_out.update(frame, &mel, 1, midi_out_velocity, midi_out);
+        else
+            mel_out.release(frame, midi_out);
+
+        if (midi_tx_harm)
         {
-            int ix = (start_ix + k) & cmask;
-            fft_in.realp[k] = cbuf[ix];
+            int harm[HARM_AUTO_VOICES];
+            for (int k = 0; k < HARM_AUTO_VOICES; k++)
+                harm[k] = voice_notes[k] != mel ? voice_notes[k] : -1;
+            harm_out.update(frame, harm, HARM_AUTO_VOICES, midi_out_velocity, midi_out);
         }
-        
-        vDSP_fft_zopt(fft_s, &fft_in, 1, &fft_out, 1, &fft_buf, 11, 1);
-        
-        for (int k = maxT; k < 2*maxT; k++)
-        {
-            int ix = (start_ix + k) & cmask;
-            fft_in.realp[k] = cbuf[ix];
+        else
+            harm_out.release(frame, midi_out);
+    }
+
+    void release_midi_notes(int frame)
+    {
+        if (mel_out.sounding())
+            mel_out.release(frame, midi_out);
+        if (harm_out.sounding())
+            harm_out.release(frame, midi_out);
+    }
+
+    // whether vix is making grains right now
+    bool voice_active(int vix)
+    {
+        if (vix < first_psola_voice())
+            return false;
+        if (voices[vix].gain < 0.001)
+            return false;
+        if (vix < HARM_AUTO_VOICES ? vix >= n_auto : !midi_enable)
+            return false;
+        return true;
+    }
+
+    // targets only move with the analysis hop, MIDI and parameters, so this runs once per block and hop
+    void update_gain_targets()
+    {
+        int nonvoiced_count = (int) (dry_enable > 0);
+
+        ramping = 0;
+        for (int vix = first_psola_voice(); vix < nvoices; vix++)
+        {
+            voices[vix].target_gain = ((voiced || nonvoiced_count == 0) && voices[vix].midinote > 0) ? 1.0 : 0.0;
+            
+            if (voices[vix].target_gain > 0)
+                nonvoiced_count++;
+            
+            if (vix == 0 && (autotune || triad >= 0)) voices[vix].target_gain = dry_mix;
+
+            if (voices[vix].gain != voices[vix].target_gain)
+                ramping |= 1u << vix;
         }
-        vDSP_fft_zopt(fft_s, &fft_in, 1, &fft_out2, 1, &fft_buf, 11, 1);
-        
-        // conjugate small window and correlate with large window
-        for (int k = 0; k < nfft; k++)
+    }
+
+    /*
+        The spectral engine, once per block: the same gain targets as the
+        grains, applied per hop rather than ramped per sample, since the
+        overlap-add already crossfades between hops. Unvoiced input is left
+        unshifted like the grains leave it, and nothing new sounds while the
+        gate is closed. Per-voice record stems stay silent in this mode.
+    */
+    void render_spectral(frame_count_t frameCount, frame_count_t bufferOffset)
+    {
+        if (!shifter_live)
+        {
+            shifter.reset();
+            shifter_live = true;
+        }
+
+        update_gain_targets();
+        ramping = 0;
+        shifter.setPeriod(voiced ? (float) T : 0.f);
+
+        for (int vix = 0; vix < shifter.voiceCount(); vix++)
+        {
+            voice_t & v = voices[vix];
+            v.gain = v.target_gain;
+
+            float g = 0;
+            if (gate_open && voice_active(vix))
+            {
+                g = vix == 0 ? 1.f : (float) v.midivel / 127.f;
+                if (vix >= HARM_AUTO_VOICES)
+                    g *= midigain_buf[0];
+                g *= v.gain;
+            }
+
+            spectral_voice_t & sv = shifter.voice(vix);
+            sv.ratio = voiced ? v.ratio : 1.f;
+            sv.formant = v.formant_ratio;
+            sv.gain_l = g * (v.pan + 1) / 2;
+            sv.gain_r = g * (1 - v.pan) / 2;
+            sv.lead = vix == 0;
+        }
+
+        shifter.process(in_buffers[0] + bufferOffset, (int) frameCount, wet_l, wet_r, harm_l, harm_r);
+    }
+
+    /*
+        One frame of voice bookkeeping. Only voices still ramping toward their
+        target gain are touched every sample; grain onsets live in the
+        scheduler in scheduler frames, which only advance while this runs, so
+        a voice's countdown pauses with the gate just like it used to. A voice
+        that stops being active is parked with its remaining countdown in
+        nextgrain and rescheduled from there when it comes back.
+    */
+    void run_voices(int frameIndex)
+    {
+        double now = (double) ++sched_frames;
+
+        uint32_t check = ramping;
+        if (voices_dirty)
+        {
+            update_gain_targets();
+            check = (nvoices < 32) ? ((1u << nvoices) - 1) : ~0u;
+            voices_dirty = 0;
+        }
+
+        for (uint32_t m = ramping; m; m &= m - 1)
+        {
+            int vix = __builtin_ctz(m);
+            voices[vix].gain = inc_to_target(voices[vix].gain, voices[vix].target_gain, 0.9, 0.001, -0.0004);
+            if (voices[vix].gain == voices[vix].target_gain)
+                ramping &= ~(1u << vix);
+        }
+
+        for (uint32_t m = check; m; m &= m - 1)
+        {
+            int vix = __builtin_ctz(m);
+            bool active = voice_active(vix);
+            if (active && !sched.scheduled(vix))
+            {
+                sched.schedule(vix, now + voices[vix].nextgrain - 1);
+            }
+            else if (!active && sched.scheduled(vix))
+            {
+                voices[vix].nextgrain = sched.onset(vix) - now + 1;
+                sched.cancel(vix);
+            }
+        }
+
+        if (sched.empty() || sched.topOnset() >= now)
+            return;
+
+        // everything due this frame, started in voice order
+        int due[GRAIN_SCHEDULER_MAX_VOICES];
+        double due_onset[GRAIN_SCHEDULER_MAX_VOICES];
+        int ndue = 0;
+        while (!sched.empty() && sched.topOnset() < now)
+        {
+            int vix = sched.topVoice();
+            double onset = sched.topOnset();
+            sched.pop();
+
+            int k = ndue++;
+            for (; k > 0 && due[k - 1] > vix; k--)
+            {
+                due[k] = due[k - 1];
+                due_onset[k] = due_onset[k - 1];
+            }
+            due[k] = vix;
+            due_onset[k] = onset;
+        }
+
+        for (int j = 0; j < ndue; j++)
+        {
+            int vix = due[j];
+            if (start_grain(vix, (float) (now - due_onset[j]), frameIndex))
+            {
+                sched.schedule(vix, due_onset[j] + (voiced ? (T / voices[vix].ratio) : T));
+            }
+            else
+            {
+                // try again next frame, a little later into the period
+                grain_overflow++;
+                sched.schedule(vix, due_onset[j]);
+            }
+        }
+
+        for (int k = maxgrain; k > 0; k--)
+        {
+            if (grains[k].size >= 0)
+                break;
+            
+            maxgrain = k;
+        }
+    }
+
+    // start a grain for vix, late samples after its onset; false if every grain is busy
+    bool start_grain(int vix, float late, int frameIndex)
+    {
+        float midigain_local = 1.0;
+        if (vix >= HARM_AUTO_VOICES)
+            midigain_local = midigain_buf[frameIndex];
+
+        // search for the first open grain
+        for (int k = 0; k < ngrains; k++)
+        {
+            if (grains[k].size < 0)
+            {
+                grains[k].size = 2 * T;
+                grains[k].start = pitchmark[0] + late - T;
+                grains[k].ratio = voices[vix].formant_ratio;
+                
+                grains[k].ix = 0;
+                grains[k].gain = midigain_local * (float) voices[vix].midivel / 127.0;
+                grains[k].pan = voices[vix].pan;
+                grains[k].vix = vix;
+                
+                if (vix == 0)
+                {
+                    grains[k].gain = 1.0;
+                }
+                
+                if (!voiced)
+                {
+                    grains[k].ratio = 1.0; //voices[vix].ratio;
+                }
+                else
+                {
+                    // for low transpositions, increase gain
+                    if (voices[vix].ratio < 1)
+                        grains[k].gain *= powf(1/voices[vix].ratio,0.5);
+                    
+                    // for high transpositions, start shortening the blips.
+                    if (voices[vix].ratio > 1.7)
+                    {
+                        //grains[k].size = T/2;
+                        grains[k].ratio *= (1 + (voices[vix].ratio - 1.7)/2);
+                        //grains[k].gain *= powf(voices[vix].ratio,0.5);
+                    }
+                }
+                
+                // the window is a turning phasor, one step per sample read
+                float step = 2 * M_PI * grains[k].ratio / grains[k].size;
+                grains[k].wc = 1;
+                grains[k].ws = 0;
+                grains[k].rc = cosf(step);
+                grains[k].rs = sinf(step);
+
+                //printf("maxgrain = %d\n", maxgrain);
+                if (k > maxgrain)
+                    maxgrain = k;
+                
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void send_event(int type, int a, int b, int value)
+    {
+        harm_event_t ev;
+        ev.type = (uint8_t) type;
+        ev.a = (uint8_t) a;
+        ev.b = (uint8_t) b;
+        ev.value = value;
+        ev.sample = sample_count;
+        events.send(ev);
+    }
+
+    // the host's end of the kernel's event stream; see EventChannel.hpp
+    EventChannel & eventChannel()
+    {
+        return events;
+    }
+
+    /*
+        Note events from the melody and harmony senders, stamped with frames
+        from the start of the render call. The host clears it before each
+        render call and forwards what's there afterwards.
+    */
+    MidiOutBuffer & midiOut()
+    {
+        return midi_out;
+    }
+
+    /*
+        Input, output and bus meters for the block. The lead and harmony
+        buses are only looked at when the block was synthesized; otherwise
+        they just fall.
+    */
+    void update_meters(frame_count_t frameCount, frame_count_t bufferOffset, bool rendered)
+    {
+        if (meter_clear.exchange(0, std::memory_order_relaxed))
+        {
+            meter_in.clearClips();
+            meter_lead.clearClips();
+            meter_harm.clearClips();
+            for (int ch = 0; ch < 2; ch++)
+                meter_out[ch].clearClips();
+        }
+
+        meter_in.process(in_buffers[0] + bufferOffset, frameCount);
+
+        for (int ch = 0; ch < n_channels && ch < 2; ch++)
+        {
+            if (silent_frames >= (unsigned int) frameCount)
+                meter_out[ch].silence(frameCount);
+            else
+                meter_out[ch].process(out_buffers[ch] + bufferOffset, frameCount);
+        }
+
+        int nbus = n_channels == 1 ? 1 : 2;
+        const float * lead[2] = {wet_l, wet_r};
+        const float * harm[2] = {harm_l, harm_r};
+        if (rendered)
+        {
+            meter_lead.process(lead, nbus, frameCount);
+            meter_harm.process(harm, nbus, frameCount);
+        }
+        else
+        {
+            meter_lead.silence(frameCount);
+            meter_harm.silence(frameCount);
+        }
+    }
+
+    /*
+        Input spectrum for displays, off by default. While on, every analysis
+        hop publishes one; readSpectrum is safe from any thread.
+    */
+    void enableSpectrum(bool on)
+    {
+        spectrum_on.store(on, std::memory_order_relaxed);
+    }
+
+    void readSpectrum(spectrum_t & out) const
+    {
+        spectrum.read(out);
+    }
+
+    // any thread: zero the clip counters and peak holds at the next block
+    void clearMeters()
+    {
+        meter_clear.store(1, std::memory_order_relaxed);
+    }
+
+    // snapshot what the UI shows; the only place the render thread touches the shared lines
+    void publish_telemetry()
+    {
+        telem.block++;
+        telem.midi_note_number = midi_note_number;
+        telem.note_number = note_number;
+        telem.period = T;
+        telem.rms = meter_in.reading().block_rms;
+        telem.voiced = voiced;
+        telem.root_key = root_key;
+        telem.chord_quality = chord_quality;
+        memcpy(telem.voice_notes, voice_notes, sizeof(telem.voice_notes));
+
+        for (int k = 0; k < TELEMETRY_NVOICES; k++)
+        {
+            bool on = k < nvoices && voices[k].gain >= 0.001;
+            telem.voices[k].midinote = on ? (int16_t) voices[k].midinote : -1;
+            telem.voices[k].gain = on ? voices[k].gain : 0;
+            telem.voices[k].ratio = on ? voices[k].ratio : 1;
+        }
+
+        telem.keys_down[0] = telem.keys_down[1] = 0;
+        for (int k = 0; k < 128; k++)
+        {
+            if (keys_down[k])
+                telem.keys_down[k >> 6] |= 1ull << (k & 63);
+        }
+
+        telem.input = meter_in.reading();
+        for (int ch = 0; ch < 2; ch++)
+            telem.output[ch] = meter_out[ch < n_channels ? ch : 0].reading();
+        telem.lead = meter_lead.reading();
+        telem.harmony = meter_harm.reading();
+        telem.gate_gain = silent_frames > 0 ? 0.f : 1.f;
+
+        telemetry.publish(telem);
+    }
+
+    // safe from any thread
+    void readTelemetry(telemetry_t & out) const
+    {
+        telemetry.read(out);
+    }
+
+    /*
+        Looper storage is opt-in, so offline and analysis kernels don't carry
+        the chunk pool or the spill thread. Call after init(); spill_dir needs
+        room for the longest take.
+    */
+    bool enableLooper(const char * spill_dir, float resident_seconds = 20)
+    {
+        return looper.open(spill_dir, n_channels, sampleRate, max_frames, resident_seconds);
+    }
+
+    int getLoopMode()
+    {
+        return looper.mode();
+    }
+
+    float loopPosition()
+    {
+        return looper.position();
+    }
+
+    const Looper & loop() const
+    {
+        return looper;
+    }
+
+    /*
+        Record tap. Stems go to one WAV per stem from a writer thread; see
+        RecordTap.hpp. Call from the host thread; recording starts and stops
+        on block boundaries and the render thread never waits on the disk.
+    */
+    bool startRecording(const char * prefix, unsigned int stems)
+    {
+        return recorder.start(prefix, stems, n_channels, nvoices, sampleRate, max_frames);
+    }
+
+    void stopRecording()
+    {
+        recorder.stop();
+    }
+
+    const RecordTap & recordTap() const
+    {
+        return recorder;
+    }
+
+    // everything that follows the synthesis: looper, record tap, telemetry. rendered is false
+    // when the block skipped synthesis, so the lead and harmony buffers hold nothing of it.
+    void end_block(frame_count_t frameCount, frame_count_t bufferOffset, bool rendered)
+    {
+        render_looper(frameCount, bufferOffset);
+        record_block(frameCount, bufferOffset, rendered);
+        update_meters(frameCount, bufferOffset, rendered);
+        publish_telemetry();
+    }
+
+    void record_block(frame_count_t frameCount, frame_count_t bufferOffset, bool rendered)
+    {
+        if (!tapping)
+            return;
+
+        const float * src[RECORD_TAP_MAX_CHANNELS];
+        int n = 0;
+        unsigned int stems = recorder.stemMask();
+
+        if (stems & RecordStemMix)
+            for (int ch = 0; ch < n_channels; ch++)
+                src[n++] = out_buffers[ch] + bufferOffset;
+        if (stems & RecordStemDry)
+            src[n++] = in_buffers[0] + bufferOffset;
+        if (stems & RecordStemLead)
+        {
+            src[n++] = rendered ? wet_l : NULL;
+            src[n++] = rendered ? wet_r : NULL;
+        }
+        if (stems & RecordStemHarmony)
+        {
+            src[n++] = rendered ? harm_l : NULL;
+            src[n++] = rendered ? harm_r : NULL;
+        }
+        if (stems & RecordStemVoices)
+            for (int v = 0; v < nvoices; v++)
+                src[n++] = recorder.voiceBuffer(v);
+
+        int dropped = recorder.push(src, frameCount);
+        recorder.end();
+        tapping = false;
+        tap_voices = false;
+
+        if (dropped)
+            send_event(HarmEventRecordOverrun, 0, 0, dropped);
+    }
+
+    void render_looper(frame_count_t frameCount, frame_count_t bufferOffset)
+    {
+        if (!looper.isOpen())
+            return;
+
+        float * out[8];
+        int nout = n_channels < 8 ? n_channels : 8;
+        for (int ch = 0; ch < nout; ch++)
+            out[ch] = out_buffers[ch] + bufferOffset;
+        looper.process(out, frameCount);
+
+        // loop playback lands on top of gated silence, so the block isn't silent any more
+        int m = looper.mode();
+        if (m == LoopPlay || m == LoopPlayRec)
+            silent_frames = 0;
+    }
+
+    // out = voice * vgain + harmony * hgain + dry input * dry gain, one channel at a time.
+    void mix_block(frame_count_t frameCount, frame_count_t bufferOffset)
+    {
+        const float * in = in_buffers[0] + bufferOffset;
+
+        if (n_channels == 1)
+        {
+            // mono: fold both pan positions into the single output
+            for (int k = 0; k < frameCount; k++)
+            {
+                wet_l[k] += wet_r[k];
+                harm_l[k] += harm_r[k];
+            }
+        }
+
+        for (int ch = 0; ch < n_channels && ch < 2; ch++)
+        {
+            float * out = out_buffers[ch] + bufferOffset;
+            const float * wet = ch ? wet_r : wet_l;
+            const float * harm = ch ? harm_r : harm_l;
+#ifdef __APPLE__
+            vDSP_vmma(wet, 1, voicegain_buf, 1, harm, 1, harmgain_buf, 1, mix_buf, 1, (vDSP_Length) frameCount);
+            vDSP_vma(in, 1, drygain_buf, 1, mix_buf, 1, out, 1, (vDSP_Length) frameCount);
+#else
+            for (int k = 0; k < frameCount; k++)
+            {
+                out[k] = wet[k] * voicegain_buf[k] + harm[k] * harmgain_buf[k] + in[k] * drygain_buf[k];
+            }
+#endif
+        }
+    }
+
+    // fill this block's gain curves and pick up the block-rate parameters.
+    void prepare_ramps(frame_count_t frameCount)
+    {
+        voicegainRamper.dezipperCheck(ramp_frames);
+        harmgainRamper.dezipperCheck(ramp_frames);
+        drymixRamper.dezipperCheck(ramp_frames);
+        corrRamper.dezipperCheck(ramp_frames);
+        speedRamper.dezipperCheck(ramp_frames);
+
+        // the dry input fades out whenever the corrected voice replaces it
+        float dry_target = (!autotune && triad < 0) ? 1.0 : 0.0;
+        if (dry_target != dryenableRamper.goal())
+            dryenableRamper.startRamp(dry_target, ramp_frames);
+
+        dry_enable = dryenableRamper.get();
+        dry_mix = drymixRamper.get();
+        corr_strength = corrRamper.get();
+        speed = speedRamper.get();
+        corrRamper.stepBy(frameCount);
+        speedRamper.stepBy(frameCount);
+
+        voicegainRamper.getBlock(voicegain_buf, frameCount);
+        harmgainRamper.getBlock(harmgain_buf, frameCount);
+        midigainRamper.getBlock(midigain_buf, frameCount);
+        drymixRamper.getBlock(drygain_buf, frameCount);
+        dryenableRamper.getBlock(mix_buf, frameCount);
+#ifdef __APPLE__
+        float half = 0.5;
+        vDSP_vmul(drygain_buf, 1, mix_buf, 1, drygain_buf, 1, (vDSP_Length) frameCount);
+        vDSP_vsmul(drygain_buf, 1, &half, drygain_buf, 1, (vDSP_Length) frameCount);
+#else
+        for (int k = 0; k < frameCount; k++)
+        {
+            drygain_buf[k] *= 0.5f * mix_buf[k];
+        }
+#endif
+    }
+
+    ParameterRamper * ramperFor(param_address_t address)
+    {
+        switch (address) {
+            case HarmParamAutoStrength:
+                return &corrRamper;
+            case HarmParamHgain:
+                return &harmgainRamper;
+            case HarmParamVgain:
+                return &voicegainRamper;
+            case HarmParamDryMix:
+                return &drymixRamper;
+            case HarmParamSpeed:
+                return &speedRamper;
+            default:
+                return NULL;
+        }
+    }
+
+    void render_bypass(frame_count_t frameCount, frame_count_t bufferOffset)
+    {
+        const float * in = in_buffers[0] + bufferOffset;
+
+        for (int k = 0; k < frameCount; k++)
+        {
+            float x = in[k];
+            cbuf[cix] = x;
+            if (cix < 3)
+                cbuf[ncbuf+cix] = cbuf[cix];
+            if (++cix >= ncbuf)
+                cix = 0;
+
+            for (int ch = 0; ch < n_channels; ch++)
+                out_buffers[ch][bufferOffset + k] = x / 2;
+        }
+        silent_frames = 0;
+    }
+
+    // quality tier for grain reads; takes effect from the next sample
+    void setInterpolation(int tier)
+    {
+        interp_tier = clamp(tier, (int) InterpLinear, (int) InterpSinc);
+    }
+
+    int interpolation() const
+    {
+        return interp_tier;
+    }
+
+    void render_grains(int frame)
+    {
+        switch (interp_tier)
+        {
+            case InterpLinear:
+                render_grains_at<InterpLinear>(frame);
+                break;
+            case InterpSinc:
+                render_grains_at<InterpSinc>(frame);
+                break;
+            default:
+                render_grains_at<InterpCubic>(frame);
+                break;
+        }
+    }
+
+    // input at fi, between cbuf[i + 1] and cbuf[i + 2] for i = floor(fi), as cubic() has always read it
+    template <int Tier>
+    float read_input(float fi)
+    {
+        int i = (int) fi;
+        float a = fi - i;
+        if (Tier == InterpLinear)
+            return linear(cbuf + i + 1, a);
+        if (Tier == InterpCubic)
+            return cubic(cbuf + i, a);
+
+        int first = i + 2 - SINC_TAPS / 2;
+        if (first >= 0 && first + SINC_TAPS <= ncbuf)
+            return sinc->read(cbuf + first, a);
+
+        // the taps straddle the ring's seam
+        float x[SINC_TAPS];
+        for (int t = 0; t < SINC_TAPS; t++)
+            x[t] = cbuf[(first + t) & cmask];
+        return sinc->read(x, a);
+    }
+
+    // add every active grain's next sample into the wet (lead) or harmony scratch
+    template <int Tier>
+    void render_grains_at(int frame)
+    {
+        for (int ix = 0; ix <= maxgrain; ix++)
+        {
+            grain_t g = grains[ix];
+
+            // if this grain has been "triggered", it's size is > 0
+            if (g.size > 0)
+            {
+                float fi = g.start + g.ix;
+
+                if (fi >= ncbuf)
+                    fi -= ncbuf;
+                else if (fi < 0)
+                    fi += ncbuf;
+
+                float u = read_input<Tier>(fi);
+                float w = 0.5f * (1 - g.wc);
+
+                float a = u * w * g.gain * voices[g.vix].gain;
+
+                if (tap_voices)
+                    recorder.voiceBuffer(g.vix)[frame] += a;
+
+                if (g.vix)
+                {
+                    harm_l[frame] += a * (g.pan + 1.0)/2;
+                    harm_r[frame] += a * (-g.pan + 1)/2;
+                }
+                else
+                {
+                    wet_l[frame] += a * (g.pan + 1.0)/2;
+                    wet_r[frame] += a * (-g.pan + 1)/2;
+                }
+
+                g.ix += g.ratio;
+                float wc = g.wc * g.rc - g.ws * g.rs;
+                g.ws = g.ws * g.rc + g.wc * g.rs;
+                g.wc = wc;
+
+                if (g.ix > g.size)
+                {
+                    g.size = -1;
+                    //printf("ending grain %d\n", ix);
+                }
+
+                grains[ix] = g;
+            }
+        }
+    }
+
+    // returns true while the gate is open, i.e. the input has been above
+    // gate_level at some point in the last gate_hold_max samples.
+    int update_gate(const float * in, frame_count_t frameCount)
+    {
+        float peak = 0;
+#ifdef __APPLE__
+        vDSP_maxmgv(in, 1, &peak, (vDSP_Length) frameCount);
+#else
+        for (int k = 0; k < frameCount; k++)
+            peak = std::max(peak, fabsf(in[k]));
+#endif
+        if (peak >= gate_level)
+        {
+            gate_hold = 0;
+            if (!gate_open)
+            {
+                // restart pitch marking at the current analysis position
+                gate_open = 1;
+                rcnt = 1;
+                pitchmark[0] = (cix - 2*maxT) & cmask;
+            }
+            return gate_open;
+        }
+
+        gate_hold += frameCount;
+        if (gate_open && gate_hold > (int) (sampleRate * gate_hold_sec))
+        {
+            gate_open = 0;
+            memset(Tbuf, 0, nmed * sizeof(float));
+            memset(Tsrt, 0, nmed * sizeof(float));
+            yin_job = false;
+            yin_next = YinSteps;
+            voiced = 0;
+            update_voices();
+            if (spectrum_on.load(std::memory_order_relaxed))
+                publish_silent_spectrum();
+        }
+        return gate_open;
+    }
+
+    int grains_idle()
+    {
+        for (int ix = 0; ix <= maxgrain; ix++)
+        {
+            if (grains[ix].size > 0)
+                return 0;
+        }
+        return 1;
+    }
+
+    // keep the capture buffer current so analysis can resume cleanly, but emit zeros.
+    void render_silence(frame_count_t frameCount, frame_count_t bufferOffset)
+    {
+        const float * in = in_buffers[0] + bufferOffset;
+
+        for (int k = 0; k < frameCount; k++)
+        {
+            cbuf[cix] = in[k];
+            if (cix < 3)
+                cbuf[ncbuf+cix] = cbuf[cix];
+            if (++cix >= ncbuf)
+                cix = 0;
+        }
+
+        for (int k = 0; k < n_channels; k++)
+        {
+            memset(out_buffers[k] + bufferOffset, 0, frameCount * sizeof(float));
+        }
+
+        silent_frames += frameCount;
+    }
+
+    // number of consecutive frames (up to now) for which the output was exactly zero.
+    unsigned int silentFrames()
+    {
+        return silent_frames;
+    }
+
+    // YIN period of the 2*maxT samples at x, in samples; 0 if nothing clears the threshold.
+    float yin_period(const float * x)
+    {
+        for (int step = 0; step < YinStepSearch; step++)
+            yin_step(x, step);
+        return yin_step(x, YinStepSearch);
+    }
+
+    /*
+        One piece of yin_period(), in YinStep* order, with the state between
+        pieces kept in fft_x and fft_spec. Only the last returns the period.
+    */
+    float yin_step(const float * x, int step)
+    {
+        int nbins = nfft/2 + 1;
+        float * re1 = fft_spec;
+        float * im1 = fft_spec + nbins;
+        float * re2 = fft_spec + 2*nbins;
+        float * im2 = fft_spec + 3*nbins;
+
+        if (step == YinStepFirstHalf)
+        {
+            memset(fft_x, 0, nfft * sizeof(float));
+            memcpy(fft_x, x, maxT * sizeof(float));
+            fft_fwd->run(fft_x, re1, im1, fft_work);
+            return 0;
+        }
+
+        if (step == YinStepWhole)
+        {
+            memcpy(fft_x + maxT, x + maxT, maxT * sizeof(float));
+            fft_fwd->run(fft_x, re2, im2, fft_work);
+            return 0;
+        }
+
+        if (step == YinStepCorrelate)
+        {
+            correlate_spectra(re1, im1, re2, im2, nbins);
+            fft_inv->run(fft_x, re1, im1, fft_work);
+            return 0;
+        }
+
+        return yin_search(x);
+    }
+
+    // conjugate the small window's spectrum and correlate it with the large window's
+    void correlate_spectra(float * re1, float * im1, const float * re2, const float * im2, int nbins)
+    {
+#ifdef __APPLE__
+        DSPSplitComplex a = {re1, im1};
+        DSPSplitComplex b = {(float *) re2, (float *) im2};
+        vDSP_zvmul(&a, 1, &b, 1, &a, 1, (vDSP_Length) nbins, -1);
+#else
+        for (int k = 0; k < nbins; k++)
         {
             float r1,c1,r2,c2;
-            r1 = fft_out.realp[k]; c1 = -fft_out.imagp[k];
-            r2 = fft_out2.realp[k]; c2 = fft_out2.imagp[k];
+            r1 = re1[k]; c1 = -im1[k];
+            r2 = re2[k]; c2 = im2[k];
 
-            fft_in.realp[k] = r1*r2 - c1*c2;
-            fft_in.imagp[k] = r1*c2 + r2*c1;
+            re1[k] = r1*r2 - c1*c2;
+            im1[k] = r1*c2 + r2*c1;
         }
-        // inverse transform
-        vDSP_fft_zopt(fft_s, &fft_in, 1, &fft_out, 1, &fft_buf, 11, -1);
-        
-        float sumsq_ = fft_out.realp[0]/nfft;
+#endif
+    }
+
+    // the cumulative mean normalised difference over lags, from the correlation in fft_x
+    float yin_search(const float * x)
+    {
+        float sumsq_ = fft_x[0]/nfft;
         float sumsq = sumsq_;
         
         float df,cmdf,cmdf1,cmdf2, sum = 0;
@@ -993,13 +1906,10 @@ public:
         cmdf2 = cmdf1 = cmdf = 1;
         for (int k = 1; k < maxT; k++)
         {
-            int ix1 = (start_ix + k) & cmask;
-            int ix2 = (start_ix + k + maxT) & cmask;
+            sumsq -= x[k]*x[k];
+            sumsq += x[k + maxT]*x[k + maxT];
             
-            sumsq -= cbuf[ix1]*cbuf[ix1];
-            sumsq += cbuf[ix2]*cbuf[ix2];
-            
-            df = sumsq + sumsq_ - 2 * fft_out.realp[k]/nfft;
+            df = sumsq + sumsq_ - 2 * fft_x[k]/nfft;
             sum += df;
             cmdf2 = cmdf1; cmdf1 = cmdf;
             cmdf = (df * k) / sum;
@@ -1010,92 +1920,188 @@ public:
             }
         }
         
-        Tbuf[Tix++] = period;
-        
-        if (Tix >= nmed)
-            Tix = 0;
-        
-        memcpy(Tsrt, Tbuf, nmed * sizeof(float));
-        vDSP_vsort(Tsrt, (vDSP_Length) nmed, 1);
-        
-        return Tsrt[nmed/2];
+        return period;
     }
 
-#else
-    float estimate_pitch(int start_ix) {
-        memset(fft_in, 0, nfft * sizeof(kiss_fft_cpx));
-
-        for (int k = 0; k < maxT; k++) {
-            int ix = (start_ix + k) & cmask;
-            fft_in[k].r = cbuf[ix];
-        }
-
-        kiss_fft(fft_s, fft_in, fft_out);
 
-        //memset(fft_in, 0, nfft * sizeof(kiss_fft_cpx));
+    /*
+        yin_period leaves the transform of the whole 2*maxT window in its
+        second spectrum, so the display only costs a magnitude per bin and a
+        log per band. Each band shows its strongest bin, scaled so a full-scale
+        sine reads 0 dB.
+    */
+    void publish_spectrum()
+    {
+        int nbins = nfft/2 + 1;
+        const float * re = fft_spec + 2*nbins;
+        const float * im = fft_spec + 3*nbins;
+        float scale = 2.f / (2*maxT);
 
-        for (int k = maxT; k < 2 * maxT; k++) {
-            int ix = (start_ix + k) & cmask;
-            fft_in[k].r = cbuf[ix];
+        for (int b = 0; b < SPECTRUM_BANDS; b++)
+        {
+            float pmax = 0;
+            for (int k = band_bin[b]; k < band_bin[b + 1]; k++)
+                pmax = std::max(pmax, re[k]*re[k] + im[k]*im[k]);
+            spec.db[b] = std::max(-120.f, 10.f * log10f(pmax * scale * scale + 1e-12f));
         }
+        spec.hop++;
+        spectrum.publish(spec);
+    }
 
-        kiss_fft(fft_s, fft_in, fft_out2);
+    // the gate shut: show the floor rather than the last thing heard
+    void publish_silent_spectrum()
+    {
+        for (int b = 0; b < SPECTRUM_BANDS; b++)
+            spec.db[b] = -120.f;
+        spec.hop++;
+        spectrum.publish(spec);
+    }
 
-        // conjugate small window and correlate with large window
-        for (int k = 0; k < nfft; k++) {
-            float r1, c1, r2, c2;
-            r1 = fft_out[k].r;
-            c1 = -fft_out[k].i;
-            r2 = fft_out2[k].r;
-            c2 = fft_out2[k].i;
+    // geometric band edges from 40 Hz to Nyquist, each band at least one bin wide, shared per nfft and rate
+    void init_spectrum()
+    {
+        SharedTables::release(spectrum_tables);
+        spectrum_tables = SharedTables::acquire(nfft, sampleRate);
+        band_bin = spectrum_tables->band_bin;
+
+        memset(&spec, 0, sizeof(spec));
+        spec.fmin = 40.f;
+        spec.fmax = sampleRate / 2;
+        for (int b = 0; b < SPECTRUM_BANDS; b++)
+            spec.db[b] = -120.f;
+    }
 
-            fft_in[k].r = r1 * r2 - c1 * c2;
-            fft_in[k].i = r1 * c2 + r2 * c1;
-        }
-        // inverse transform
-        kiss_fft(ifft_s, fft_in, fft_out);
+    // causal estimate: YIN on the newest 2*maxT samples, median-filtered over the last nmed hops
+    float estimate_pitch(int start_ix)
+    {
+        snapshot_window(start_ix);
+        return median_period(yin_period(ana_buf));
+    }
 
-        float sumsq_ = fft_out[0].r / nfft;
-        float sumsq = sumsq_;
+    void snapshot_window(int start_ix)
+    {
+        for (int k = 0; k < 2*maxT; k++)
+        {
+            ana_buf[k] = cbuf[(start_ix + k) & cmask];
+        }
+    }
 
-        float df, cmdf, cmdf1, cmdf2, sum = 0;
+    // a finished raw period into the median, with the display spectrum of the same window
+    float median_period(float raw)
+    {
+        Tbuf[Tix++] = raw;
+        if (spectrum_on.load(std::memory_order_relaxed))
+            publish_spectrum();
 
-        float period = 0.0;
+        if (Tix >= nmed)
+            Tix = 0;
 
-        cmdf2 = cmdf1 = cmdf = 1;
-        for (int k = 1; k < maxT; k++) {
-            int ix1 = (start_ix + k) & cmask;
-            int ix2 = (start_ix + k + maxT) & cmask;
+        memcpy(Tsrt, Tbuf, nmed * sizeof(float));
+#ifdef __APPLE__
+        vDSP_vsort(Tsrt, (vDSP_Length) nmed, 1);
+#else
+        std::sort(Tsrt, Tsrt+nmed);
+#endif
+        return Tsrt[nmed/2];
+    }
 
-            sumsq -= cbuf[ix1] * cbuf[ix1];
-            sumsq += cbuf[ix2] * cbuf[ix2];
+    /*
+        The hop's pitch in the current analysis mode. Sliced and threaded
+        return the previous window's result and start on this one; a helper
+        that hasn't finished yet costs a hop of pitch updates (counted in
+        analysisMisses()) rather than a wait.
+    */
+    float next_pitch(int start_ix)
+    {
+        int mode = analysis_request.load(std::memory_order_relaxed);
+        if (mode != analysis_mode && worker.idle())
+        {
+            analysis_mode = mode;
+            yin_job = false;
+            yin_next = YinSteps;
+        }
 
-            df = sumsq + sumsq_ - 2 * fft_out[k].r / nfft;
-            sum += df;
-            cmdf2 = cmdf1;
-            cmdf1 = cmdf;
-            cmdf = (df * k) / sum;
+        if (analysis_mode == AnalysisInline)
+            return estimate_pitch(start_ix);
 
-            if (k > 0 && cmdf2 > cmdf1 && cmdf1 < cmdf && cmdf1 < threshold && k > 20) {
-                period = (float) (k - 1) + 0.5 * (cmdf2 - cmdf) / (cmdf2 + cmdf - 2 * cmdf1);
-                break;
+        float p = Tsrt[nmed/2];
+        if (analysis_mode == AnalysisSliced)
+        {
+            if (yin_job)
+            {
+                // only behind if the gate reopened mid-hop
+                for (; yin_next < YinSteps; yin_next++)
+                    yin_raw = yin_step(ana_buf, yin_next);
+                p = median_period(yin_raw);
             }
+            snapshot_window(start_ix);
+            yin_job = true;
+            yin_next = 0;
+            return p;
         }
 
-        Tbuf[Tix++] = period;
-
-        if (Tix >= nmed)
-            Tix = 0;
+        if (!worker.idle())
+        {
+            analysis_misses.fetch_add(1, std::memory_order_relaxed);
+            return p;
+        }
+        if (yin_job)
+            p = median_period(yin_raw);
+        snapshot_window(start_ix);
+        yin_job = true;
+        worker.post();
+        return p;
+    }
 
-        memcpy(Tsrt, Tbuf, nmed * sizeof(float));
+    /*
+        Host thread. Threaded mode starts the helper here; the switch itself
+        happens at a hop boundary once nothing is in flight.
+    */
+    void setAnalysisMode(int mode)
+    {
+        mode = clamp(mode, (int) AnalysisInline, (int) AnalysisThreaded);
+        if (mode == AnalysisThreaded)
+            worker.start([this] { yin_raw = yin_period(ana_buf); });
+        analysis_request.store(mode, std::memory_order_relaxed);
+    }
 
-        std::sort(Tsrt, Tsrt+nmed);
+    int analysisMode() const
+    {
+        return analysis_request.load(std::memory_order_relaxed);
+    }
 
-        return Tsrt[nmed / 2];
+    // hops the helper thread was still busy with the previous window
+    uint64_t analysisMisses() const
+    {
+        return analysis_misses.load(std::memory_order_relaxed);
     }
 
-#endif
     
+    /*
+        Synthesize from a precomputed analysis instead of the causal tracker.
+        Positions in the track count from the first frame processed after
+        reset(), so call this (and reset()) before the input starts.
+        The track must outlive the kernel's use of it; pass NULL to go back
+        to live analysis.
+    */
+    void setPitchTrack(const pitch_track_t * track_)
+    {
+        track = track_;
+        track_mark = 0;
+    }
+
+    // take every precomputed mark the reference point has passed by a quarter period,
+    // which is when findmark() would have committed it
+    void next_track_marks(double ref)
+    {
+        while (track_mark < track->nmarks && track->marks[track_mark] + T/4 <= ref)
+        {
+            memmove(pitchmark + 1, pitchmark, 2 * sizeof(float));
+            pitchmark[0] = (float) fmod(track->marks[track_mark], (double) ncbuf);
+            track_mark++;
+        }
+    }
+
     void findmark (void)
     {
         int mask = ncbuf - 1;
@@ -1151,6 +2157,7 @@ public:
         int min_ix = -1;
         midi_changed_sample_num = sample_count;
         midi_changed = 1;
+        key_on(note);
         
         if (!midi_enable)
         {
@@ -1161,7 +2168,7 @@ public:
         {
             // look for one with the same note and take that if we can, or the empty one with
             // the closest last note to the one we want
-            for (int k = 3; k < nvoices; k++)
+            for (int k = HARM_AUTO_VOICES; k < nvoices; k++)
             {
                 dist = abs(voices[k].lastnote - note);
                 if ((dist < min_dist && voices[k].midinote < 0) || voices[k].midinote == note)
@@ -1171,7 +2178,7 @@ public:
                 }
             }
             
-            if (min_dist >= 0)
+            if (min_ix >= 0)
             {
                 voices[min_ix].lastnote = voices[min_ix].midinote;
                 voices[min_ix].midinote = note;
@@ -1186,7 +2193,7 @@ public:
         // otherwise, we are stealing
         min_dist = 129;
         min_ix = -1;
-        for (int k = 3; k < nvoices; k++)
+        for (int k = HARM_AUTO_VOICES; k < nvoices; k++)
         {
             dist = abs(voices[k].midinote - note);
             if (dist < min_dist)
@@ -1203,14 +2210,16 @@ public:
         //voices[min_ix].nextgrain = 0;
         
         if (++voice_ix > nvoices)
-            voice_ix = 3;
+            voice_ix = HARM_AUTO_VOICES;
         
         return;
     }
     
     void remnote(int note)
     {
-        for (int k = 3; k < nvoices; k++)
+        key_off(note);
+
+        for (int k = HARM_AUTO_VOICES; k < nvoices; k++)
         {
             if (voices[k].midinote == note)
             {
@@ -1223,84 +2232,43 @@ public:
         midi_changed = 1;
     }
     
+    // held keys are tracked as a count per pitch class so the chord mask is always current
+    void key_on(int note)
+    {
+        if (keys_down[note])
+            return;
+        keys_down[note] = 1;
+        if (pc_count[note % 12]++ == 0)
+            pc_mask |= 1u << (note % 12);
+    }
+
+    void key_off(int note)
+    {
+        if (!keys_down[note])
+            return;
+        keys_down[note] = 0;
+        if (--pc_count[note % 12] == 0)
+            pc_mask &= ~(1u << (note % 12));
+    }
+
     void analyze_harmony(void)
     {
-        //float intervals[127];
-        int octave[12];
-        
-        memset(octave, 0, 12 * sizeof(int));
-        
-        int n = 0;
-        for (int j = 3; j < nvoices; j++)
-        {
-            if (voices[j].midinote < 0)
-                continue;
-            
-            midinotes[n++] = (float) voices[j].midinote;
-            
-            octave[voices[j].midinote % 12] = 1;
-        }
-        if (n == 0)
+        const chord_info_t & chord = ChordTable::shared().lookup(pc_mask);
+
+        if (chord.quality == CHORD_NONE || chord.confidence < chord_min_confidence)
             return;
 
-#ifdef __APPLE__
-        vDSP_vsort(midinotes, (vDSP_Length) n, 1);
-#else
-        std::sort(midinotes, midinotes + n);
-#endif
-        for (int j = 0; j < n; j++)
+        chord_quality = chord.quality;
+        int key = chord.root + 12 * chord.key_quality;
+        if (key != root_key)
         {
-            // ignore doubles
-            int dbl = 0;
-            for (int k = 0; k < j; k++)
-            {
-                if (((int)(midinotes[j] - midinotes[k]) % 12) == 0)
-                {
-                    dbl = 1; break;
-                }
-            }
-            
-            if (dbl)
-                continue;
-            
-            int ix = (int) midinotes[j] % 12;
-            
-            if (octave[(ix+2)%12] && octave[(ix+6)%12])
-            {
-                // 7th
-            }
-            
-            if (octave[(ix+3)%12] && octave[(ix+6)%12])
-            {
-                // dim
-            }
-            
-            if (octave[(ix+3)%12] && octave[(ix+7)%12])
-            {
-                //min
-                root_key = ix + 12;
-                break;
-            }
-            
-            if (octave[(ix+4)%12] && octave[(ix+7)%12])
-            {
-                //maj
-                root_key = ix;
-                break;
-            }
-            
-            if (octave[(ix+4)%12] && octave[(ix+8)%12])
-            {
-                //aug
-            }
-       
+            root_key = key;
+            send_event(HarmEventKeyChange, 0, 0, key);
         }
     }
     
     void update_voices (void)
     {
-        static int last_nn = 0;
-        
         voices[0].error = 0;
         //voices[0].ratio = 1;
         voices[0].target_ratio = 1;
@@ -1308,17 +2276,12 @@ public:
         voices[0].midivel = 127;
         voices[0].midinote = 0;
         
-        voices[1].midinote = -1;
-        voices[1].midivel = 65;
-        voices[1].pan = 0.5;
-        
-        voices[2].midinote = -1;
-        voices[2].midivel = 65;
-        voices[2].pan = -0.5;
-        
-        voices[3].midinote = -1;
-        voices[3].midivel = 65;
-        voices[3].pan = -0.5;
+        for (int k = 1; k < HARM_AUTO_VOICES; k++)
+        {
+            voices[k].midinote = -1;
+            voices[k].midivel = 65;
+            voices[k].pan = voice_pan(k);
+        }
         
         if (midi_changed && (sample_count - midi_changed_sample_num) > (int) sampleRate / 50)
         {
@@ -1330,14 +2293,12 @@ public:
             }
         }
         
-        static int was_voiced = 0;
-        
         if (!voiced)
         {
             note_number = -1.0;
             midi_note_number = -1.0;
             last_nn = -1;
-            for (int k = 0; k < 4; k++)
+            for (int k = 0; k < HARM_AUTO_VOICES; k++)
             {
                 voice_notes[k] = -1;
             }
@@ -1345,8 +2306,6 @@ public:
             return;
         }
         
-        //int n_auto = 4;
-            
         float f = log2f (sampleRate / (T * baseTuning));
         
         float note_f = f * 12.0;
@@ -1366,70 +2325,32 @@ public:
             midi_note_number = nn + 69;
         }
         
-        //float error = (note_f - (float)nn)/12;
-        //float error_ratio = powf(2.0, error);
-        
         int root = root_key % 12;
         int quality = root_key / 12;
         
         int interval = (last_nn + 69 - root) % 12;
         note_number = (nn + 69) % 12 + (note_f - nn);
         
-        //last_nn = nn;
-        
-        for (int k = 0; k < 4; k++)
+        // one row of the table holds every voice for this degree; inversion drops the upper chord voices
+        const int32_t * row = interval_offsets.row(quality, interval);
+        for (int k = 0; k < HARM_AUTO_VOICES; k++)
         {
             if (k >= n_auto)
             {
                 voice_notes[k] = -1;
             }
-            else {
-                voice_notes[k] = midi_note_number + interval_offsets[k + (interval*4) + (quality*48)];
-            }
-            
-            if (k > inversion)
+            else
             {
-                voice_notes[k] -= 12;
+                voice_notes[k] = midi_note_number + row[k];
+                if (k > inversion && k < 4)
+                {
+                    voice_notes[k] -= 12;
+                }
             }
             
             voices[k].midinote = voice_notes[k];
         }
         
-        //int start = (autotune || (triad >= 0)) ? 0 : 1;
-
-//        if (triad >= 0)
-//        {
-//            voices[0].midinote = 0;
-//            voices[1].midinote = 0;
-//            voices[2].midinote = 0;
-//            voices[1].target_ratio = voices[1].ratio = triads[triad].r1;
-//            voices[2].target_ratio = voices[2].ratio = triads[triad].r2;
-//        }
-        
-//        else if (auto_enable)
-//        {
-//            for (int k = start; k < n_auto; k++)
-//            {
-//                //voices[k].midinote = 0;
-//
-//                if (quality == 0)
-//                {
-//                    voices[k].target_ratio = major_chord_table[interval][k];
-//                }
-//                else if (quality == 1)
-//                {
-//                    voices[k].target_ratio = minor_chord_table[interval][k];
-//                }
-//                else if (quality == 2)
-//                {
-//                    voices[k].target_ratio = blues_chord_table[interval][k];
-//                }
-//
-//                if (k > inversion)
-//                    voices[k].target_ratio *= 0.5;
-//            }
-//        }
-//        else
         if (!auto_enable)
         {
             for (int k = 0; k < n_auto; k++)
@@ -1438,33 +2359,32 @@ public:
             }
         }
         
+        // pitch errors for every sounding voice, turned into ratios together below
+        float ratio_semis[HARM_AUTO_VOICES + HARM_MIDI_VOICES];
+        int ratio_voice[HARM_AUTO_VOICES + HARM_MIDI_VOICES];
+        int nratios = 0;
+        
+        const int32_t * triad_row = interval_offsets.row(CHORD_KEY_MAJOR, 0);
         for (int k = 0; k < nvoices; k++)
         {
             if (voices[k].midinote < 0)
                 continue;
             
-            if (triad >= 0 && k < 4)
+            if (triad >= 0 && k < HARM_AUTO_VOICES)
             {
-                voices[k].target_ratio = major_chord_table[0][k];
+                voices[k].target_ratio = intervals[triad_row[k]];
+                voice_notes[k] = midi_note_number + triad_row[k];
                 
-                if (k > inversion)
+                if (k > inversion && k < 4)
                 {
                     voices[k].target_ratio /= 2;
+                    voice_notes[k] -= 12;
                 }
                 
                 if (k == 0 && voices[k].target_ratio != 1)
                 {
                     voices[0].midinote = 0; // hack to turn on voice
                 }
-                
-                voice_notes[k] = midi_note_number + interval_offsets[k];
-                
-                if (k > inversion)
-                {
-                    voice_notes[k] -= 12;
-                }
-                
-                //fprintf(stderr,"%d: %f\n", k, major_chord_table[0][k]);
                 continue;
             }
             
@@ -1479,37 +2399,28 @@ public:
                 voices[k].midinote_ += diff;
             }
             
-            //voices[k].midinote_ = sgn(voices[k].midinote - voices[k].midinote_) * fmin(1.0, abs(voices[k].midinote - voices[k].midinote_));
-            
-            //voices[0].midinote = 0;
-            
             float error_hsteps = (voices[k].midinote_ - 69) - note_f;
             if (k == 0)
             {
                 error_hsteps *= corr_strength;
             }
-            voices[k].target_ratio = powf(2.0, error_hsteps/12);
-            //voices[k].ratio = voices[k].target_ratio;
+            ratio_semis[nratios] = error_hsteps;
+            ratio_voice[nratios++] = k;
+        }
+        
+        semitone_ratios(ratio_semis, ratio_semis, nratios);
+        for (int j = 0; j < nratios; j++)
+        {
+            voices[ratio_voice[j]].target_ratio = ratio_semis[j];
         }
         
         was_voiced = voiced;
     
-        //float frac = 0.99 - (speed * 0.29);
         float v1frac = 0.5;
         
         for (int k = 0; k < nvoices; k++)
         {
-//            if (k < n_auto && k >= start)
-//                voices[k].target_ratio /= error_ratio; // for autoharm
-            
-            if (k == 0)
-            {
-                voices[k].ratio = v1frac * voices[k].ratio + (1-v1frac) * voices[k].target_ratio;
-            }
-            else
-            {
             voices[k].ratio = v1frac * voices[k].ratio + (1-v1frac) * voices[k].target_ratio;
-            }
         }
     }
 	
@@ -1518,15 +2429,13 @@ public:
 private:
 	//std::vector<FilterState> channelStates;
     int nfft = 2048;
-    int l2nfft = 11;
-#ifdef __APPLE__
-    FFTSetup fft_s;
-    DSPSplitComplex fft_in, fft_out, fft_out2, fft_buf;
-#else
-    kiss_fft_cfg fft_s, ifft_s;
-    kiss_fft_cpx *fft_in, *fft_out, *fft_out2, *fft_buf;
-#endif
+    const FFTPlan * fft_fwd;
+    const FFTPlan * fft_inv;
+    float * fft_x;
+    float * fft_spec; // two spectra, nfft/2 + 1 bins each, split real/imaginary
+    float * fft_work; // the plans' working memory
     float * cbuf;
+    float * ana_buf;
     int ncbuf = 4096;
     int cix = 0;
     int rix = 0;
@@ -1536,6 +2445,13 @@ private:
     int nmed = 5;
     float Tbuf[5];
     float Tsrt[5];
+    int analysis_mode = AnalysisInline;             // render thread
+    std::atomic<int> analysis_request{AnalysisInline};
+    bool yin_job = false;           // ana_buf holds a window whose result hasn't been used
+    int yin_next = YinSteps;        // next sliced step
+    float yin_raw = 0;              // the window's YIN period once its last step has run
+    AnalysisWorker worker;
+    std::atomic<uint64_t> analysis_misses{0};
     int Tix;
     float pitchmark[3] = {0,-1,-1};
     int maxT = 600; // note nfft should be bigger than 3*maxT
@@ -1544,23 +2460,46 @@ private:
 	float sampleRate = 44100.0;
     float baseTuning = 440.0;
     int keycenter = 0;
-    float midinotes[128];
-    float midigain = 1.0;
-    float harmgain = 0.0;
-    float harmgain_target = 1.0;
-    float voicegain = 0.0;
-    float voicegain_target = 1.0;
+    // smoothed parameters; the plain floats hold the value for the current block
+    ParameterRamper voicegainRamper {1.0, ParameterRamper::Exponential};
+    ParameterRamper harmgainRamper {1.0, ParameterRamper::Exponential};
+    ParameterRamper drymixRamper {1.0, ParameterRamper::Exponential};
+    ParameterRamper dryenableRamper {0.0};
+    ParameterRamper midigainRamper {1.0, ParameterRamper::Exponential};
+    ParameterRamper corrRamper {0.5};
+    ParameterRamper speedRamper {1.0};
+    ramp_count_t ramp_frames = 882;
+    float dry_enable = 0.0;
     float dry_mix = 1.0;
     float speed = 1.0;
     float corr_strength = 0.5;
+    frame_count_t max_frames = 4096;
+    float * wet_l;
+    float * wet_r;
+    float * harm_l;
+    float * harm_r;
+    float * mix_buf;
+    float * voicegain_buf;
+    float * harmgain_buf;
+    float * drygain_buf;
+    float * midigain_buf;
     float threshold = 0.2;
+    float gate_thresh = -60.0; // dB
+    float gate_level = 0.001;
+    float gate_hold_sec = 0.1;
+    int gate_hold = 0;
+    int gate_open = 1;
+    unsigned int silent_frames = 0;
     int autotune = 1;
     int bypass = 0;
     
-    int nvoices = 16;
-    int voice_ix = 3;
+    int nvoices = HARM_AUTO_VOICES + HARM_MIDI_VOICES;
+    int voice_ix = HARM_AUTO_VOICES;
     
     int chord_quality = 0;
+    float chord_min_confidence = 0.6;
+    int pc_count[12];
+    unsigned int pc_mask = 0;
     voice_t * voices;
     int inversion = 2;
     int midi_enable = 1;
@@ -1569,26 +2508,63 @@ private:
     int midi_link = 1;
     int n_auto = 3;
     int triad = -1;
-    float interval_table[48];
-    int interval_offsets[144];
-    float * intervals;
-    triad_ratio_t triads[18];
-    chord_ratio_t major_chord_table[12];
-    chord_ratio_t minor_chord_table[12];
-    chord_ratio_t blues_chord_table[12];
+    // sized here rather than in init() so intervals set before it still land
+    VoicingTable interval_offsets {HARM_AUTO_VOICES, CHORD_KEY_NQUALITIES, HARM_DEGREES};
+    const float * intervals = NULL;
     
     int ngrains;
     int grain_ix = 0;
     grain_t * grains;
     
-    int graintablesize = maxT;
-    float * grain_window;
+    int interp_tier = InterpCubic;
+    const SincTable * sinc = NULL;
     
     unsigned int sample_count = 0;
+    uint64_t input_frames = 0;
+    const pitch_track_t * track = NULL;
+    uint64_t track_mark = 0;
+    int last_nn = 0;
+    int was_voiced = 0;
+    telemetry_t telem = {};
+    Seqlock<telemetry_t> telemetry;
+
+    Meter meter_in;
+    Meter meter_out[2];
+    Meter meter_lead;
+    Meter meter_harm;
+    std::atomic<int> meter_clear{0};
+
+    spectrum_t spec;
+    Seqlock<spectrum_t> spectrum;
+    std::atomic<int> spectrum_on{0};
+    const shared_tables_t * spectrum_tables = NULL;
+    const int * band_bin = NULL;
+    EventChannel events;
+    int grain_overflow = 0;
+    Looper looper;
+    RecordTap recorder;
+    bool tapping = false;           // between recorder.begin() and end() for this block
+    bool tap_voices = false;
+    GrainScheduler sched;
+    uint64_t sched_frames = 0;      // frames that have run the voice section
+    uint32_t ramping = 0;           // voices whose gain hasn't reached its target yet
+    int voices_dirty = 1;           // gain targets need recomputing
     unsigned int midi_changed_sample_num = 0;
     unsigned int midi_changed = 1;
 
     int preset_ix = 0;
+    const PresetBank * program_bank = NULL;
+
+    int algorithm = AlgorithmPSOLA;
+    SpectralShifter shifter;
+    bool shifter_live = false;      // the shifter has run since the last PSOLA block
+
+    int midi_tx_mel = 0;
+    int midi_tx_harm = 0;
+    uint8_t midi_out_velocity = 100;
+    MidiOutBuffer midi_out;
+    MidiNoteOut mel_out{0};
+    MidiNoteOut harm_out{1};
 
 //    AudioBufferList* inBufferListPtr = nullptr;
 //    AudioBufferList* outBufferListPtr = nullptr;
@@ -1598,10 +2574,12 @@ public:
     float ** in_buffers;
     float ** out_buffers;
 
+    // render-thread state; other threads should use readTelemetry()
     float note_number = -1.0;
-    float midi_note_number;
-    int voice_notes[4];
+    float midi_note_number = -1.0;
+    int voice_notes[HARM_AUTO_VOICES];
     int root_key = 0;
+    unsigned char keys_down[128];
 
     std::string preset_names[9] = {"Chords","Diatonic","Chromatic","Barbershop","JustMidi","Bohemian?","Bass!","4ths","Modes"};
 };
@@ -0,0 +1,498 @@
+//
+//  LoopStorage.hpp
+//  Harmonizer
+//
+//  Looper audio in fixed-size chunks from a preallocated pool, spilled to a
+//  file so a loop can run for as long as the disk allows while resident
+//  memory stays at pool size.
+//
+//  The render thread only ever touches resident chunks and never waits: a
+//  chunk that isn't resident when playback reaches it plays as silence, and
+//  recording into a chunk it can't get is dropped; both are counted. A
+//  background thread does everything else. It writes chunks to the file once
+//  the render thread has moved on from them, evicts clean chunks that won't
+//  be needed for longest, reads chunks back ahead of the playhead, and keeps
+//  a few zeroed chunks ready for recording.
+//
+//  Handing chunks back and forth needs no locks. The render thread announces
+//  the chunks it's using (hazards) before looking them up, and the spill
+//  thread only reclaims a chunk after unpublishing it and checking it isn't
+//  announced.
+//
+
+#ifndef LoopStorage_hpp
+#define LoopStorage_hpp
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "EventChannel.hpp"
+
+class LoopStorage {
+public:
+    enum { chunk_frames = 16384 };
+
+    ~LoopStorage() { close(); }
+
+    /*
+        Host thread. Allocates resident_chunks chunks of channels-interleaved
+        audio, creates an unlinked spill file in dir, and starts the spill
+        thread. max_chunks bounds the loop length; only a small index per
+        chunk is kept for it.
+    */
+    bool open(const char * dir, int channels_, int resident_chunks, size_t max_chunks_)
+    {
+        close();
+
+        std::string path = std::string(dir) + "/harmonizr-loop-XXXXXX";
+        std::vector<char> name(path.begin(), path.end());
+        name.push_back(0);
+        fd = mkstemp(name.data());
+        if (fd < 0)
+            return false;
+        unlink(name.data());    // the file goes away with the descriptor
+
+        channels = std::max(1, std::min(channels_, 8));
+        nslots = std::max(resident_chunks, (int) min_slots);
+        max_chunks = max_chunks_;
+        chunk_size = (size_t) chunk_frames * channels;
+
+        pool = (float *) calloc((size_t) nslots * chunk_size, sizeof(float));
+        owner = new std::atomic<int64_t>[nslots];
+        slot = new std::atomic<int32_t>[max_chunks];
+        write_gen = new std::atomic<uint32_t>[max_chunks];
+        clean_gen = new uint32_t[max_chunks];
+        on_disk = new uint8_t[max_chunks];
+
+        for (int s = 0; s < nslots; s++)
+            owner[s].store(-1, std::memory_order_relaxed);
+        for (size_t i = 0; i < max_chunks; i++)
+        {
+            slot[i].store(-1, std::memory_order_relaxed);
+            write_gen[i].store(0, std::memory_order_relaxed);
+            clean_gen[i] = 0;
+            on_disk[i] = 0;
+        }
+
+        free_slots.clear();
+        for (int s = nslots - 1; s >= 0; s--)
+            free_slots.push_back(s);
+
+        play_hazard.store(-1);
+        rec_hazard.store(-1);
+        head_chunk.store(0);
+        loop_chunks.store(1);
+        rec_spare = -1;
+        rec_slot = -1;
+        fresh_taken.store(0);
+        fresh_given = 0;
+        underruns.store(0);
+        overruns.store(0);
+
+        stop.store(0);
+        spiller = std::thread([this] { spill_loop(); });
+        return true;
+    }
+
+    void close()
+    {
+        if (spiller.joinable())
+        {
+            stop.store(1);
+            notifier.post();
+            spiller.join();
+        }
+
+        int32_t s;
+        while (fresh.pop(s))
+            ;
+
+        if (fd >= 0)
+            ::close(fd);
+        fd = -1;
+
+        free(pool);
+        pool = NULL;
+        delete[] owner;
+        delete[] slot;
+        delete[] write_gen;
+        delete[] clean_gen;
+        delete[] on_disk;
+        owner = NULL;
+        slot = NULL;
+        write_gen = NULL;
+        clean_gen = NULL;
+        on_disk = NULL;
+    }
+
+    bool isOpen() const { return pool != NULL; }
+    size_t maxFrames() const { return max_chunks * chunk_frames; }
+    size_t residentBytes() const { return (size_t) nslots * chunk_size * sizeof(float); }
+
+    // frames that played as silence because their chunk wasn't back from disk in time
+    uint32_t underrunFrames() const { return underruns.load(std::memory_order_relaxed); }
+    // frames that couldn't be recorded because no chunk was available
+    uint32_t overrunFrames() const { return overruns.load(std::memory_order_relaxed); }
+
+    // ---- render thread ----
+
+    // where playback or recording is, and how long the loop is; drives prefetch and eviction
+    void setHead(size_t frame, size_t length)
+    {
+        int64_t c = (int64_t) (frame / chunk_frames);
+        int64_t n = (int64_t) ((length + chunk_frames - 1) / chunk_frames);
+        if (n < 1)
+            n = 1;
+        loop_chunks.store(n, std::memory_order_relaxed);
+        if (head_chunk.exchange(c, std::memory_order_relaxed) != c)
+            notifier.post();
+    }
+
+    // add n frames of the loop starting at frame into out
+    void read(size_t frame, float * const * out_, int nout, int n)
+    {
+        float * out[8];
+        nout = std::min(nout, 8);
+        for (int ch = 0; ch < nout; ch++)
+            out[ch] = out_[ch];
+
+        while (n > 0)
+        {
+            size_t i = frame / chunk_frames;
+            int off = (int) (frame % chunk_frames);
+            int m = std::min(n, chunk_frames - off);
+
+            const float * src = play_chunk(i);
+            if (src)
+            {
+                src += (size_t) off * channels;
+                for (int ch = 0; ch < nout; ch++)
+                {
+                    const float * x = src + (ch % channels);
+                    float * y = out[ch];
+                    for (int k = 0; k < m; k++)
+                        y[k] += x[k * channels];
+                }
+            }
+            else
+            {
+                underruns.fetch_add(m, std::memory_order_relaxed);
+            }
+
+            for (int ch = 0; ch < nout; ch++)
+                out[ch] += m;
+            frame += m;
+            n -= m;
+        }
+    }
+
+    // record n frames of in at frame, replacing what's there or (overdub) adding to it
+    void write(size_t frame, const float * const * in, int nin, int n, bool overdub)
+    {
+        const float * src[8];
+        for (int ch = 0; ch < channels; ch++)
+            src[ch] = in[ch < nin ? ch : nin - 1];
+
+        while (n > 0)
+        {
+            size_t i = frame / chunk_frames;
+            int off = (int) (frame % chunk_frames);
+            int m = std::min(n, chunk_frames - off);
+
+            float * dst = rec_chunk(i, overdub);
+            if (dst)
+            {
+                dst += (size_t) off * channels;
+                for (int ch = 0; ch < channels; ch++)
+                {
+                    float * y = dst + ch;
+                    const float * x = src[ch];
+                    if (overdub)
+                        for (int k = 0; k < m; k++)
+                            y[k * channels] += x[k];
+                    else
+                        for (int k = 0; k < m; k++)
+                            y[k * channels] = x[k];
+                }
+            }
+            else
+            {
+                overruns.fetch_add(m, std::memory_order_relaxed);
+            }
+
+            for (int ch = 0; ch < channels; ch++)
+                src[ch] += m;
+            frame += m;
+            n -= m;
+        }
+    }
+
+    // not recording any more; lets the spill thread write the last chunk out
+    void endRecording()
+    {
+        if (rec_hazard.exchange(-1, std::memory_order_seq_cst) >= 0)
+            notifier.post();
+    }
+
+private:
+    enum { prefetch_chunks = 4, fresh_target = 2, min_slots = prefetch_chunks + fresh_target + 4 };
+
+    int fd = -1;
+    int channels = 0;
+    int nslots = 0;
+    size_t max_chunks = 0;
+    size_t chunk_size = 0;
+
+    float * pool = NULL;
+    std::atomic<int64_t> * owner = NULL;        // chunk held by each pool slot, -1 when free
+    std::atomic<int32_t> * slot = NULL;         // pool slot holding each chunk, -1 when not resident
+    std::atomic<uint32_t> * write_gen = NULL;   // bumped by the render thread whenever it starts writing a chunk's slot
+    uint32_t * clean_gen = NULL;                // spill thread: write_gen as of the last time the file caught up
+    uint8_t * on_disk = NULL;                   // spill thread: the file holds this chunk
+
+    std::atomic<int64_t> play_hazard{-1};
+    std::atomic<int64_t> rec_hazard{-1};
+    std::atomic<int64_t> head_chunk{0};
+    std::atomic<int64_t> loop_chunks{1};
+    std::atomic<uint32_t> underruns{0};
+    std::atomic<uint32_t> overruns{0};
+
+    SpscRing<int32_t, 8> fresh;     // zeroed slots, spill thread to render thread
+    std::atomic<uint32_t> fresh_taken{0};
+    uint32_t fresh_given = 0;       // spill thread
+    int32_t rec_spare = -1;         // render thread: a fresh slot it took but didn't need
+    int32_t rec_slot = -1;          // render thread: the slot write_gen was last bumped for
+
+    std::vector<int32_t> free_slots;    // spill thread
+    EventNotifier notifier;
+    std::atomic<int> stop{0};
+    std::thread spiller;
+
+    const float * play_chunk(size_t i)
+    {
+        if (i >= max_chunks)
+            return NULL;
+        if (play_hazard.load(std::memory_order_relaxed) != (int64_t) i)
+        {
+            play_hazard.store((int64_t) i, std::memory_order_seq_cst);
+            notifier.post();
+        }
+        int32_t s = slot[i].load(std::memory_order_seq_cst);
+        return (s < 0) ? NULL : pool + (size_t) s * chunk_size;
+    }
+
+    float * rec_chunk(size_t i, bool overdub)
+    {
+        if (i >= max_chunks)
+            return NULL;
+        if (rec_hazard.load(std::memory_order_relaxed) != (int64_t) i)
+        {
+            rec_slot = -1;
+            rec_hazard.store((int64_t) i, std::memory_order_seq_cst);
+            notifier.post();
+        }
+
+        int32_t s = slot[i].load(std::memory_order_seq_cst);
+        if (s < 0)
+        {
+            // overdubbing needs what's on disk; a new take just needs somewhere to go
+            if (overdub)
+                return NULL;
+            if (rec_spare < 0)
+            {
+                if (!fresh.pop(rec_spare))
+                    return NULL;
+                fresh_taken.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            s = rec_spare;
+            owner[s].store((int64_t) i, std::memory_order_relaxed);
+            int32_t expected = -1;
+            if (slot[i].compare_exchange_strong(expected, s, std::memory_order_seq_cst))
+            {
+                rec_spare = -1;
+            }
+            else
+            {
+                // the spill thread brought it back in the meantime
+                owner[s].store(-1, std::memory_order_relaxed);
+                s = expected;
+            }
+        }
+
+        /*
+            Dirty the chunk once per slot it's written in, not once per visit:
+            after a miss the spill thread may read it back and mark it clean
+            while the hazard is up, and everything written from then on has to
+            count as a change.
+        */
+        if (s != rec_slot)
+        {
+            write_gen[i].fetch_add(1, std::memory_order_relaxed);
+            rec_slot = s;
+        }
+        return pool + (size_t) s * chunk_size;
+    }
+
+    // ---- spill thread ----
+
+    void spill_loop()
+    {
+        while (!stop.load())
+        {
+            flush_dirty();
+            prefetch();
+            top_up_fresh();
+            notifier.wait();
+        }
+    }
+
+    bool busy(int64_t i) const
+    {
+        return play_hazard.load() == i || rec_hazard.load() == i;
+    }
+
+    // write every resident chunk the render thread has finished changing
+    void flush_dirty()
+    {
+        for (int s = 0; s < nslots; s++)
+        {
+            int64_t i = owner[s].load(std::memory_order_acquire);
+            if (i < 0 || slot[i].load() != s)
+                continue;
+
+            uint32_t g = write_gen[i].load();
+            if (g == clean_gen[i] || rec_hazard.load() == i)
+                continue;
+
+            size_t bytes = chunk_size * sizeof(float);
+            if (pwrite(fd, pool + (size_t) s * chunk_size, bytes, (off_t) (i * bytes)) != (ssize_t) bytes)
+                continue;
+
+            // only clean if nobody started writing it again while that was going on
+            if (write_gen[i].load() == g && rec_hazard.load() != i)
+            {
+                clean_gen[i] = g;
+                on_disk[i] = 1;
+            }
+        }
+    }
+
+    // how long until playback needs chunk i
+    int64_t distance(int64_t i) const
+    {
+        int64_t n = loop_chunks.load();
+        int64_t h = head_chunk.load();
+        if (i >= n)
+            return INT64_MAX;   // past the end of the loop: first to go
+        int64_t d = i - h;
+        return d < 0 ? d + n : d;
+    }
+
+    // free the clean resident chunk needed furthest in the future; -1 if there's none to give
+    int32_t evict(int64_t keep_within)
+    {
+        int32_t best = -1;
+        int64_t best_d = keep_within;
+        for (int s = 0; s < nslots; s++)
+        {
+            int64_t i = owner[s].load(std::memory_order_acquire);
+            if (i < 0 || slot[i].load() != s || write_gen[i].load() != clean_gen[i] || busy(i))
+                continue;
+            int64_t d = distance(i);
+            if (d > best_d)
+            {
+                best_d = d;
+                best = s;
+            }
+        }
+        if (best < 0)
+            return -1;
+
+        int64_t i = owner[best].load();
+        int32_t s = slot[i].exchange(-1, std::memory_order_seq_cst);
+        if (busy(i) || write_gen[i].load() != clean_gen[i])
+        {
+            // the render thread got to it first
+            slot[i].store(s, std::memory_order_seq_cst);
+            return -1;
+        }
+        owner[s].store(-1, std::memory_order_relaxed);
+        return s;
+    }
+
+    int32_t take_slot(int64_t keep_within)
+    {
+        if (!free_slots.empty())
+        {
+            int32_t s = free_slots.back();
+            free_slots.pop_back();
+            return s;
+        }
+        return evict(keep_within);
+    }
+
+    void prefetch()
+    {
+        int64_t n = loop_chunks.load();
+        int64_t h = head_chunk.load();
+        size_t bytes = chunk_size * sizeof(float);
+
+        for (int64_t d = 0; d <= prefetch_chunks && d < n; d++)
+        {
+            int64_t i = (h + d) % n;
+            if (i >= (int64_t) max_chunks || slot[i].load() >= 0 || !on_disk[i])
+                continue;
+
+            // never push out something needed sooner than what comes in
+            int32_t s = take_slot(d);
+            if (s < 0)
+                return;
+
+            float * dst = pool + (size_t) s * chunk_size;
+            ssize_t got = pread(fd, dst, bytes, (off_t) (i * bytes));
+            if (got < (ssize_t) bytes)
+                memset((char *) dst + (got > 0 ? got : 0), 0, bytes - (got > 0 ? got : 0));
+
+            clean_gen[i] = write_gen[i].load();
+            owner[s].store(i, std::memory_order_release);
+            int32_t expected = -1;
+            if (!slot[i].compare_exchange_strong(expected, s, std::memory_order_seq_cst))
+            {
+                owner[s].store(-1, std::memory_order_relaxed);
+                free_slots.push_back(s);
+            }
+        }
+    }
+
+    /*
+        Keep a few zeroed slots queued so recording never waits for one. While
+        a take is being recorded that beats keeping old audio resident; the
+        rest of the time only spare slots are queued.
+    */
+    void top_up_fresh()
+    {
+        bool recording = rec_hazard.load() >= 0;
+        while (fresh_given - fresh_taken.load(std::memory_order_relaxed) < fresh_target)
+        {
+            int32_t s = take_slot(recording ? 0 : INT64_MAX);
+            if (s < 0)
+                break;
+            memset(pool + (size_t) s * chunk_size, 0, chunk_size * sizeof(float));
+            fresh.push(s);
+            fresh_given++;
+        }
+    }
+};
+
+#endif /* LoopStorage_hpp */
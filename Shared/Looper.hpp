@@ -0,0 +1,191 @@
+//
+//  Looper.hpp
+//  Harmonizer
+//
+//  Loop recorder on the kernel's output. Modes follow the host's loop
+//  control: record a new take, play it back, play while overdubbing, or
+//  pause. The audio itself lives in LoopStorage, so a take can be as long
+//  as the disk allows while the resident memory stays fixed.
+//
+
+#ifndef Looper_hpp
+#define Looper_hpp
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+
+#include "LoopStorage.hpp"
+
+enum {
+    LoopStopped = 0,
+    LoopRec,
+    LoopPlay,
+    LoopPlayRec,
+    LoopPause
+};
+
+class Looper {
+public:
+    ~Looper() { close(); }
+
+    /*
+        Host thread. spill_dir holds the (unlinked) spill file; resident_seconds
+        caps the memory used for audio, max_seconds the length of a take.
+    */
+    bool open(const char * spill_dir, int channels, float sampleRate, int max_frames,
+              float resident_seconds = 20, float max_seconds = 4 * 3600)
+    {
+        close();
+
+        int resident = (int) (resident_seconds * sampleRate / LoopStorage::chunk_frames) + 1;
+        size_t max_chunks = (size_t) (max_seconds * sampleRate / LoopStorage::chunk_frames) + 1;
+        if (!storage.open(spill_dir, channels, resident, max_chunks))
+            return false;
+
+        nch = channels < 8 ? channels : 8;
+        scratch_frames = max_frames;
+        for (int ch = 0; ch < nch; ch++)
+            scratch[ch] = (float *) calloc(max_frames, sizeof(float));
+
+        current = LoopStopped;
+        requested.store(LoopStopped);
+        pos = 0;
+        length = 0;
+        position_.store(0);
+        return true;
+    }
+
+    void close()
+    {
+        storage.close();
+        for (int ch = 0; ch < 8; ch++)
+        {
+            free(scratch[ch]);
+            scratch[ch] = NULL;
+        }
+    }
+
+    bool isOpen() const { return storage.isOpen(); }
+
+    // any thread; takes effect at the start of the next block
+    void setMode(int mode)
+    {
+        if (mode >= LoopStopped && mode <= LoopPause)
+            requested.store(mode, std::memory_order_relaxed);
+    }
+
+    int mode() const { return requested.load(std::memory_order_relaxed); }
+
+    // playback position as a fraction of the loop, 0 while recording
+    float position() const { return position_.load(std::memory_order_relaxed); }
+
+    const LoopStorage & store() const { return storage; }
+
+    // render thread: record out and/or mix the loop into it
+    void process(float * const * out, int n)
+    {
+        if (!storage.isOpen() || n > scratch_frames)
+            return;
+
+        int m = requested.load(std::memory_order_relaxed);
+        if (m != current)
+            change_mode(m);
+
+        switch (current)
+        {
+            case LoopRec:
+            {
+                size_t room = storage.maxFrames() - pos;
+                int k = (int) ((size_t) n < room ? n : room);
+                storage.write(pos, out, nch, k, false);
+                pos += k;
+                storage.setHead(pos, pos);
+                position_.store(0, std::memory_order_relaxed);
+                break;
+            }
+            case LoopPlay:
+            case LoopPlayRec:
+            {
+                if (length == 0)
+                    break;
+
+                // read the loop before overdubbing, so the take doesn't hear itself twice
+                for (int ch = 0; ch < nch; ch++)
+                    memset(scratch[ch], 0, n * sizeof(float));
+
+                int done = 0;
+                while (done < n)
+                {
+                    int k = (int) std::min((size_t) (n - done), length - pos);
+                    float * dst[8];
+                    const float * src[8];
+                    for (int ch = 0; ch < nch; ch++)
+                    {
+                        dst[ch] = scratch[ch] + done;
+                        src[ch] = out[ch] + done;
+                    }
+
+                    storage.read(pos, dst, nch, k);
+                    if (current == LoopPlayRec)
+                        storage.write(pos, src, nch, k, true);
+
+                    pos += k;
+                    if (pos >= length)
+                        pos = 0;
+                    done += k;
+                }
+
+                for (int ch = 0; ch < nch; ch++)
+                    for (int k = 0; k < n; k++)
+                        out[ch][k] += scratch[ch][k];
+
+                storage.setHead(pos, length);
+                position_.store((float) pos / length, std::memory_order_relaxed);
+                break;
+            }
+            default:
+                break;
+        }
+    }
+
+private:
+    LoopStorage storage;
+    int nch = 0;
+    int scratch_frames = 0;
+    float * scratch[8] = {NULL};
+
+    std::atomic<int> requested{LoopStopped};
+    int current = LoopStopped;
+    size_t pos = 0;         // render thread
+    size_t length = 0;      // frames in the finished take
+    std::atomic<float> position_{0};
+
+    void change_mode(int m)
+    {
+        if (current == LoopRec)
+        {
+            // closing a take: it's as long as what was recorded
+            storage.endRecording();
+            length = pos;
+            pos = 0;
+        }
+        if (m == LoopRec)
+        {
+            pos = 0;
+            length = 0;
+        }
+        else if (m == LoopStopped)
+        {
+            pos = 0;
+        }
+        if (m != LoopPlayRec && m != LoopRec)
+            storage.endRecording();
+
+        current = m;
+        storage.setHead(pos, m == LoopRec ? 0 : length);
+    }
+};
+
+#endif /* Looper_hpp */
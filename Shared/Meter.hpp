@@ -0,0 +1,170 @@
+//
+//  Meter.hpp
+//  Harmonizer
+//
+//  Level meters that run once per render block. The per-sample work is a
+//  peak and a sum of squares over the block (vDSP on Apple, an unrolled loop
+//  the compiler vectorizes elsewhere). Ballistics are applied per block:
+//  peak hold then a steady fall, and RMS through a one-pole average. Clipped
+//  samples are only counted in the rare block whose peak reaches full scale.
+//
+
+#ifndef Meter_hpp
+#define Meter_hpp
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#ifdef __APPLE__
+#include <Accelerate/Accelerate.h>
+#endif
+
+typedef struct meter_reading_s
+{
+    float peak;         // falling peak, linear
+    float hold;         // highest peak in the hold time
+    float rms;          // averaged RMS
+    float block_rms;    // RMS of the last block alone
+    uint32_t clips;     // samples at or past full scale since the last reset
+} meter_reading_t;
+
+// peak magnitude and sum of squares of n samples
+static inline void meter_block_stats(const float * x, int n, float & peak, float & sumsq)
+{
+#ifdef __APPLE__
+    vDSP_maxmgv(x, 1, &peak, (vDSP_Length) n);
+    vDSP_svesq(x, 1, &sumsq, (vDSP_Length) n);
+#else
+    // four independent lanes so the loop vectorizes without -ffast-math
+    float p[4] = {0, 0, 0, 0};
+    float s[4] = {0, 0, 0, 0};
+    int k = 0;
+    for (; k + 4 <= n; k += 4)
+    {
+        for (int j = 0; j < 4; j++)
+        {
+            float v = x[k + j];
+            p[j] = std::max(p[j], fabsf(v));
+            s[j] += v * v;
+        }
+    }
+    for (; k < n; k++)
+    {
+        p[0] = std::max(p[0], fabsf(x[k]));
+        s[0] += x[k] * x[k];
+    }
+    peak = std::max(std::max(p[0], p[1]), std::max(p[2], p[3]));
+    sumsq = (s[0] + s[1]) + (s[2] + s[3]);
+#endif
+}
+
+class Meter {
+public:
+    /*
+        rms_seconds is the averaging time, hold_seconds how long a peak is
+        held, and fall_db_per_second how fast the peak comes down after.
+    */
+    void init(float sampleRate, float rms_seconds = 0.3f, float hold_seconds = 1.5f, float fall_db_per_second = 20.f)
+    {
+        rms_tau = rms_seconds * sampleRate;
+        hold_frames = (int) (hold_seconds * sampleRate);
+        fall_per_frame = fall_db_per_second / 20.f * logf(10.f) / sampleRate;
+        reset();
+    }
+
+    void reset()
+    {
+        peak = hold = 0;
+        ms = 0;
+        block_rms = 0;
+        held_for = 0;
+        clips = 0;
+    }
+
+    // one block of nch channels, metered together
+    void process(const float * const * x, int nch, int n)
+    {
+        if (n <= 0)
+            return;
+
+        float bpeak = 0, bsum = 0;
+        for (int ch = 0; ch < nch; ch++)
+        {
+            float p, s;
+            meter_block_stats(x[ch], n, p, s);
+            bpeak = std::max(bpeak, p);
+            bsum += s;
+
+            if (p >= 1.f)
+            {
+                for (int k = 0; k < n; k++)
+                    clips += fabsf(x[ch][k]) >= 1.f;
+            }
+        }
+        update(bpeak, bsum / (float) (n * nch), n);
+    }
+
+    void process(const float * x, int n)
+    {
+        process(&x, 1, n);
+    }
+
+    // a block known to be silent, without looking at it
+    void silence(int n)
+    {
+        if (n > 0)
+            update(0, 0, n);
+    }
+
+    void clearClips()
+    {
+        clips = 0;
+        hold = peak;
+        held_for = 0;
+    }
+
+    meter_reading_t reading() const
+    {
+        meter_reading_t r;
+        r.peak = peak;
+        r.hold = hold;
+        r.rms = sqrtf(ms);
+        r.block_rms = block_rms;
+        r.clips = clips;
+        return r;
+    }
+
+private:
+    float rms_tau = 13230;
+    int hold_frames = 66150;
+    float fall_per_frame = 5.2e-5f;
+
+    float peak = 0;
+    float hold = 0;
+    float ms = 0;           // averaged mean square
+    float block_rms = 0;
+    int held_for = 0;
+    uint32_t clips = 0;
+
+    void update(float bpeak, float bms, int n)
+    {
+        block_rms = sqrtf(bms);
+        ms += (bms - ms) * (1.f - expf(-(float) n / rms_tau));
+        if (ms < 1e-12f)
+            ms = 0;
+
+        peak = std::max(bpeak, peak * expf(-fall_per_frame * n));
+        if (peak < 1e-6f)
+            peak = 0;
+
+        held_for += n;
+        if (bpeak >= hold || held_for > hold_frames)
+        {
+            hold = std::max(bpeak, peak);
+            held_for = 0;
+        }
+    }
+};
+
+#endif /* Meter_hpp */
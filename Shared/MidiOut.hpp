@@ -0,0 +1,148 @@
+//
+//  MidiOut.hpp
+//  Harmonizer
+//
+//  MIDI notes out of the pitch tracker. MidiOutBuffer is a fixed array the
+//  render thread fills with channel messages at exact frame offsets, for the
+//  host to hand on after the render call. MidiNoteOut turns a stream of
+//  note sets (the tracked melody, or the harmony notes) into note-ons and
+//  note-offs: a set has to hold for a few analysis hops before it's sent,
+//  and only the notes that changed go out, so a note that is both a voice
+//  and the next chord tone isn't retriggered.
+//
+
+#ifndef MidiOut_hpp
+#define MidiOut_hpp
+
+#include <cstdint>
+
+#define MIDI_OUT_MAX_EVENTS 256
+
+typedef struct midi_out_event_s
+{
+    int32_t frame;          // from the start of the render call
+    uint8_t data[3];
+} midi_out_event_t;
+
+class MidiOutBuffer {
+public:
+    // host, before each render call
+    void clear()
+    {
+        n = 0;
+    }
+
+    bool push(int frame, uint8_t status, uint8_t d1, uint8_t d2)
+    {
+        if (n == MIDI_OUT_MAX_EVENTS)
+        {
+            dropped++;
+            return false;
+        }
+        midi_out_event_t & e = events[n++];
+        e.frame = frame;
+        e.data[0] = status;
+        e.data[1] = d1;
+        e.data[2] = d2;
+        return true;
+    }
+
+    int count() const { return n; }
+    const midi_out_event_t & event(int k) const { return events[k]; }
+    uint32_t droppedEvents() const { return dropped; }
+
+private:
+    midi_out_event_t events[MIDI_OUT_MAX_EVENTS];
+    int n = 0;
+    uint32_t dropped = 0;
+};
+
+class MidiNoteOut {
+public:
+    MidiNoteOut(int channel_ = 0, int hold_ = 2) : channel(channel_), hold(hold_) {}
+
+    void setChannel(int ch) { channel = ch & 0x0F; }
+    void setHold(int hops) { hold = hops > 0 ? hops : 1; }
+
+    /*
+        The notes that should sound now; negative entries are ignored. Called
+        once per analysis hop, with frame the offset to stamp the changes with.
+    */
+    void update(int frame, const int * notes, int n, uint8_t velocity, MidiOutBuffer & out)
+    {
+        uint64_t want[2] = {0, 0};
+        for (int k = 0; k < n; k++)
+        {
+            if (notes[k] >= 0 && notes[k] < 128)
+                want[notes[k] >> 6] |= 1ull << (notes[k] & 63);
+        }
+
+        if (want[0] == held[0] && want[1] == held[1])
+        {
+            pending_hops = 0;
+            return;
+        }
+
+        // hysteresis: a new set has to be seen hold times in a row
+        if (want[0] != pending[0] || want[1] != pending[1])
+        {
+            pending[0] = want[0];
+            pending[1] = want[1];
+            pending_hops = 0;
+        }
+        if (++pending_hops < hold)
+            return;
+
+        send(frame, want, velocity, out);
+    }
+
+    // release everything that's sounding, e.g. when the gate closes or on bypass
+    void release(int frame, MidiOutBuffer & out)
+    {
+        pending[0] = pending[1] = 0;
+        pending_hops = 0;
+        if (held[0] | held[1])
+        {
+            uint64_t none[2] = {0, 0};
+            send(frame, none, 0, out);
+        }
+    }
+
+    bool sounding() const { return (held[0] | held[1]) != 0; }
+
+private:
+    int channel;
+    int hold;
+    uint64_t held[2] = {0, 0};
+    uint64_t pending[2] = {0, 0};
+    int pending_hops = 0;
+
+    // offs before ons, so a synth with one voice per channel follows the move
+    void send(int frame, const uint64_t * want, uint8_t velocity, MidiOutBuffer & out)
+    {
+        for (int w = 0; w < 2; w++)
+        {
+            uint64_t off = held[w] & ~want[w];
+            while (off)
+            {
+                int bit = __builtin_ctzll(off);
+                off &= off - 1;
+                if (out.push(frame, 0x80 | channel, (uint8_t) (w * 64 + bit), 0))
+                    held[w] &= ~(1ull << bit);
+            }
+        }
+        for (int w = 0; w < 2; w++)
+        {
+            uint64_t on = want[w] & ~held[w];
+            while (on)
+            {
+                int bit = __builtin_ctzll(on);
+                on &= on - 1;
+                if (out.push(frame, 0x90 | channel, (uint8_t) (w * 64 + bit), velocity))
+                    held[w] |= 1ull << bit;
+            }
+        }
+    }
+};
+
+#endif /* MidiOut_hpp */
@@ -0,0 +1,219 @@
+//
+//  OfflineAnalysis.hpp
+//  Harmonizer
+//
+//  First pass of two-pass offline rendering: pitch analysis of a whole file.
+//
+//  The live kernel has to decide on a period from the audio it has already
+//  seen, and its running median adds a couple of hops of lag on top. Offline
+//  there's no reason for either, so this
+//
+//    1. runs the kernel's YIN estimator on every hop, in parallel chunks.
+//       Each chunk reads its hops' windows straight from the source, so the
+//       window - hop samples it shares with the next chunk act as the overlap
+//       and the raw estimates stitch without seams;
+//    2. smooths the whole track with a centred median and folds octave jumps
+//       back onto the surrounding pitch;
+//    3. places pitch marks with the same centre-of-mass rule as findmark(),
+//       but using the period centred on each mark instead of a lagging one.
+//
+//  The result drives HarmonizerDSPKernel::setPitchTrack() in the second pass.
+//
+
+#ifndef OfflineAnalysis_hpp
+#define OfflineAnalysis_hpp
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "HarmonizerDSPKernel.hpp"
+#include "PitchTrack.hpp"
+
+class OfflineAnalysis {
+public:
+    // reads n mono frames starting at frame start into out, returns frames read; called from several threads
+    typedef std::function<size_t(size_t start, size_t n, float * out)> source_t;
+
+    float sampleRate = 44100;
+    float threshold = 0.2;
+    int nthreads = 1;
+    int hop = 256;
+    int maxT = 600;          // must match the kernel
+    int nmed = 5;            // median length, in hops
+    int octave_span = 8;     // hops either side used as the reference for octave correction
+
+    void analyze(const source_t & source, size_t nframes, PitchTrackBuffer & out)
+    {
+        out.hop = hop;
+        out.window = 2 * maxT;
+
+        std::vector<float> raw((nframes + hop - 1) / hop, 0.f);
+        estimate(source, nframes, raw);
+        smooth(raw, out.period);
+        place_marks(source, nframes, out);
+    }
+
+private:
+    static const int hops_per_chunk = 1024;
+
+    void estimate(const source_t & source, size_t nframes, std::vector<float> & raw)
+    {
+        size_t nhops = raw.size();
+        size_t nchunks = (nhops + hops_per_chunk - 1) / hops_per_chunk;
+        std::atomic<size_t> next_chunk{0};
+
+        auto worker = [&] {
+            // each worker owns a kernel for its FFT setup and scratch
+            std::unique_ptr<HarmonizerDSPKernel> kernel(new HarmonizerDSPKernel());
+            kernel->init(1, sampleRate);
+            kernel->setParameter(HarmParamThreshold, threshold);
+
+            size_t window = 2 * maxT;
+            std::vector<float> x((hops_per_chunk - 1) * hop + window);
+
+            for (size_t c = next_chunk++; c < nchunks; c = next_chunk++)
+            {
+                size_t h0 = c * hops_per_chunk;
+                size_t h1 = std::min(nhops, h0 + hops_per_chunk);
+                size_t start = h0 * hop;
+
+                size_t n = std::min(x.size(), nframes - start);
+                n = source(start, n, x.data());
+                std::fill(x.begin() + n, x.end(), 0.f);
+
+                for (size_t h = h0; h < h1; h++)
+                {
+                    raw[h] = kernel->yin_period(x.data() + (h - h0) * hop);
+                }
+            }
+            kernel->fini();
+        };
+
+        int n = std::max(1, std::min(nthreads, (int) nchunks));
+        std::vector<std::thread> threads;
+        for (int k = 1; k < n; k++)
+            threads.emplace_back(worker);
+        worker();
+        for (auto & t : threads)
+            t.join();
+    }
+
+    void smooth(const std::vector<float> & raw, std::vector<float> & period)
+    {
+        size_t nhops = raw.size();
+        int half = nmed / 2;
+        period.assign(nhops, 0.f);
+
+        // centred median, unvoiced hops included so voicing edges stay where they are
+        std::vector<float> w(nmed);
+        for (size_t h = 0; h < nhops; h++)
+        {
+            int m = 0;
+            for (int k = -half; k <= half; k++)
+            {
+                long j = (long) h + k;
+                w[m++] = (j >= 0 && j < (long) nhops) ? raw[j] : 0.f;
+            }
+            std::nth_element(w.begin(), w.begin() + half, w.begin() + m);
+            period[h] = w[half];
+        }
+
+        // fold octave errors onto the median of the voiced neighbourhood
+        std::vector<float> ref;
+        std::vector<float> folded(period);
+        for (size_t h = 0; h < nhops; h++)
+        {
+            if (period[h] <= 0)
+                continue;
+
+            ref.clear();
+            for (long j = (long) h - octave_span; j <= (long) h + octave_span; j++)
+            {
+                if (j >= 0 && j < (long) nhops && period[j] > 0)
+                    ref.push_back(period[j]);
+            }
+            std::nth_element(ref.begin(), ref.begin() + ref.size() / 2, ref.end());
+            float r = period[h] / ref[ref.size() / 2];
+
+            if (r > 1.7f && r < 2.3f && period[h] / 2 > 20)
+                folded[h] = period[h] / 2;
+            else if (r > 0.43f && r < 0.59f && period[h] * 2 < maxT)
+                folded[h] = period[h] * 2;
+        }
+        period.swap(folded);
+    }
+
+    void place_marks(const source_t & source, size_t nframes, PitchTrackBuffer & out)
+    {
+        pitch_track_t track = out.view();
+        out.marks.clear();
+
+        // a sliding segment of the input, refilled whenever a search would run off its end
+        const size_t seglen = 1 << 16;
+        std::vector<float> seg(seglen);
+        size_t seg_start = 0, seg_n = 0;
+
+        double mark = 0;
+        float T = 400;
+
+        while (true)
+        {
+            float p = pitch_track_period(&track, mark);
+            if (p > 0)
+                T = p;
+
+            double next = mark + T;
+            if (next >= (double) nframes)
+                break;
+
+            float pn = pitch_track_period(&track, next);
+            if (pn > 0)
+            {
+                int srch_n = (int) T / 4;
+                long lo = (long) next - srch_n;
+                if (lo < 0)
+                    lo = 0;
+
+                if ((size_t) lo < seg_start || (size_t) lo + 2 * srch_n > seg_start + seg_n)
+                {
+                    seg_start = (size_t) lo;
+                    seg_n = source(seg_start, std::min(seglen, nframes - seg_start), seg.data());
+                }
+
+                // centre of mass of the waveform above its local minimum, as in findmark()
+                float min = HUGE_VALF;
+                for (int k = -srch_n; k < srch_n; k++)
+                {
+                    long ix = (long) next + k - (long) seg_start;
+                    if (ix >= 0 && ix < (long) seg_n)
+                        min = std::min(min, seg[ix]);
+                }
+
+                float mean = 0, sum = 0;
+                for (int k = -srch_n; k < srch_n; k++)
+                {
+                    long ix = (long) next + k - (long) seg_start;
+                    if (ix >= 0 && ix < (long) seg_n)
+                    {
+                        mean += (float) k * (seg[ix] - min);
+                        sum += seg[ix] - min;
+                    }
+                }
+
+                if (sum == 0)
+                    next += T;
+                else
+                    next += mean / sum;
+            }
+
+            out.marks.push_back(next);
+            mark = next;
+        }
+    }
+};
+
+#endif /* OfflineAnalysis_hpp */
@@ -11,27 +11,45 @@
 
 // N.B. This is C++.
 
-#import <AudioToolbox/AudioToolbox.h>
-#import <libkern/OSAtomic.h>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+
+// same width as AUAudioFrameCount, but usable off Apple platforms too.
+typedef uint32_t ramp_count_t;
 
 class ParameterRamper {
+public:
+    enum Shape {
+        Linear = 0,
+        // constant ratio per sample; for gains, so fades sound even in dB.
+        Exponential
+    };
+
+private:
 	float clampLow, clampHigh;
     float _uiValue;
     float _goal;
     float inverseSlope;
-    AUAudioFrameCount samplesRemaining;
+    float logSlope;
+    Shape shape;
+    ramp_count_t samplesRemaining;
     std::atomic<int32_t> changeCounter;
 	int32_t updateCounter = 0;
 
+    // exponential ramps are taken on (value + floor) so they can start or end at zero.
+    static constexpr float expFloor = 1e-3f;
+
     void setImmediate(float value) {
 		// only to be called from the render thread or when resources are not allocated.
         _goal = _uiValue = value;
         inverseSlope = 0.0;
+        logSlope = 0.0;
         samplesRemaining = 0;
     }
 
 public:
-	ParameterRamper(float value) {
+	ParameterRamper(float value, Shape shape_ = Linear) : shape(shape_), changeCounter(0) {
 		setImmediate(value);
 	}
 	
@@ -54,7 +72,7 @@ public:
 	
 	float getUIValue() const { return _uiValue; }
 	
-	void dezipperCheck(AUAudioFrameCount rampDuration)
+	void dezipperCheck(ramp_count_t rampDuration)
 	{
 		// check to see if the UI has changed and if so, start a ramp to dezipper it.
 		int32_t changeCounterSnapshot = changeCounter;
@@ -64,7 +82,7 @@ public:
 		}
 	}
 
-    void startRamp(float newGoal, AUAudioFrameCount duration) {
+    void startRamp(float newGoal, ramp_count_t duration) {
         if (duration == 0) {
             setImmediate(newGoal);
         }
@@ -73,7 +91,9 @@ public:
             	Set a new ramp.
             	Assigning to inverseSlope must come before assigning to goal.
             */
-            inverseSlope = (get() - newGoal) / float(duration);
+            float current = get();
+            inverseSlope = (current - newGoal) / float(duration);
+            logSlope = logf((current + expFloor) / (newGoal + expFloor)) / float(duration);
             samplesRemaining = duration;
             _goal = _uiValue = newGoal;
         }
@@ -84,8 +104,15 @@ public:
 			For long ramps, integrating a sum loses precision and does not reach 
             the goal at the right time. So instead, a line equation is used. y = m * x + b.
 		*/
+        if (shape == Exponential && samplesRemaining != 0) {
+            return (_goal + expFloor) * expf(logSlope * float(samplesRemaining)) - expFloor;
+        }
         return inverseSlope * float(samplesRemaining) + _goal;
     }
+
+    float goal() const { return _goal; }
+
+    bool isRamping() const { return samplesRemaining != 0; }
 	
     void step() {
         // Do this in each inner loop iteration after getting the value.
@@ -106,7 +133,7 @@ public:
         }
     }
 
-    void stepBy(AUAudioFrameCount n) {
+    void stepBy(ramp_count_t n) {
         /*
             When a parameter does not participate in the current inner loop, you 
             will want to advance it after the end of the loop.
@@ -118,6 +145,36 @@ public:
 			samplesRemaining -= n;
 		}
     }
+
+    void getBlock(float *out, ramp_count_t n) {
+        /*
+            Writes the next n values of the ramp and advances past them, so the
+            render loop can apply the parameter as a plain vector multiply.
+        */
+        ramp_count_t k = 0;
+        if (samplesRemaining != 0) {
+            ramp_count_t nramp = n < samplesRemaining ? n : samplesRemaining;
+            if (shape == Exponential) {
+                float a = get() + expFloor;
+                float r = expf(-logSlope);
+                for (; k < nramp; ++k) {
+                    out[k] = a - expFloor;
+                    a *= r;
+                }
+            }
+            else {
+                float a = get();
+                for (; k < nramp; ++k) {
+                    out[k] = a;
+                    a -= inverseSlope;
+                }
+            }
+            samplesRemaining -= nramp;
+        }
+        for (; k < n; ++k) {
+            out[k] = _goal;
+        }
+    }
 };
 
 #endif /* ParameterRamper_h */
@@ -0,0 +1,66 @@
+//
+//  PitchTrack.hpp
+//  Harmonizer
+//
+//  A precomputed pitch analysis of a whole input: one period estimate per
+//  analysis hop and every pitch mark, in absolute sample positions.
+//  The kernel can synthesize from one of these instead of running its own
+//  causal tracker (see HarmonizerDSPKernel::setPitchTrack).
+//
+//  pitch_track_t is only a view; OfflineAnalysis fills a PitchTrackBuffer
+//  that owns the storage.
+//
+
+#ifndef PitchTrack_hpp
+#define PitchTrack_hpp
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+typedef struct pitch_track_s
+{
+    uint32_t hop;           // samples between period estimates
+    uint32_t window;        // analysis window; hop h covers x[h*hop, h*hop + window)
+    uint64_t nhops;
+    uint64_t nmarks;
+    const float * period;   // period in samples per hop, 0 where unvoiced
+    const double * marks;   // pitch marks, ascending
+} pitch_track_t;
+
+// period of the hop whose window is centred nearest to pos
+static inline float pitch_track_period(const pitch_track_t * track, double pos)
+{
+    if (track->nhops == 0)
+        return 0;
+
+    double h = floor((pos - 0.5 * track->window) / track->hop + 0.5);
+    if (h < 0)
+        h = 0;
+    else if (h > track->nhops - 1)
+        h = (double) (track->nhops - 1);
+
+    return track->period[(uint64_t) h];
+}
+
+class PitchTrackBuffer {
+public:
+    uint32_t hop = 256;
+    uint32_t window = 1200;
+    std::vector<float> period;
+    std::vector<double> marks;
+
+    pitch_track_t view() const
+    {
+        pitch_track_t t;
+        t.hop = hop;
+        t.window = window;
+        t.nhops = period.size();
+        t.nmarks = marks.size();
+        t.period = period.data();
+        t.marks = marks.data();
+        return t;
+    }
+};
+
+#endif /* PitchTrack_hpp */
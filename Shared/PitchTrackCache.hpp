@@ -0,0 +1,208 @@
+//
+//  PitchTrackCache.hpp
+//  Harmonizer
+//
+//  Sidecar file holding an OfflineAnalysis result, so re-rendering a take
+//  with different presets, keys or interval tables skips the analysis pass.
+//
+//  The analysis only depends on the audio and the analysis settings, so the
+//  file is keyed by a hash of exactly those. A cache whose key doesn't match
+//  is simply ignored and rewritten. Reading maps the file and hands out a
+//  pitch_track_t that points straight into the mapping.
+//
+//  layout (little-endian, as written by the host):
+//      pitch_cache_header_t
+//      float  period[nhops]
+//      pad to 8 bytes
+//      double marks[nmarks]
+//
+
+#ifndef PitchTrackCache_hpp
+#define PitchTrackCache_hpp
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "PitchTrack.hpp"
+
+typedef struct pitch_cache_header_s
+{
+    char magic[4];          // "HZPT"
+    uint32_t version;
+    uint64_t key;
+    uint32_t hop;
+    uint32_t window;
+    uint64_t nhops;
+    uint64_t nmarks;
+} pitch_cache_header_t;
+
+class PitchTrackCache {
+public:
+    enum { version = 1 };
+
+    PitchTrackCache() {}
+    ~PitchTrackCache() { close(); }
+
+    // FNV-1a, a word at a time; plenty for telling takes apart, and fast enough to run on every render
+    static uint64_t hash(const void * data, size_t n, uint64_t h = 14695981039346656037ull)
+    {
+        const uint8_t * p = (const uint8_t *) data;
+        const uint64_t prime = 1099511628211ull;
+
+        for (; n >= 8; n -= 8, p += 8)
+        {
+            uint64_t w;
+            memcpy(&w, p, 8);
+            h = (h ^ w) * prime;
+        }
+        for (; n > 0; n--, p++)
+            h = (h ^ *p) * prime;
+        return h;
+    }
+
+    /*
+        Cache key for a take: the raw sample data, its format, and every
+        setting the analysis result depends on. Tuning isn't one of them: it
+        only maps the tracked periods to notes, after the analysis.
+    */
+    static uint64_t key(const void * audio, size_t nbytes, int sample_rate, int channels, int bits,
+                        float threshold, int hop, int maxT, int nmed)
+    {
+        uint64_t h = hash(audio, nbytes);
+        int32_t ints[6] = {sample_rate, channels, bits, hop, maxT, nmed};
+        h = hash(ints, sizeof(ints), h);
+        h = hash(&threshold, sizeof(threshold), h);
+        return h;
+    }
+
+    static std::string sidecarPath(const std::string & input)
+    {
+        return input + ".pitch";
+    }
+
+    // map the cache at path; false if it's missing, truncated, or for other audio/settings
+    bool open(const char * path, uint64_t key)
+    {
+        close();
+
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0)
+            return false;
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(pitch_cache_header_t))
+        {
+            ::close(fd);
+            return false;
+        }
+
+        map_size = (size_t) st.st_size;
+        map = (const uint8_t *) mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (map == MAP_FAILED)
+        {
+            map = NULL;
+            return false;
+        }
+
+        const pitch_cache_header_t * h = (const pitch_cache_header_t *) map;
+        if (memcmp(h->magic, "HZPT", 4) != 0 || h->version != version || h->key != key
+            || map_size != fileSize(h->nhops, h->nmarks))
+        {
+            close();
+            return false;
+        }
+
+        t.hop = h->hop;
+        t.window = h->window;
+        t.nhops = h->nhops;
+        t.nmarks = h->nmarks;
+        t.period = (const float *) (map + sizeof(pitch_cache_header_t));
+        t.marks = (const double *) (map + marksOffset(h->nhops));
+        return true;
+    }
+
+    void close()
+    {
+        if (map)
+            munmap((void *) map, map_size);
+        map = NULL;
+        memset(&t, 0, sizeof(t));
+    }
+
+    // valid between a successful open() and close()
+    const pitch_track_t & track() const { return t; }
+
+    /*
+        Write through a uniquely named temporary next to path, so a concurrent
+        reader never sees a partial file and two writers of the same cache
+        (the same input in two jobs) don't write into each other's.
+    */
+    static bool write(const char * path, uint64_t key, const PitchTrackBuffer & buf)
+    {
+        std::string tmp = std::string(path) + ".XXXXXX";
+        int fd = mkstemp(&tmp[0]);
+        if (fd < 0)
+            return false;
+        fchmod(fd, 0644);
+        FILE * fp = fdopen(fd, "wb");
+        if (!fp)
+        {
+            ::close(fd);
+            unlink(tmp.c_str());
+            return false;
+        }
+
+        pitch_cache_header_t h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, "HZPT", 4);
+        h.version = version;
+        h.key = key;
+        h.hop = buf.hop;
+        h.window = buf.window;
+        h.nhops = buf.period.size();
+        h.nmarks = buf.marks.size();
+
+        static const uint8_t zeros[8] = {0};
+        size_t pad = marksOffset(h.nhops) - sizeof(h) - h.nhops * sizeof(float);
+
+        bool ok = fwrite(&h, sizeof(h), 1, fp) == 1
+            && fwrite(buf.period.data(), sizeof(float), h.nhops, fp) == h.nhops
+            && fwrite(zeros, 1, pad, fp) == pad
+            && fwrite(buf.marks.data(), sizeof(double), h.nmarks, fp) == h.nmarks;
+        ok = (fclose(fp) == 0) && ok;
+
+        if (!ok || rename(tmp.c_str(), path) != 0)
+        {
+            unlink(tmp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+private:
+    const uint8_t * map = NULL;
+    size_t map_size = 0;
+    pitch_track_t t = {0, 0, 0, 0, NULL, NULL};
+
+    static size_t marksOffset(uint64_t nhops)
+    {
+        size_t off = sizeof(pitch_cache_header_t) + nhops * sizeof(float);
+        return (off + 7) & ~(size_t) 7;
+    }
+
+    static size_t fileSize(uint64_t nhops, uint64_t nmarks)
+    {
+        return marksOffset(nhops) + nmarks * sizeof(double);
+    }
+};
+
+#endif /* PitchTrackCache_hpp */
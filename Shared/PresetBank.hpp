@@ -0,0 +1,282 @@
+//
+//  PresetBank.hpp
+//  Harmonizer
+//
+//  Presets as one versioned binary file: a header, an index sorted by name
+//  hash, and fixed-size records holding the parameters, the whole auto-harmony
+//  interval table and the name. A bank on disk is memory-mapped and its records
+//  are used in place, so opening thousands of presets costs one mmap and a
+//  program change is a lookup plus a block copy into the kernel.
+//
+
+#ifndef PresetBank_hpp
+#define PresetBank_hpp
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define PRESET_BANK_VERSION 2           // 2: intervals for 8 voices and 6 key qualities
+#define PRESET_BANK_NPARAMS 18          // one per parameter address below HarmParamLoop
+#define PRESET_BANK_NINTERVALS 576      // qualities x degrees x voices, as the kernel's table
+#define PRESET_BANK_NAME_LEN 32
+#define PRESET_BANK_MAX_PRESETS 65536
+
+typedef struct harm_preset_s
+{
+    char name[PRESET_BANK_NAME_LEN];        // NUL-terminated
+    float params[PRESET_BANK_NPARAMS];      // by parameter address, NAN leaves the parameter as it is
+    int32_t intervals[PRESET_BANK_NINTERVALS];
+} harm_preset_t;
+
+typedef struct preset_bank_header_s
+{
+    char magic[4];                  // "HPBK"
+    uint32_t version;
+    uint32_t count;
+    uint32_t record_size;
+    uint32_t index_offset;          // count preset_bank_index_t, sorted by hash
+    uint32_t records_offset;        // count records, in program order
+    uint32_t reserved[2];
+} preset_bank_header_t;
+
+typedef struct preset_bank_index_s
+{
+    uint32_t hash;
+    uint32_t record;
+} preset_bank_index_t;
+
+class PresetBank {
+public:
+    PresetBank() {}
+    explicit PresetBank(std::vector<uint8_t> image) { openImage(std::move(image)); }
+    ~PresetBank() { close(); }
+
+    PresetBank(const PresetBank &) = delete;
+    PresetBank & operator=(const PresetBank &) = delete;
+
+    // map a bank file; the records are checked once here so applying one later needs no checks
+    bool open(const char * path)
+    {
+        close();
+
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0)
+            return false;
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(preset_bank_header_t))
+        {
+            ::close(fd);
+            return false;
+        }
+
+        size = (size_t) st.st_size;
+        void * m = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+
+        if (m == MAP_FAILED)
+        {
+            size = 0;
+            return false;
+        }
+        base = (const uint8_t *) m;
+        mapped = true;
+
+        // validate() reads every record, which also leaves the pages resident for the render thread
+        if (!validate())
+        {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    // use a bank already in memory, e.g. one made by build()
+    bool openImage(std::vector<uint8_t> image_)
+    {
+        close();
+        image = std::move(image_);
+        base = image.data();
+        size = image.size();
+        if (!validate())
+        {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close()
+    {
+        if (mapped)
+            munmap((void *) base, size);
+        mapped = false;
+        image.clear();
+        base = NULL;
+        size = 0;
+        hdr = NULL;
+        index = NULL;
+        records = NULL;
+    }
+
+    bool isOpen() const { return hdr != NULL; }
+    int count() const { return hdr ? (int) hdr->count : 0; }
+
+    // program number to preset, NULL when out of range
+    const harm_preset_t * preset(int program) const
+    {
+        if (!hdr || program < 0 || program >= (int) hdr->count)
+            return NULL;
+        return (const harm_preset_t *) (records + (size_t) program * hdr->record_size);
+    }
+
+    // program number of the preset with this name, -1 if there isn't one
+    int find(const char * name) const
+    {
+        if (!hdr)
+            return -1;
+
+        uint32_t h = hash(name);
+        const preset_bank_index_t * end = index + hdr->count;
+        const preset_bank_index_t * it = std::lower_bound(index, end, h,
+            [](const preset_bank_index_t & e, uint32_t v) { return e.hash < v; });
+
+        for (; it != end && it->hash == h; it++)
+        {
+            if (strncmp(preset(it->record)->name, name, PRESET_BANK_NAME_LEN) == 0)
+                return (int) it->record;
+        }
+        return -1;
+    }
+
+    // FNV-1a over the name as stored
+    static uint32_t hash(const char * name)
+    {
+        uint32_t h = 2166136261u;
+        for (int k = 0; k < PRESET_BANK_NAME_LEN && name[k]; k++)
+        {
+            h ^= (uint8_t) name[k];
+            h *= 16777619u;
+        }
+        return h;
+    }
+
+    // lay out n presets as a bank, in the order given
+    static std::vector<uint8_t> build(const harm_preset_t * presets, int n)
+    {
+        preset_bank_header_t h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, "HPBK", 4);
+        h.version = PRESET_BANK_VERSION;
+        h.count = (uint32_t) n;
+        h.record_size = sizeof(harm_preset_t);
+        h.index_offset = sizeof(preset_bank_header_t);
+        h.records_offset = h.index_offset + n * sizeof(preset_bank_index_t);
+
+        std::vector<preset_bank_index_t> ix(n);
+        for (int k = 0; k < n; k++)
+        {
+            ix[k].hash = hash(presets[k].name);
+            ix[k].record = (uint32_t) k;
+        }
+        std::stable_sort(ix.begin(), ix.end(),
+            [](const preset_bank_index_t & a, const preset_bank_index_t & b) { return a.hash < b.hash; });
+
+        std::vector<uint8_t> out(h.records_offset + (size_t) n * sizeof(harm_preset_t));
+        memcpy(out.data(), &h, sizeof(h));
+        if (n > 0)
+        {
+            memcpy(out.data() + h.index_offset, ix.data(), n * sizeof(preset_bank_index_t));
+            memcpy(out.data() + h.records_offset, presets, n * sizeof(harm_preset_t));
+        }
+
+        // names are compared with strncmp, so make sure they end
+        for (int k = 0; k < n; k++)
+            out[h.records_offset + (size_t) k * sizeof(harm_preset_t) + PRESET_BANK_NAME_LEN - 1] = 0;
+        return out;
+    }
+
+    // write a bank file, replacing any old one only once the new one is complete
+    static bool write(const char * path, const harm_preset_t * presets, int n)
+    {
+        std::vector<uint8_t> out = build(presets, n);
+        std::string tmp = std::string(path) + ".tmp";
+
+        FILE * fp = fopen(tmp.c_str(), "wb");
+        if (!fp)
+            return false;
+        bool ok = fwrite(out.data(), 1, out.size(), fp) == out.size();
+        ok = (fclose(fp) == 0) && ok;
+
+        if (!ok || rename(tmp.c_str(), path) != 0)
+        {
+            unlink(tmp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+private:
+    const uint8_t * base = NULL;
+    size_t size = 0;
+    bool mapped = false;
+    std::vector<uint8_t> image;
+
+    const preset_bank_header_t * hdr = NULL;
+    const preset_bank_index_t * index = NULL;
+    const uint8_t * records = NULL;
+
+    bool validate()
+    {
+        if (size < sizeof(preset_bank_header_t))
+            return false;
+
+        const preset_bank_header_t * h = (const preset_bank_header_t *) base;
+        if (memcmp(h->magic, "HPBK", 4) != 0 || h->version != PRESET_BANK_VERSION)
+            return false;
+        if (h->count > PRESET_BANK_MAX_PRESETS || h->record_size < sizeof(harm_preset_t) || h->record_size % 4)
+            return false;
+        if (h->index_offset % 4 || h->records_offset % 4)
+            return false;
+        if ((size_t) h->index_offset + (size_t) h->count * sizeof(preset_bank_index_t) > size)
+            return false;
+        if ((size_t) h->records_offset + (size_t) h->count * h->record_size > size)
+            return false;
+
+        const preset_bank_index_t * ix = (const preset_bank_index_t *) (base + h->index_offset);
+        const uint8_t * rec = base + h->records_offset;
+
+        for (uint32_t k = 0; k < h->count; k++)
+        {
+            if (ix[k].record >= h->count || (k > 0 && ix[k].hash < ix[k - 1].hash))
+                return false;
+
+            // the kernel copies intervals straight in, so they have to be in its range here
+            const harm_preset_t * p = (const harm_preset_t *) (rec + (size_t) k * h->record_size);
+            if (p->name[PRESET_BANK_NAME_LEN - 1] != 0)
+                return false;
+            for (int i = 0; i < PRESET_BANK_NINTERVALS; i++)
+            {
+                if (p->intervals[i] < -23 || p->intervals[i] > 23)
+                    return false;
+            }
+        }
+
+        hdr = h;
+        index = ix;
+        records = rec;
+        return true;
+    }
+};
+
+#endif /* PresetBank_hpp */
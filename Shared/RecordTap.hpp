@@ -0,0 +1,298 @@
+//
+//  RecordTap.hpp
+//  Harmonizer
+//
+//  Recording straight from the kernel. The render thread copies the stems
+//  it's asked for (final mix, dry input, lead voice, harmony sum, each
+//  voice on its own) into one preallocated ring, one interleaved frame at a
+//  time. A writer thread drains the ring into a WAV file per stem. A block
+//  that doesn't fit is dropped and counted instead of waiting for the disk.
+//
+
+#ifndef RecordTap_hpp
+#define RecordTap_hpp
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "EventChannel.hpp"
+#include "WavFile.hpp"
+
+enum {
+    RecordStemMix = 1 << 0,         // what the kernel outputs
+    RecordStemDry = 1 << 1,         // the input, mono
+    RecordStemLead = 1 << 2,        // the corrected lead voice, before its gain
+    RecordStemHarmony = 1 << 3,     // all harmony voices, before the harmony gain
+    RecordStemVoices = 1 << 4       // each voice on its own, mono, before the mix gains
+};
+
+#define RECORD_TAP_MAX_CHANNELS 64
+
+class RecordTap {
+public:
+    ~RecordTap() { stop(); }
+
+    /*
+        Host thread. Opens prefix-mix.wav, prefix-dry.wav, prefix-lead.wav,
+        prefix-harmony.wav and prefix-voiceN.wav for the requested stems,
+        allocates the ring and starts the writer. The render thread starts
+        recording at its next block.
+    */
+    bool start(const char * prefix, unsigned int stems_, int mix_channels, int nvoices_, float sampleRate,
+               int max_frames, float ring_seconds = 4)
+    {
+        stop();
+
+        stems = stems_;
+        nvoices = nvoices_;
+        nch = 0;
+        files.clear();
+
+        std::string p(prefix);
+        if (stems & RecordStemMix)
+            add_file(p + "-mix.wav", mix_channels);
+        if (stems & RecordStemDry)
+            add_file(p + "-dry.wav", 1);
+        if (stems & RecordStemLead)
+            add_file(p + "-lead.wav", 2);
+        if (stems & RecordStemHarmony)
+            add_file(p + "-harmony.wav", 2);
+        if (stems & RecordStemVoices)
+        {
+            for (int v = 0; v < nvoices; v++)
+                add_file(p + "-voice" + std::to_string(v) + ".wav", 1);
+        }
+
+        if (nch == 0 || nch > RECORD_TAP_MAX_CHANNELS)
+            return false;
+
+        for (auto & f : files)
+        {
+            f.writer.reset(new WavWriter());
+            if (!f.writer->open(f.path.c_str(), f.channels, (int) sampleRate))
+            {
+                files.clear();
+                return false;
+            }
+        }
+
+        capacity = (size_t) (ring_seconds * sampleRate);
+        if (capacity < (size_t) max_frames * 2)
+            capacity = (size_t) max_frames * 2;
+        ring.assign(capacity * nch, 0.f);
+        post_frames = (size_t) max_frames > capacity / 8 ? (size_t) max_frames : capacity / 8;
+
+        if (stems & RecordStemVoices)
+        {
+            voice_bufs.assign((size_t) nvoices * max_frames, 0.f);
+            voice_frames = max_frames;
+        }
+        else
+        {
+            voice_bufs.clear();
+            voice_frames = 0;
+        }
+
+        wpos.store(0);
+        rpos.store(0);
+        last_post = 0;
+        overruns.store(0);
+
+        stopping.store(0);
+        writer = std::thread([this] { write_loop(); });
+        armed.store(1, std::memory_order_seq_cst);
+        return true;
+    }
+
+    // host thread: stop taking audio, write out what's queued and close the files
+    void stop()
+    {
+        if (!writer.joinable())
+            return;
+
+        // once this returns the render thread is out of the tap for good
+        armed.store(0, std::memory_order_seq_cst);
+        while (in_block.load(std::memory_order_seq_cst))
+            std::this_thread::yield();
+
+        stopping.store(1);
+        notifier.post();
+        writer.join();
+
+        for (auto & f : files)
+            f.writer->close();
+    }
+
+    bool active() const { return armed.load(std::memory_order_relaxed) != 0; }
+    unsigned int stemMask() const { return stems; }
+
+    // frames taken into the ring, and frames dropped because it was full
+    uint64_t framesRecorded() const { return wpos.load(std::memory_order_relaxed); }
+    uint64_t overrunFrames() const { return overruns.load(std::memory_order_relaxed); }
+
+    // ---- render thread ----
+
+    /*
+        Bracket every block that touches the tap, voice buffers included.
+        begin() returns false when not recording, and then end() must not be
+        called.
+    */
+    bool begin()
+    {
+        if (!armed.load(std::memory_order_relaxed))
+            return false;
+        in_block.store(1, std::memory_order_seq_cst);
+        if (!armed.load(std::memory_order_seq_cst))
+        {
+            in_block.store(0, std::memory_order_release);
+            return false;
+        }
+        return true;
+    }
+
+    void end()
+    {
+        in_block.store(0, std::memory_order_release);
+    }
+
+    // per-voice scratch the kernel accumulates into while voice stems are on; NULL otherwise
+    float * voiceBuffer(int vix)
+    {
+        return voice_frames ? voice_bufs.data() + (size_t) vix * voice_frames : NULL;
+    }
+
+    void clearVoiceBuffers(int n)
+    {
+        for (int v = 0; v < nvoices; v++)
+            memset(voiceBuffer(v), 0, n * sizeof(float));
+    }
+
+    /*
+        Append n frames. src holds one pointer per channel in the tap's layout
+        (mix, dry, lead L/R, harmony L/R, voices, for the stems that are on);
+        NULL records silence. Returns the frames dropped because the writer
+        has fallen behind, so the kernel can tell the host.
+    */
+    int push(const float * const * src, int n)
+    {
+        uint64_t w = wpos.load(std::memory_order_relaxed);
+        uint64_t r = rpos.load(std::memory_order_acquire);
+        if (w + n - r > capacity)
+        {
+            overruns.fetch_add(n, std::memory_order_relaxed);
+            notifier.post();
+            return n;
+        }
+
+        size_t at = (size_t) (w % capacity);
+        for (int k = 0; k < n; k++)
+        {
+            float * frame = ring.data() + at * nch;
+            for (int ch = 0; ch < nch; ch++)
+                frame[ch] = src[ch] ? src[ch][k] : 0.f;
+            if (++at == capacity)
+                at = 0;
+        }
+        wpos.store(w + n, std::memory_order_release);
+
+        // wake the writer every so often rather than every block
+        if (w + n - last_post >= post_frames)
+        {
+            last_post = w + n;
+            notifier.post();
+        }
+        return 0;
+    }
+
+    int channels() const { return nch; }
+
+private:
+    typedef struct stem_file_s
+    {
+        std::string path;
+        int first;          // first ring channel
+        int channels;
+        std::unique_ptr<WavWriter> writer;
+    } stem_file_t;
+
+    std::vector<stem_file_t> files;
+    unsigned int stems = 0;
+    int nvoices = 0;
+    int nch = 0;
+
+    std::vector<float> ring;
+    size_t capacity = 0;            // frames
+    size_t post_frames = 0;
+    std::atomic<uint64_t> wpos{0};
+    std::atomic<uint64_t> rpos{0};
+    uint64_t last_post = 0;         // render thread
+    std::atomic<uint64_t> overruns{0};
+
+    std::vector<float> voice_bufs;
+    int voice_frames = 0;
+
+    std::atomic<int> armed{0};
+    std::atomic<int> in_block{0};
+    std::atomic<int> stopping{0};
+    EventNotifier notifier;
+    std::thread writer;
+
+    void add_file(const std::string & path, int channels)
+    {
+        stem_file_t f;
+        f.path = path;
+        f.first = nch;
+        f.channels = channels;
+        files.push_back(std::move(f));
+        nch += channels;
+    }
+
+    void write_loop()
+    {
+        std::vector<float> buf;
+        while (true)
+        {
+            bool last = stopping.load() != 0;
+            drain(buf);
+            if (last)
+                break;
+            notifier.wait();
+        }
+    }
+
+    // write everything queued so far, one stem file at a time
+    void drain(std::vector<float> & buf)
+    {
+        uint64_t r = rpos.load(std::memory_order_relaxed);
+        uint64_t w = wpos.load(std::memory_order_acquire);
+
+        while (r < w)
+        {
+            size_t at = (size_t) (r % capacity);
+            size_t n = (size_t) std::min<uint64_t>(w - r, capacity - at);
+            const float * frames = ring.data() + at * nch;
+
+            for (auto & f : files)
+            {
+                buf.resize(n * f.channels);
+                for (size_t k = 0; k < n; k++)
+                    for (int ch = 0; ch < f.channels; ch++)
+                        buf[k * f.channels + ch] = frames[k * nch + f.first + ch];
+                f.writer->writeInterleaved(buf.data(), n);
+            }
+
+            r += n;
+            rpos.store(r, std::memory_order_release);
+        }
+    }
+};
+
+#endif /* RecordTap_hpp */
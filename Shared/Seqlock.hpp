@@ -0,0 +1,85 @@
+//
+//  Seqlock.hpp
+//  Harmonizer
+//
+//  Publishes a small struct from the render thread to any number of
+//  readers without either side taking a lock. On its own so hosts that
+//  don't use the Shared kernel can snapshot their own state with it.
+//
+
+#ifndef Seqlock_hpp
+#define Seqlock_hpp
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+/*
+    Single-writer seqlock. The payload is stored as relaxed atomic words so
+    concurrent reads are well defined; the sequence number tells the reader
+    whether what it copied is a single snapshot. Kept on its own cache lines
+    so the render thread's hot state isn't shared with UI polling.
+*/
+template <typename T>
+class alignas(64) Seqlock {
+    static_assert(std::is_trivially_copyable<T>::value, "Seqlock payload must be trivially copyable");
+
+public:
+    Seqlock()
+    {
+        for (auto & w : words)
+            w.store(0, std::memory_order_relaxed);
+    }
+
+    // render thread only
+    void publish(const T & value)
+    {
+        uint64_t tmp[nwords] = {0};
+        memcpy(tmp, &value, sizeof(T));
+
+        uint32_t s = seq.load(std::memory_order_relaxed);
+        seq.store(s + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        for (size_t k = 0; k < nwords; k++)
+            words[k].store(tmp[k], std::memory_order_relaxed);
+
+        seq.store(s + 2, std::memory_order_release);
+    }
+
+    // any thread; false if a publish got in the way
+    bool tryRead(T & out) const
+    {
+        uint64_t tmp[nwords];
+
+        uint32_t s1 = seq.load(std::memory_order_acquire);
+        if (s1 & 1)
+            return false;
+
+        for (size_t k = 0; k < nwords; k++)
+            tmp[k] = words[k].load(std::memory_order_relaxed);
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (seq.load(std::memory_order_relaxed) != s1)
+            return false;
+
+        memcpy(&out, tmp, sizeof(T));
+        return true;
+    }
+
+    // a publish takes well under a microsecond, so this settles almost immediately
+    void read(T & out) const
+    {
+        while (!tryRead(out))
+            ;
+    }
+
+private:
+    static const size_t nwords = (sizeof(T) + 7) / 8;
+
+    std::atomic<uint32_t> seq{0};
+    alignas(64) std::atomic<uint64_t> words[nwords];
+};
+
+#endif /* Seqlock_hpp */
@@ -0,0 +1,168 @@
+//
+//  SharedTables.hpp
+//  Harmonizer
+//
+//  Read-only tables that every kernel instance would otherwise build and
+//  keep its own copy of. Tables that depend on nothing are built once per
+//  process, like the chord and sinc tables. Tables that depend on a frame
+//  size or sample rate are built for the first instance that asks for that
+//  size and rate, shared by the rest, and freed when the last one lets go,
+//  so a process running hundreds of instances at one rate holds one copy.
+//
+//  Entries start on a cache line. acquire() and release() take a lock and
+//  may allocate: host thread only (init and fini), never while rendering.
+//
+
+#ifndef SharedTables_hpp
+#define SharedTables_hpp
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+#include "Telemetry.hpp"
+
+#define SHARED_TABLES_ALIGN 64
+
+typedef struct shared_tables_s
+{
+    int n;                              // frame size
+    float rate;                         // sample rate; 0 for tables of n alone
+    int refs;
+    float * hann;                       // n-point periodic Hann window
+    int band_bin[SPECTRUM_BANDS + 1];   // first bin of each log-spaced display band, 40 Hz up; rate > 0 only
+} shared_tables_t;
+
+class SharedTables {
+public:
+    /*
+        Equal-tempered ratios 2^(k/12) for k from -23 to 23, indexed by k.
+        Built on first use; the kernel calls it from init().
+    */
+    static const float * intervals()
+    {
+        alignas(SHARED_TABLES_ALIGN) static float table[48];
+        static const bool built = [] {
+            for (int k = -23; k < 24; k++)
+                table[k + 24] = powf(2.0, (float) (k) / 12);
+            return true;
+        }();
+        (void) built;
+        return table + 24;
+    }
+
+    /*
+        Tables for frame size n at this sample rate, built if no one holds
+        them yet. Pair each call with release(). Returns NULL only if it
+        couldn't allocate.
+    */
+    static const shared_tables_t * acquire(int n, float rate)
+    {
+        std::lock_guard<std::mutex> guard(lock());
+        std::vector<shared_tables_t *> & all = entries();
+        for (shared_tables_t * t : all)
+        {
+            if (t->n == n && t->rate == rate)
+            {
+                t->refs++;
+                return t;
+            }
+        }
+
+        shared_tables_t * t = build(n, rate);
+        if (t)
+            all.push_back(t);
+        return t;
+    }
+
+    // NULL is fine
+    static void release(const shared_tables_t * tables)
+    {
+        if (!tables)
+            return;
+        std::lock_guard<std::mutex> guard(lock());
+        std::vector<shared_tables_t *> & all = entries();
+        for (size_t k = 0; k < all.size(); k++)
+        {
+            if (all[k] != tables)
+                continue;
+            if (--all[k]->refs == 0)
+            {
+                free(all[k]->hann);
+                free(all[k]);
+                all.erase(all.begin() + k);
+            }
+            return;
+        }
+    }
+
+    // distinct tables currently held, for tests
+    static int liveCount()
+    {
+        std::lock_guard<std::mutex> guard(lock());
+        return (int) entries().size();
+    }
+
+private:
+    static std::mutex & lock()
+    {
+        static std::mutex m;
+        return m;
+    }
+
+    static std::vector<shared_tables_t *> & entries()
+    {
+        static std::vector<shared_tables_t *> all;
+        return all;
+    }
+
+    static void * aligned(size_t bytes)
+    {
+        void * p = NULL;
+        size_t size = (bytes + SHARED_TABLES_ALIGN - 1) & ~(size_t) (SHARED_TABLES_ALIGN - 1);
+        if (posix_memalign(&p, SHARED_TABLES_ALIGN, size) != 0)
+            return NULL;
+        return p;
+    }
+
+    static shared_tables_t * build(int n, float rate)
+    {
+        shared_tables_t * t = (shared_tables_t *) aligned(sizeof(shared_tables_t));
+        float * hann = (float *) aligned(n * sizeof(float));
+        if (!t || !hann)
+        {
+            free(t);
+            free(hann);
+            return NULL;
+        }
+        memset(t, 0, sizeof(*t));
+        t->n = n;
+        t->rate = rate;
+        t->refs = 1;
+        t->hann = hann;
+
+        for (int k = 0; k < n; k++)
+            hann[k] = 0.5f * (1 - cosf(2 * M_PI * k / n));
+
+        if (rate > 0)
+        {
+            int nbins = n/2 + 1;
+            float fmin = 40.f, fmax = rate / 2;
+            float hz_per_bin = rate / n;
+
+            t->band_bin[0] = std::max(1, (int) (fmin / hz_per_bin));
+            for (int b = 1; b <= SPECTRUM_BANDS; b++)
+            {
+                float f = fmin * powf(fmax / fmin, (float) b / SPECTRUM_BANDS);
+                int k = (int) ceilf(f / hz_per_bin);
+                t->band_bin[b] = std::min(nbins, std::max(t->band_bin[b - 1] + 1, k));
+            }
+        }
+        return t;
+    }
+};
+
+#endif /* SharedTables_hpp */
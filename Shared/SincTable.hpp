@@ -0,0 +1,77 @@
+//
+//  SincTable.hpp
+//  Harmonizer
+//
+//  Polyphase windowed-sinc coefficients for the highest grain read quality.
+//  Each phase holds SINC_TAPS taps for one fractional position, normalised
+//  to unity gain, and a read picks the nearest of SINC_PHASES + 1 phases
+//  rather than interpolating between them. The table is built once and
+//  shared by every kernel, like the FFT plans.
+//
+
+#ifndef SincTable_hpp
+#define SincTable_hpp
+
+#include <cmath>
+
+#define SINC_TAPS 16
+#define SINC_PHASES 1024
+
+class SincTable {
+public:
+    /*
+        The first call builds the table, so make it off the render thread
+        (the kernel does in init()).
+    */
+    static const SincTable & shared()
+    {
+        static const SincTable table;
+        return table;
+    }
+
+    /*
+        Taps for a read at fraction a (0..1) of the way from x[SINC_TAPS/2 - 1]
+        to x[SINC_TAPS/2], where x holds the SINC_TAPS samples around it.
+    */
+    const float * phase(float a) const
+    {
+        return coef[(int) (a * SINC_PHASES + 0.5f)];
+    }
+
+    // sum of x[t] * taps(a)[t]
+    float read(const float * x, float a) const
+    {
+        const float * h = phase(a);
+        float y = 0;
+        for (int t = 0; t < SINC_TAPS; t++)
+            y += x[t] * h[t];
+        return y;
+    }
+
+private:
+    float coef[SINC_PHASES + 1][SINC_TAPS];
+
+    // cutoff a little under Nyquist so the Blackman window still stops well
+    SincTable()
+    {
+        const double fc = 0.9;
+        const double half = SINC_TAPS / 2;
+        for (int p = 0; p <= SINC_PHASES; p++)
+        {
+            double a = (double) p / SINC_PHASES;
+            double sum = 0;
+            for (int t = 0; t < SINC_TAPS; t++)
+            {
+                double x = t - (half - 1) - a;
+                double s = x == 0 ? 1 : sin(M_PI * fc * x) / (M_PI * fc * x);
+                double w = 0.42 + 0.5 * cos(M_PI * x / half) + 0.08 * cos(2 * M_PI * x / half);
+                coef[p][t] = (float) (fc * s * w);
+                sum += coef[p][t];
+            }
+            for (int t = 0; t < SINC_TAPS; t++)
+                coef[p][t] = (float) (coef[p][t] / sum);
+        }
+    }
+};
+
+#endif /* SincTable_hpp */
@@ -0,0 +1,360 @@
+//
+//  SpectralShifter.hpp
+//  Harmonizer
+//
+//  The frequency-domain alternative to the PSOLA grains. The input goes
+//  through one STFT per hop; the peaks of that spectrum and their regions
+//  are found once, then every voice moves whole regions to its pitch and
+//  rotates their phase to match (peak-locked pitch shifting, after Laroche
+//  and Dolson). Each bin is also rescaled by the smoothed spectral envelope
+//  at its old and new place, so the formants stay where they were.
+//
+//  Voices only add a pass over the bins; the FFTs are shared. There's one
+//  forward transform per hop, and at most four inverse transforms and
+//  overlap-adds (lead and harmony, left and right) however many voices
+//  are sounding.
+//
+
+#ifndef SpectralShifter_hpp
+#define SpectralShifter_hpp
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#include "FFT.hpp"
+#include "SharedTables.hpp"
+
+#ifdef __APPLE__
+#include <Accelerate/Accelerate.h>
+#endif
+
+#define SPECTRAL_MAX_VOICES 32
+
+typedef struct spectral_voice_s
+{
+    float ratio;            // pitch shift
+    float formant;          // envelope shift, 1 leaves the formants in place
+    float gain_l;           // 0 for both turns the voice off
+    float gain_r;
+    int lead;               // mixed into the lead output rather than the harmony
+} spectral_voice_t;
+
+// s[k], c[k] = sin, cos of x[k], for x in -pi..pi
+static inline void spectral_sincos(const float * x, float * s, float * c, int n)
+{
+#ifdef __APPLE__
+    vvsincosf(s, c, x, &n);
+#else
+    for (int k = 0; k < n; k++)
+    {
+        // quarter turns, then a polynomial on -pi/4..pi/4
+        float q = (x[k] * 0.63661977f + 12582912.f) - 12582912.f;
+        float r = (x[k] - q * 1.5703125f) - q * 4.8382679e-4f;
+        float r2 = r * r;
+        float sr = r + r * r2 * (-0.16666667f + r2 * (0.0083333333f - r2 * 0.00019841270f));
+        float cr = 1.f + r2 * (-0.5f + r2 * (0.041666667f + r2 * (-0.0013888889f + r2 * 2.4801587e-5f)));
+        int quadrant = (int) q;
+        bool swap = quadrant & 1;
+        float sv = swap ? cr : sr;
+        float cv = swap ? sr : cr;
+        s[k] = (quadrant & 2) ? -sv : sv;
+        c[k] = ((quadrant + 1) & 2) ? -cv : cv;
+    }
+#endif
+}
+
+class SpectralShifter {
+public:
+    ~SpectralShifter()
+    {
+        SharedTables::release(tables);
+    }
+
+    /*
+        nfft must be a power of two the FFT supports; the hop is a quarter
+        of it, and the output lags the input by nfft samples. Host thread.
+    */
+    void init(int nfft_, int nvoices_)
+    {
+        nfft = nfft_;
+        hop = nfft / 4;
+        nbins = nfft / 2 + 1;
+        nvoices = std::min(nvoices_, SPECTRAL_MAX_VOICES);
+        fwd = FFT::plan(nfft, FFTForward);
+        inv = FFT::plan(nfft, FFTInverse);
+
+        // the analysis and synthesis window is the same for every shifter of this size
+        SharedTables::release(tables);
+        tables = SharedTables::acquire(nfft, 0);
+        window = tables->hann;
+
+        in_buf.assign(nfft, 0.f);
+        frame.assign(nfft, 0.f);
+        work.assign(FFTPlan::scratchSize(nfft), 0.f);
+        re.assign(nbins, 0.f);
+        im.assign(nbins, 0.f);
+        mag.assign(nbins, 0.f);
+        last_phase.assign(nbins, 0.f);
+        advance.assign(nbins, 0.f);
+        csum.assign(nbins + 1, 0.f);
+        env.assign(nbins, 0.f);
+        inv_env.assign(nbins, 0.f);
+        peak_bin.assign(nbins, 0);
+        region_end.assign(nbins, 0);
+        peak_theta.assign(nbins, 0.f);
+        peak_sin.assign(nbins, 0.f);
+        peak_cos.assign(nbins, 0.f);
+        rot.assign((size_t) nvoices * nbins, 0.f);
+        for (int b = 0; b < 4; b++)
+        {
+            bus_re[b].assign(nbins, 0.f);
+            bus_im[b].assign(nbins, 0.f);
+            ola[b].assign(nfft, 0.f);
+        }
+        memset(voices, 0, sizeof(voices));
+        for (int v = 0; v < SPECTRAL_MAX_VOICES; v++)
+            voices[v].ratio = voices[v].formant = 1;
+        reset();
+    }
+
+    // host thread: lets go of the shared window; init() again before processing
+    void fini()
+    {
+        SharedTables::release(tables);
+        tables = NULL;
+        window = NULL;
+    }
+
+    void reset()
+    {
+        std::fill(in_buf.begin(), in_buf.end(), 0.f);
+        std::fill(last_phase.begin(), last_phase.end(), 0.f);
+        for (int b = 0; b < 4; b++)
+            std::fill(ola[b].begin(), ola[b].end(), 0.f);
+        memset(was_active, 0, sizeof(was_active));
+        fill = nfft - hop;
+        quiet_hops = nfft / hop;
+    }
+
+    // set before process(); read once per hop
+    spectral_voice_t & voice(int v) { return voices[v]; }
+    int voiceCount() const { return nvoices; }
+
+    // the envelope is smoothed over one harmonic spacing either side of each bin
+    void setPeriod(float period)
+    {
+        int bins = period > 0 ? (int) (nfft / period) : 4;
+        env_width = std::max(2, std::min(bins, nbins / 8));
+    }
+
+    int latency() const { return nfft; }
+
+    // nothing sounding and nothing left in the overlap-add
+    bool idle() const { return quiet_hops >= nfft / hop; }
+
+    // add n samples of each output to lead_l/r and harm_l/r
+    void process(const float * in, int n, float * lead_l, float * lead_r, float * harm_l, float * harm_r)
+    {
+        float * out[4] = {lead_l, lead_r, harm_l, harm_r};
+        while (n > 0)
+        {
+            int run = std::min(n, nfft - fill);
+            memcpy(in_buf.data() + fill, in, run * sizeof(float));
+
+            int ix = fill - (nfft - hop);
+            for (int b = 0; b < 4; b++)
+            {
+                const float * src = ola[b].data() + ix;
+                for (int k = 0; k < run; k++)
+                    out[b][k] += src[k];
+                out[b] += run;
+            }
+
+            fill += run;
+            in += run;
+            n -= run;
+
+            if (fill == nfft)
+            {
+                analyze_frame();
+                fill = nfft - hop;
+                memmove(in_buf.data(), in_buf.data() + hop, (nfft - hop) * sizeof(float));
+            }
+        }
+    }
+
+private:
+    int nfft = 1024;
+    int hop = 256;
+    int nbins = 513;
+    int nvoices = 0;
+    int env_width = 4;
+    int fill = 768;
+    int quiet_hops = 4;
+    const FFTPlan * fwd = NULL;
+    const FFTPlan * inv = NULL;
+
+    spectral_voice_t voices[SPECTRAL_MAX_VOICES];
+    bool was_active[SPECTRAL_MAX_VOICES];
+
+    const shared_tables_t * tables = NULL;
+    const float * window = NULL;
+    std::vector<float> in_buf, frame, work;
+    std::vector<float> re, im, mag, last_phase, advance, csum, env, inv_env;
+    std::vector<int> peak_bin, region_end;
+    std::vector<float> peak_theta, peak_sin, peak_cos;
+    std::vector<float> rot;                 // per voice, the phase rotation last used at each bin
+    std::vector<float> bus_re[4], bus_im[4], ola[4];
+
+    static float wrap(float x)
+    {
+        const float twopi = 6.2831853f;
+        float n = (x * (1.f / twopi) + 12582912.f) - 12582912.f;
+        return x - n * twopi;
+    }
+
+    void analyze_frame()
+    {
+        for (int k = 0; k < nfft; k++)
+            frame[k] = in_buf[k] * window[k];
+        fwd->run(frame.data(), re.data(), im.data(), work.data());
+
+        // magnitude, and the phase advance over the hop that each bin really saw
+        float expect = 2 * M_PI * hop / nfft;
+        float peak_mag = 0;
+        for (int k = 0; k < nbins; k++)
+        {
+            mag[k] = sqrtf(re[k] * re[k] + im[k] * im[k]);
+            peak_mag = std::max(peak_mag, mag[k]);
+            float ph = atan2f(im[k], re[k]);
+            advance[k] = k * expect + wrap(ph - last_phase[k] - k * expect);
+            last_phase[k] = ph;
+        }
+
+        // envelope: a moving average over about one harmonic either side
+        csum[0] = 0;
+        for (int k = 0; k < nbins; k++)
+            csum[k + 1] = csum[k] + mag[k];
+        float floor_mag = peak_mag * 1e-5f + 1e-20f;
+        for (int k = 0; k < nbins; k++)
+        {
+            int lo = std::max(0, k - env_width), hi = std::min(nbins, k + env_width + 1);
+            env[k] = (csum[hi] - csum[lo]) / (hi - lo) + floor_mag;
+            inv_env[k] = 1.f / env[k];
+        }
+
+        // peaks at least 80 dB up, each owning the bins out to halfway to its neighbours
+        int npeaks = 0;
+        float thresh = peak_mag * 1e-4f;
+        for (int k = 2; k < nbins - 2; k++)
+        {
+            float m = mag[k];
+            if (m > thresh && m > mag[k - 1] && m >= mag[k + 1] && m > mag[k - 2] && m >= mag[k + 2])
+                peak_bin[npeaks++] = k;
+        }
+        for (int p = 0; p < npeaks; p++)
+            region_end[p] = p + 1 < npeaks ? (peak_bin[p] + peak_bin[p + 1]) / 2 + 1 : nbins;
+
+        for (int b = 0; b < 4; b++)
+        {
+            memset(bus_re[b].data(), 0, nbins * sizeof(float));
+            memset(bus_im[b].data(), 0, nbins * sizeof(float));
+        }
+
+        bool used[4] = {false, false, false, false};
+        for (int v = 0; v < nvoices; v++)
+        {
+            const spectral_voice_t & sv = voices[v];
+            if ((sv.gain_l == 0 && sv.gain_r == 0) || npeaks == 0)
+            {
+                was_active[v] = false;
+                continue;
+            }
+
+            float * vrot = rot.data() + (size_t) v * nbins;
+            if (!was_active[v])
+                memset(vrot, 0, nbins * sizeof(float));
+            was_active[v] = true;
+
+            int b = sv.lead ? 0 : 2;
+            used[b] = used[b + 1] = true;
+            shift_voice(sv, vrot, npeaks, bus_re[b].data(), bus_im[b].data(), bus_re[b + 1].data(), bus_im[b + 1].data());
+        }
+
+        for (int b = 0; b < 4; b++)
+        {
+            float * o = ola[b].data();
+            memmove(o, o + hop, (nfft - hop) * sizeof(float));
+            memset(o + nfft - hop, 0, hop * sizeof(float));
+        }
+
+        // Hann in and out at a quarter hop sums to 1.5, and the inverse FFT scales by nfft
+        float scale = 1.f / (1.5f * nfft);
+        bool any = false;
+        for (int b = 0; b < 4; b++)
+        {
+            if (!used[b])
+                continue;
+            any = true;
+            bus_im[b][0] = 0;
+            bus_im[b][nbins - 1] = 0;
+            inv->run(frame.data(), bus_re[b].data(), bus_im[b].data(), work.data());
+            float * o = ola[b].data();
+            for (int k = 0; k < nfft; k++)
+                o[k] += frame[k] * window[k] * scale;
+        }
+        quiet_hops = any ? 0 : quiet_hops + 1;
+    }
+
+    /*
+        One voice: each peak's region moves by a whole number of bins to
+        land the peak at ratio times its frequency, turned by a rotation
+        that keeps advancing at the shifted frequency from hop to hop.
+    */
+    void shift_voice(const spectral_voice_t & sv, float * vrot, int npeaks,
+                     float * lre, float * lim, float * rre, float * rim)
+    {
+        float r = sv.ratio;
+        for (int p = 0; p < npeaks; p++)
+        {
+            int k = peak_bin[p];
+            peak_theta[p] = wrap(vrot[k] + (r - 1) * advance[k]);
+        }
+        spectral_sincos(peak_theta.data(), peak_sin.data(), peak_cos.data(), npeaks);
+
+        float fscale = 1.f / sv.formant;
+        int lo = 0;
+        for (int p = 0; p < npeaks; p++)
+        {
+            int kp = peak_bin[p];
+            int hi = region_end[p];
+            int shift = (int) lrintf(kp * r) - kp;
+            float theta = peak_theta[p];
+
+            // the region keeps its shape; the envelope only scales it as a whole
+            int e = std::min(nbins - 1, (int) ((kp + shift) * fscale + 0.5f));
+            float g = env[e] * inv_env[kp];
+            float c = peak_cos[p] * g, s = peak_sin[p] * g;
+            float lg = sv.gain_l, rg = sv.gain_r;
+
+            int k0 = std::max(lo, -shift), k1 = std::min(hi, nbins - shift);
+            for (int k = k0; k < k1; k++)
+            {
+                int dst = k + shift;
+                float yr = re[k] * c - im[k] * s;
+                float yi = re[k] * s + im[k] * c;
+                lre[dst] += lg * yr;
+                lim[dst] += lg * yi;
+                rre[dst] += rg * yr;
+                rim[dst] += rg * yi;
+            }
+            for (int k = lo; k < hi; k++)
+                vrot[k] = theta;
+            lo = hi;
+        }
+    }
+};
+
+#endif /* SpectralShifter_hpp */
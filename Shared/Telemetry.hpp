@@ -0,0 +1,61 @@
+//
+//  Telemetry.hpp
+//  Harmonizer
+//
+//  What the UI wants to know about the kernel, published once per render
+//  block through a seqlock. The render thread never waits; a reader that
+//  races with a publish just retries, and always ends up with one block's
+//  worth of consistent state instead of fields from two different blocks.
+//
+
+#ifndef Telemetry_hpp
+#define Telemetry_hpp
+
+#include <cstdint>
+
+#include "Meter.hpp"
+#include "Seqlock.hpp"
+
+#define TELEMETRY_NVOICES 21       // every kernel voice, auto-harmony then MIDI
+#define TELEMETRY_NAUTO 8
+
+typedef struct telemetry_voice_s
+{
+    int16_t midinote;       // -1 when the voice is off
+    float gain;
+    float ratio;
+} telemetry_voice_t;
+
+typedef struct telemetry_s
+{
+    uint64_t block;             // publish count, so readers can tell a fresh snapshot from a repeat
+    float midi_note_number;     // detected input note, -1 when unvoiced
+    float note_number;          // pitch class plus cents, -1 when unvoiced
+    float period;               // detected period in samples
+    float rms;                  // input level over the block
+    int32_t voiced;
+    int32_t root_key;           // key center, root + 12 * quality
+    int32_t chord_quality;
+    int32_t voice_notes[TELEMETRY_NAUTO];   // the auto-harmony notes, -1 for voices not in use
+    telemetry_voice_t voices[TELEMETRY_NVOICES];
+    uint64_t keys_down[2];      // held MIDI keys, one bit per key
+
+    // meters, updated every block
+    meter_reading_t input;
+    meter_reading_t output[2];
+    meter_reading_t lead;       // the corrected lead voice, before its gain
+    meter_reading_t harmony;    // all harmony voices, before the harmony gain
+    float gate_gain;            // 1 while the gate passes the input, 0 while it mutes
+} telemetry_t;
+
+#define SPECTRUM_BANDS 64
+
+// log-spaced magnitude spectrum of the input, from the pitch tracker's FFT
+typedef struct spectrum_s
+{
+    uint64_t hop;               // spectra published so far; stops moving while the gate is shut
+    float fmin, fmax;           // band edges run geometrically from fmin to fmax
+    float db[SPECTRUM_BANDS];   // strongest bin in each band, dB re full-scale sine
+} spectrum_t;
+
+#endif /* Telemetry_hpp */
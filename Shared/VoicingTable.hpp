@@ -0,0 +1,92 @@
+//
+//  VoicingTable.hpp
+//  Harmonizer
+//
+//  The auto-harmony intervals as one block of qualities x degrees x voices,
+//  allocated once when the kernel is made. The voices for one scale degree
+//  are adjacent, so picking a voicing for the sung note is a single row
+//  lookup however many voices there are. semitone_ratios() turns a hop's
+//  worth of pitch errors into resampling ratios in one pass, with a
+//  polynomial exp2 that vectorizes where there's no vForce.
+//
+
+#ifndef VoicingTable_hpp
+#define VoicingTable_hpp
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef __APPLE__
+#include <Accelerate/Accelerate.h>
+#endif
+
+class VoicingTable {
+public:
+    VoicingTable(int voices, int qualities, int degrees)
+        : nv(voices), nq(qualities), nd(degrees)
+    {
+        cells = (int32_t *) calloc((size_t) size(), sizeof(int32_t));
+    }
+
+    ~VoicingTable() { free(cells); }
+
+    VoicingTable(const VoicingTable &) = delete;
+    VoicingTable & operator=(const VoicingTable &) = delete;
+
+    int voices() const { return nv; }
+    int qualities() const { return nq; }
+    int degrees() const { return nd; }
+    int size() const { return nv * nq * nd; }
+
+    int getInterval(int voice, int quality, int degree) const { return cells[index(voice, quality, degree)]; }
+    void setInterval(int voice, int quality, int degree, int semitones) { cells[index(voice, quality, degree)] = semitones; }
+    int32_t * cell(int voice, int quality, int degree) { return cells + index(voice, quality, degree); }
+
+    // the voices for one degree, in voice order
+    const int32_t * row(int quality, int degree) const { return cells + index(0, quality, degree); }
+
+    // quality-major, then degree, then voice
+    int32_t * data() { return cells; }
+    const int32_t * data() const { return cells; }
+
+private:
+    int nv, nq, nd;
+    int32_t * cells = NULL;
+
+    int index(int voice, int quality, int degree) const
+    {
+        return (quality * nd + degree) * nv + voice;
+    }
+};
+
+/*
+    ratio[k] = 2^(semis[k] / 12), in place is fine. Elsewhere than Apple the
+    exponent is split at the nearest integer and the fraction goes through a
+    degree 6 polynomial, good to about 3e-7 relative, with no branches or
+    library calls in the loop.
+*/
+static inline void semitone_ratios(const float * semis, float * ratio, int n)
+{
+#ifdef __APPLE__
+    float twelfth = 1.f / 12.f;
+    vDSP_vsmul(semis, 1, &twelfth, ratio, 1, (vDSP_Length) n);
+    vvexp2f(ratio, ratio, &n);
+#else
+    for (int k = 0; k < n; k++)
+    {
+        float x = std::min(std::max(semis[k] * (1.f / 12.f), -126.f), 126.f);
+        float r = (x + 12582912.f) - 12582912.f;   // round to nearest, 1.5 * 2^23
+        float f = x - r;                            // -0.5..0.5
+        float p = 1.f + f * (0.69314718f + f * (0.24022651f + f * (0.05550411f
+            + f * (0.00961813f + f * (0.00133336f + f * 0.00015404f)))));
+        int32_t e = ((int32_t) r + 127) << 23;
+        float scale;
+        memcpy(&scale, &e, sizeof(scale));
+        ratio[k] = p * scale;
+    }
+#endif
+}
+
+#endif /* VoicingTable_hpp */
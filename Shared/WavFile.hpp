@@ -0,0 +1,295 @@
+//
+//  WavFile.hpp
+//  Harmonizer
+//
+//  Minimal RIFF/WAVE support for offline rendering and recording.
+//  WavReader memory-maps the file and converts on demand, so reading costs
+//  nothing up front and pages come in as the renderer walks the file.
+//  WavWriter always writes 32-bit float and patches the sizes on close.
+//
+
+#ifndef WavFile_hpp
+#define WavFile_hpp
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef struct wav_format_s
+{
+    int channels;
+    int sample_rate;
+    int bits;
+    int is_float;
+} wav_format_t;
+
+class WavReader {
+public:
+    WavReader() {}
+    ~WavReader() { close(); }
+
+    bool open(const char * path)
+    {
+        close();
+
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0)
+            return false;
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < 44)
+        {
+            ::close(fd);
+            return false;
+        }
+
+        map_size = (size_t) st.st_size;
+        map = (const uint8_t *) mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+
+        if (map == MAP_FAILED)
+        {
+            map = NULL;
+            return false;
+        }
+        madvise((void *) map, map_size, MADV_SEQUENTIAL);
+
+        if (!parse())
+        {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close()
+    {
+        if (map)
+            munmap((void *) map, map_size);
+        map = NULL;
+        data = NULL;
+        nframes = 0;
+    }
+
+    const wav_format_t & format() const { return fmt; }
+    size_t frames() const { return nframes; }
+    double duration() const { return (double) nframes / fmt.sample_rate; }
+
+    // raw bytes of the sample data, e.g. for hashing
+    const uint8_t * dataBytes() const { return data; }
+    size_t dataSize() const { return nframes * frame_bytes; }
+
+    /*
+        Convert n frames starting at frame start to planar float.
+        With nout == 1 all file channels are averaged into out[0];
+        otherwise channel k goes to out[k] and extra outputs get channel 0.
+        Returns the number of frames converted.
+    */
+    size_t read(size_t start, size_t n, float * const * out, int nout) const
+    {
+        if (start >= nframes)
+            return 0;
+        if (n > nframes - start)
+            n = nframes - start;
+
+        const uint8_t * p = data + start * frame_bytes;
+        int bps = fmt.bits / 8;
+        float downmix = 1.f / fmt.channels;
+
+        for (size_t i = 0; i < n; i++)
+        {
+            float mono = 0.f;
+            for (int ch = 0; ch < fmt.channels; ch++)
+            {
+                float x = sample(p + ch * bps);
+                if (nout == 1)
+                    mono += x * downmix;
+                else if (ch < nout)
+                    out[ch][i] = x;
+            }
+            if (nout == 1)
+                out[0][i] = mono;
+            else
+            {
+                for (int ch = fmt.channels; ch < nout; ch++)
+                    out[ch][i] = out[0][i];
+            }
+            p += frame_bytes;
+        }
+        return n;
+    }
+
+private:
+    const uint8_t * map = NULL;
+    size_t map_size = 0;
+    const uint8_t * data = NULL;
+    size_t nframes = 0;
+    size_t frame_bytes = 0;
+    wav_format_t fmt = {0, 0, 0, 0};
+
+    static uint32_t le32(const uint8_t * p) { return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24); }
+    static uint16_t le16(const uint8_t * p) { return (uint16_t) (p[0] | (p[1] << 8)); }
+
+    float sample(const uint8_t * p) const
+    {
+        switch (fmt.bits)
+        {
+            case 8:
+                return ((float) p[0] - 128.f) / 128.f;
+            case 16:
+                return (float) (int16_t) le16(p) / 32768.f;
+            case 24:
+                return (float) ((int32_t) ((p[0] << 8) | (p[1] << 16) | ((uint32_t) p[2] << 24)) >> 8) / 8388608.f;
+            case 32:
+                if (fmt.is_float)
+                {
+                    float f;
+                    memcpy(&f, p, 4);
+                    return f;
+                }
+                return (float) (int32_t) le32(p) / 2147483648.f;
+            default:
+                return 0.f;
+        }
+    }
+
+    bool parse()
+    {
+        if (memcmp(map, "RIFF", 4) != 0 || memcmp(map + 8, "WAVE", 4) != 0)
+            return false;
+
+        bool have_fmt = false;
+        size_t pos = 12;
+
+        while (pos + 8 <= map_size)
+        {
+            const uint8_t * chunk = map + pos;
+            size_t len = le32(chunk + 4);
+
+            if (memcmp(chunk, "fmt ", 4) == 0 && len >= 16)
+            {
+                int tag = le16(chunk + 8);
+                fmt.channels = le16(chunk + 10);
+                fmt.sample_rate = (int) le32(chunk + 12);
+                fmt.bits = le16(chunk + 22);
+                if (tag == 0xFFFE && len >= 40)
+                    tag = le16(chunk + 32); // WAVE_FORMAT_EXTENSIBLE subformat
+                fmt.is_float = (tag == 3);
+                if ((tag != 1 && tag != 3) || fmt.channels < 1)
+                    return false;
+                have_fmt = true;
+            }
+            else if (memcmp(chunk, "data", 4) == 0 && have_fmt)
+            {
+                frame_bytes = (size_t) fmt.channels * (fmt.bits / 8);
+                if (frame_bytes == 0)
+                    return false;
+                // tolerate writers that leave the size unpatched
+                if (pos + 8 + len > map_size)
+                    len = map_size - pos - 8;
+                data = chunk + 8;
+                nframes = len / frame_bytes;
+                return true;
+            }
+
+            pos += 8 + len + (len & 1);
+        }
+        return false;
+    }
+};
+
+class WavWriter {
+public:
+    WavWriter() {}
+    ~WavWriter() { close(); }
+
+    bool open(const char * path, int channels, int sample_rate)
+    {
+        close();
+        fp = fopen(path, "wb");
+        if (!fp)
+            return false;
+
+        nch = channels;
+        rate = sample_rate;
+        nframes = 0;
+        writeHeader();
+        return true;
+    }
+
+    // interleave and append n frames from nch planar buffers
+    bool write(const float * const * in, size_t n)
+    {
+        if (!fp)
+            return false;
+        if (interleaved.size() < n * nch)
+            interleaved.resize(n * nch);
+
+        for (size_t i = 0; i < n; i++)
+        {
+            for (int ch = 0; ch < nch; ch++)
+                interleaved[i * nch + ch] = in[ch][i];
+        }
+        return writeInterleaved(interleaved.data(), n);
+    }
+
+    bool writeInterleaved(const float * frames, size_t n)
+    {
+        if (!fp)
+            return false;
+        size_t wrote = fwrite(frames, sizeof(float) * nch, n, fp);
+        nframes += wrote;
+        return wrote == n;
+    }
+
+    void close()
+    {
+        if (!fp)
+            return;
+        fseek(fp, 0, SEEK_SET);
+        writeHeader();
+        fclose(fp);
+        fp = NULL;
+    }
+
+    size_t frames() const { return nframes; }
+
+private:
+    FILE * fp = NULL;
+    int nch = 0;
+    int rate = 0;
+    size_t nframes = 0;
+    std::vector<float> interleaved;
+
+    static void put32(uint8_t * p, uint32_t v) { p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24; }
+    static void put16(uint8_t * p, uint16_t v) { p[0] = v; p[1] = v >> 8; }
+
+    void writeHeader()
+    {
+        uint8_t h[44];
+        uint32_t data_bytes = (uint32_t) (nframes * nch * sizeof(float));
+
+        memcpy(h, "RIFF", 4);
+        put32(h + 4, 36 + data_bytes);
+        memcpy(h + 8, "WAVEfmt ", 8);
+        put32(h + 16, 16);
+        put16(h + 20, 3); // IEEE float
+        put16(h + 22, (uint16_t) nch);
+        put32(h + 24, (uint32_t) rate);
+        put32(h + 28, (uint32_t) (rate * nch * sizeof(float)));
+        put16(h + 32, (uint16_t) (nch * sizeof(float)));
+        put16(h + 34, 32);
+        memcpy(h + 36, "data", 4);
+        put32(h + 40, data_bytes);
+
+        fwrite(h, 1, sizeof(h), fp);
+    }
+};
+
+#endif /* WavFile_hpp */